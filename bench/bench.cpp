@@ -0,0 +1,312 @@
+/*
+* Redox - A modern, asynchronous, and wicked fast C++11 client for Redis
+*
+*    https://github.com/hmartiro/redox
+*
+* Copyright 2015 - Hayk Martirosyan <hayk.mart at gmail dot com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+/**
+* Microbenchmarks of Redox on Google Benchmark. Those that talk to Redis
+* expect a server on localhost:6379, like the test suite, and are skipped
+* without one. For machine-readable results:
+*
+*   ./bench_redox --benchmark_out=results.json --benchmark_out_format=json
+*/
+
+#include <iostream>
+#include <cstdlib>
+#include <benchmark/benchmark.h>
+
+#include "redox.hpp"
+#include "mock_server.hpp"
+
+using namespace std;
+using redox::Redox;
+using redox::Command;
+using redox::Subscriber;
+using redox::BoundedQueue;
+using redox::Histogram;
+using redox::MockServer;
+
+namespace {
+
+// Replies are pipelined in batches of this many commands
+const int BATCH = 100;
+
+const string KEY_STRING = "redox_bench:string";
+const string KEY_LIST = "redox_bench:list";
+const string KEY_MISSING = "redox_bench:missing";
+const string CHANNEL = "redox_bench:channel";
+
+/**
+* Returns a client connected to the local server, with the keys used by
+* the benchmarks set up, or nullptr after skipping the benchmark.
+*/
+Redox *client(benchmark::State &state) {
+
+  static Redox rdx(cerr, redox::log::Error);
+  static bool connected = false;
+  static bool tried = false;
+
+  if (!tried) {
+    tried = true;
+    connected = rdx.connect("localhost", 6379);
+    if (connected) {
+      rdx.set(KEY_STRING, string(100, 'x'));
+      rdx.del(KEY_LIST);
+      vector<string> rpush = {"RPUSH", KEY_LIST};
+      for (int i = 0; i < 100; i++)
+        rpush.push_back("element:" + to_string(i));
+      rdx.commandSync(rpush);
+      rdx.del(KEY_MISSING);
+    }
+  }
+
+  if (!connected) {
+    state.SkipWithError("Could not connect to Redis on localhost:6379");
+    return nullptr;
+  }
+  return &rdx;
+}
+
+/**
+* Sends [cmd] in pipelined batches, and waits for each batch of replies.
+*/
+template <class ReplyT> void runPipelined(benchmark::State &state, const vector<string> &cmd) {
+
+  Redox *rdx = client(state);
+  if (rdx == nullptr)
+    return;
+
+  atomic_int pending(0);
+  atomic_int errors(0);
+  auto callback = [&pending, &errors](Command<ReplyT> &c) {
+    if (!c.ok() && (c.status() != Command<ReplyT>::NIL_REPLY))
+      errors++;
+    pending--;
+  };
+
+  for (auto _ : state) {
+    pending = BATCH;
+    for (int i = 0; i < BATCH; i++)
+      rdx->command<ReplyT>(cmd, callback);
+    while (pending > 0)
+      this_thread::yield();
+  }
+
+  if (errors > 0)
+    state.SkipWithError("Got error replies");
+  state.SetItemsProcessed(state.iterations() * BATCH);
+}
+
+} // namespace
+
+// -------------------------------------------
+// Without a server
+// -------------------------------------------
+
+static void BM_FormatResp(benchmark::State &state) {
+  vector<string> cmd = {"SET", KEY_STRING, string(state.range(0), 'x')};
+  string buf;
+  for (auto _ : state) {
+    buf.clear();
+    redox::resp::appendCommand(buf, cmd);
+    benchmark::DoNotOptimize(buf.data());
+  }
+  state.SetBytesProcessed(state.iterations() * buf.size());
+}
+BENCHMARK(BM_FormatResp)->Range(8, 8 << 10);
+
+static void BM_FormatArgs(benchmark::State &state) {
+  string value(state.range(0), 'x');
+  string buf;
+  for (auto _ : state) {
+    buf.clear();
+    redox::resp::appendCommandArgs(buf, "SET", KEY_STRING, value, 42);
+    benchmark::DoNotOptimize(buf.data());
+  }
+  state.SetBytesProcessed(state.iterations() * buf.size());
+}
+BENCHMARK(BM_FormatArgs)->Range(8, 8 << 10);
+
+static void BM_FormatHiredis(benchmark::State &state) {
+  vector<string> cmd = {"SET", KEY_STRING, string(state.range(0), 'x')};
+  const char *argv[] = {cmd[0].data(), cmd[1].data(), cmd[2].data()};
+  const size_t argvlen[] = {cmd[0].size(), cmd[1].size(), cmd[2].size()};
+  int len = 0;
+  for (auto _ : state) {
+    char *buf;
+    len = redisFormatCommandArgv(&buf, 3, argv, argvlen);
+    benchmark::DoNotOptimize(buf);
+    free(buf);
+  }
+  state.SetBytesProcessed(state.iterations() * len);
+}
+BENCHMARK(BM_FormatHiredis)->Range(8, 8 << 10);
+
+static void BM_BoundedQueueHandoff(benchmark::State &state) {
+  BoundedQueue<string> q(1024);
+  string in(32, 'x');
+  string out;
+  for (auto _ : state) {
+    q.push(string(in));
+    q.pop(out);
+    benchmark::DoNotOptimize(out.data());
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_BoundedQueueHandoff);
+
+static void BM_HistogramRecord(benchmark::State &state) {
+  Histogram h;
+  uint64_t value = 12345;
+  for (auto _ : state) {
+    h.record(value);
+    value = value * 6364136223846793005ull + 1442695040888963407ull;
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_HistogramRecord);
+
+// Redox alone, against the in-process mock server with canned replies
+static void BM_MockPipelined(benchmark::State &state) {
+  static MockServer server;
+  static Redox rdx(cerr, redox::log::Error);
+  static bool connected = false;
+  if (!connected) {
+    server.reply("GET", MockServer::bulk(string(100, 'x')));
+    connected = server.start() && rdx.connect("127.0.0.1", server.port());
+  }
+  if (!connected) {
+    state.SkipWithError("Could not start the mock server");
+    return;
+  }
+
+  atomic_int pending(0);
+  vector<string> cmd = {"GET", KEY_STRING};
+  for (auto _ : state) {
+    pending = BATCH;
+    for (int i = 0; i < BATCH; i++)
+      rdx.command<string>(cmd, [&pending](Command<string> &c) { pending--; });
+    while (pending > 0)
+      this_thread::yield();
+  }
+  state.SetItemsProcessed(state.iterations() * BATCH);
+}
+BENCHMARK(BM_MockPipelined)->UseRealTime();
+
+// -------------------------------------------
+// With a server
+// -------------------------------------------
+
+// A command that gets a reply of each type
+template <class ReplyT> vector<string> replyCommand();
+template <> vector<string> replyCommand<redisReply *>() { return {"LRANGE", KEY_LIST, "0", "-1"}; }
+template <> vector<string> replyCommand<string>() { return {"GET", KEY_STRING}; }
+template <> vector<string> replyCommand<char *>() { return {"GET", KEY_STRING}; }
+template <> vector<string> replyCommand<int>() { return {"STRLEN", KEY_STRING}; }
+template <> vector<string> replyCommand<long long int>() { return {"STRLEN", KEY_STRING}; }
+template <> vector<string> replyCommand<nullptr_t>() { return {"GET", KEY_MISSING}; }
+template <> vector<string> replyCommand<vector<string>>() {
+  return {"LRANGE", KEY_LIST, "0", "-1"};
+}
+template <> vector<string> replyCommand<set<string>>() { return {"LRANGE", KEY_LIST, "0", "-1"}; }
+template <> vector<string> replyCommand<unordered_set<string>>() {
+  return {"LRANGE", KEY_LIST, "0", "-1"};
+}
+
+// Command creation, handoff to the event loop, round trip and reply
+// parsing, for each reply type
+template <class ReplyT> static void BM_Reply(benchmark::State &state) {
+  runPipelined<ReplyT>(state, replyCommand<ReplyT>());
+}
+BENCHMARK_TEMPLATE(BM_Reply, redisReply *)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_Reply, string)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_Reply, char *)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_Reply, int)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_Reply, long long int)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_Reply, nullptr_t)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_Reply, vector<string>)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_Reply, set<string>)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_Reply, unordered_set<string>)->UseRealTime();
+
+// Handoff of fire-and-forget commands, drained by a round trip per batch
+static void BM_Fire(benchmark::State &state) {
+  Redox *rdx = client(state);
+  if (rdx == nullptr)
+    return;
+
+  vector<string> cmd = {"GET", KEY_STRING};
+  for (auto _ : state) {
+    for (int i = 0; i < BATCH; i++)
+      rdx->fire(cmd);
+    rdx->commandSync({"PING"});
+  }
+  state.SetItemsProcessed(state.iterations() * BATCH);
+}
+BENCHMARK(BM_Fire)->UseRealTime();
+
+// Messages published and dispatched to a Subscriber callback
+static void BM_SubscriberDispatch(benchmark::State &state) {
+  Redox *rdx = client(state);
+  if (rdx == nullptr)
+    return;
+
+  Subscriber sub(cerr, redox::log::Error);
+  if (!sub.connect("localhost", 6379)) {
+    state.SkipWithError("Could not connect the Subscriber");
+    return;
+  }
+
+  atomic_long received(0);
+  atomic_bool subscribed(false);
+  sub.subscribe(CHANNEL, [&received](const string &topic, const string &msg) { received++; },
+                [&subscribed](const string &topic) { subscribed = true; });
+  while (!subscribed)
+    this_thread::yield();
+
+  string msg(32, 'x');
+  long sent = 0;
+  for (auto _ : state) {
+    for (int i = 0; i < BATCH; i++)
+      rdx->publish(CHANNEL, msg);
+    sent += BATCH;
+    while (received < sent)
+      this_thread::yield();
+  }
+
+  sub.disconnect();
+  state.SetItemsProcessed(state.iterations() * BATCH);
+}
+BENCHMARK(BM_SubscriberDispatch)->UseRealTime();
+
+// One synchronous command at a time
+static void BM_SyncRoundTrip(benchmark::State &state) {
+  Redox *rdx = client(state);
+  if (rdx == nullptr)
+    return;
+
+  for (auto _ : state) {
+    if (!rdx->commandSync({"PING"})) {
+      state.SkipWithError("PING failed");
+      break;
+    }
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_SyncRoundTrip)->UseRealTime();
+
+BENCHMARK_MAIN();
@@ -43,6 +43,14 @@ int main(int argc, char* argv[]) {
   else cerr << "Failed to get key! Status: " << c2.status() << endl;
   c2.free();
 
+  // A large value, written from where it is and released when done
+  string* large_data = new string(random_string(1000000));
+  auto& c3 = rdx.commandSync<string>(redox::cmd("SET", binary_key,
+    redox::Buffer(large_data->data(), large_data->size(), [large_data] { delete large_data; })));
+  if(c3.ok()) cout << "Reply: " << c3.reply() << endl;
+  else cerr << "Failed to set large key! Status: " << c3.status() << endl;
+  c3.free();
+
   rdx.disconnect();
   return 0;
 }
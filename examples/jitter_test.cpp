@@ -4,7 +4,10 @@
 
 #include <iostream>
 #include <iomanip>
+#include <sstream>
+#include <cmath>
 #include <string.h>
+#include <sched.h>
 #include "redox.hpp"
 
 using namespace std;
@@ -17,6 +20,12 @@ double time_s() {
   return (double)ms / 1e6;
 }
 
+// Deviation of the time between replies from the period, and age of data,
+// in microseconds, summarized at the end to compare pinned and unpinned runs
+redox::Histogram callback_jitter;
+redox::Histogram data_age;
+double period;
+
 /**
 * Prints time statistics on the received reply.
 *
@@ -32,14 +41,37 @@ void print_time(double t, double dt_callback, double dt_msg, double age_of_data)
       << " | dt callback: " << dt_callback * 1000
       << " | dt msg: " << dt_msg * 1000
       << " | age of data: " << age_of_data * 1000 << endl;
+
+  callback_jitter.record((uint64_t)(fabs(dt_callback - period) * 1e6));
+  data_age.record((uint64_t)(max(age_of_data, 0.0) * 1e6));
+}
+
+void print_summary(const string &name, const redox::Histogram &h) {
+  redox::Histogram::Snapshot s = h.snapshot();
+  if (s.count == 0) return;
+  cerr << name << " (us): mean " << s.mean()
+      << " | p50 " << s.percentile(0.5)
+      << " | p99 " << s.percentile(0.99)
+      << " | p99.9 " << s.percentile(0.999)
+      << " | max " << s.max << endl;
+}
+
+// Parses a list of CPUs like "2,3"
+vector<int> parse_cpus(const string &list) {
+  vector<int> cpus;
+  stringstream ss(list);
+  string cpu;
+  while (getline(ss, cpu, ',')) cpus.push_back(stoi(cpu));
+  return cpus;
 }
 
 int main(int argc, char* argv[]) {
 
   string usage_string = "Usage: " + string(argv[0])
-      + " --(set-async|get-async|set-sync|get-sync|get-pubsub|set-pubsub) [freq]";
+      + " --(set-async|get-async|set-sync|get-sync|get-pubsub|set-pubsub) [freq] [trace_file]"
+      + " [--count=N] [--pin=CPU,...] [--fifo=PRIORITY]";
 
-  if(argc != 3) {
+  if(argc < 3) {
     cerr << usage_string<< endl;
     return 1;
   }
@@ -47,16 +79,41 @@ int main(int argc, char* argv[]) {
   bool nowait = true;
   std::string host = "localhost";
   int port = 6379;
+  int iter = 1000000;
+
+  // Run once as is and once pinned to compare, for example with --pin=3 --fifo=50
+  redox::ThreadOptions placement;
+  string trace_file;
+  for(int i = 3; i < argc; i++) {
+    string arg = argv[i];
+    if(arg.compare(0, 8, "--count=") == 0) iter = stoi(arg.substr(8));
+    else if(arg.compare(0, 6, "--pin=") == 0) placement.cpus = parse_cpus(arg.substr(6));
+    else if(arg.compare(0, 7, "--fifo=") == 0) {
+      placement.policy = SCHED_FIFO;
+      placement.priority = stoi(arg.substr(7));
+    }
+    else if(arg.compare(0, 2, "--") != 0 && trace_file.empty()) trace_file = arg;
+    else {
+      cerr << usage_string << endl;
+      return 1;
+    }
+  }
+  placement.numa_local = !placement.cpus.empty();
 
   Redox rdx;
   if(nowait) rdx.noWait(true);
+  rdx.threadOptions(placement);
+
+  // Timeline of every command, to see which stage adds the latency
+  if(!trace_file.empty() && !rdx.traceFile(trace_file)) return 1;
 
   Subscriber rdx_sub;
   if(nowait) rdx_sub.noWait(true);
+  rdx_sub.threadOptions(placement);
 
   double freq = stod(argv[2]); // Hz
   double dt = 1 / freq; // s
-  int iter = 1000000;
+  period = dt;
   atomic_int count(0);
 
   double t0 = time_s();
@@ -197,7 +254,7 @@ int main(int argc, char* argv[]) {
       t_last_reply = t_this_reply;
 
       count++;
-      if (count == iter) rdx.stop();
+      if (count == iter) rdx_sub.stop();
     };
 
     rdx_sub.subscribe("jitter_test:time", got_message);
@@ -226,8 +283,12 @@ int main(int argc, char* argv[]) {
     return 1;
   }
 
-  rdx.wait();
-  rdx_sub.wait();
+  // Only the client this mode connected ever stops, so wait on that one
+  if(!strcmp(argv[1], "--get-pubsub")) rdx_sub.wait();
+  else rdx.wait();
+
+  print_summary("dt callback jitter", callback_jitter);
+  print_summary("age of data", data_age);
 
   return 0;
 };
@@ -0,0 +1,212 @@
+/**
+* Redox load generator
+* --------------------
+* Sends commands at a fixed target rate from a schedule (open loop) and
+* measures each latency from the time the command was meant to be sent, not
+* from when it was actually sent. A client that stalls keeps falling behind
+* its schedule instead of quietly sending less, so the stall shows up in the
+* percentiles (no coordinated omission).
+*
+* Runs every combination of the given connection counts, pipelining depths
+* (the most commands in flight per connection) and value sizes.
+*/
+
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include "redox.hpp"
+#include "mock_server.hpp"
+
+using namespace std;
+using redox::Redox;
+using redox::Command;
+using redox::Histogram;
+using redox::MockServer;
+
+typedef chrono::steady_clock Clock;
+
+struct Options {
+  string host = "localhost";
+  int port = 6379;
+  bool mock = false;
+  string command = "get";
+  double rate = 10000; // Commands per second, over all connections
+  double duration = 5; // Seconds per run
+  vector<int> connections = {1};
+  vector<int> pipeline = {1, 16, 128};
+  vector<int> sizes = {100};
+};
+
+vector<int> parseList(const string &s) {
+  vector<int> values;
+  stringstream ss(s);
+  string item;
+  while (getline(ss, item, ','))
+    values.push_back(stoi(item));
+  return values;
+}
+
+struct Result {
+  Histogram latency; // Nanoseconds from the intended send time
+  atomic_long sent = {0};
+  atomic_long errors = {0};
+  atomic_long late = {0}; // Sent after their intended time had passed
+};
+
+/**
+* Sends on one connection, at [rate] per second until [end], with at most
+* [depth] commands in flight.
+*/
+void runSender(Redox &rdx, const vector<string> &cmd, double rate, int depth,
+               Clock::time_point start, Clock::time_point end, atomic_int &in_flight,
+               Result &result) {
+
+  auto interval = chrono::duration_cast<Clock::duration>(chrono::duration<double>(1 / rate));
+
+  for (long k = 0;; k++) {
+
+    Clock::time_point intended = start + k * interval;
+    if (intended >= end)
+      break;
+
+    // Sleep most of the way, then spin, to send on time
+    auto now = Clock::now();
+    if (intended - now > chrono::microseconds(200))
+      this_thread::sleep_until(intended - chrono::microseconds(100));
+    while (Clock::now() < intended) {
+    }
+
+    // A full pipeline delays sending, and that delay counts as latency
+    while (in_flight >= depth)
+      this_thread::yield();
+    if (Clock::now() - intended > interval)
+      result.late++;
+
+    in_flight++;
+    result.sent++;
+    rdx.command<redisReply *>(cmd, [intended, &in_flight, &result](Command<redisReply *> &c) {
+      if (!c.ok())
+        result.errors++;
+      result.latency.record(
+          chrono::duration_cast<chrono::nanoseconds>(Clock::now() - intended).count());
+      in_flight--;
+    });
+  }
+
+  // Wait for the stragglers
+  for (int i = 0; (i < 10000) && (in_flight > 0); i++)
+    this_thread::sleep_for(chrono::milliseconds(1));
+}
+
+bool runOnce(const Options &opt, int connections, int depth, int size) {
+
+  string key = "load_generator:key";
+  string value(size, 'x');
+  vector<string> cmd;
+  if (opt.command == "set")
+    cmd = {"SET", key, value};
+  else
+    cmd = {"GET", key};
+
+  vector<unique_ptr<Redox>> clients;
+  for (int i = 0; i < connections; i++) {
+    clients.emplace_back(new Redox(cerr, redox::log::Error));
+    clients.back()->noWait(true);
+    if (!clients.back()->connect(opt.host, opt.port)) {
+      cerr << "Could not connect to " << opt.host << ":" << opt.port << endl;
+      return false;
+    }
+  }
+  clients[0]->set(key, value);
+
+  // Outlive any callbacks, until the clients are disconnected
+  Result result;
+  unique_ptr<atomic_int[]> in_flight(new atomic_int[connections]);
+
+  auto start = Clock::now() + chrono::milliseconds(10);
+  auto end = start + chrono::duration_cast<Clock::duration>(chrono::duration<double>(opt.duration));
+
+  vector<thread> senders;
+  for (int i = 0; i < connections; i++) {
+    // Stagger the schedules of the connections evenly
+    auto offset = chrono::duration_cast<Clock::duration>(
+        chrono::duration<double>((double)i / opt.rate));
+    in_flight[i] = 0;
+    senders.emplace_back(runSender, ref(*clients[i]), cref(cmd), opt.rate / connections, depth,
+                         start + offset, end, ref(in_flight[i]), ref(result));
+  }
+  for (thread &t : senders)
+    t.join();
+
+  for (auto &rdx : clients)
+    rdx->disconnect();
+
+  Histogram::Snapshot s = result.latency.snapshot();
+  cout << setw(6) << connections << setw(9) << depth << setw(8) << size << setw(11)
+       << (long)(s.count / opt.duration) << fixed << setprecision(3) << setw(10)
+       << s.percentile(0.5) / 1e3 << setw(10) << s.percentile(0.99) / 1e3 << setw(11)
+       << s.percentile(0.999) / 1e3 << setw(11) << s.max / 1e3 << setw(8) << result.errors
+       << setw(8) << result.late << endl;
+  return true;
+}
+
+int main(int argc, char *argv[]) {
+
+  string usage_string =
+      "Usage: " + string(argv[0]) +
+      " [--host host] [--port port] [--mock] [--command get|set] [--rate per_second]\n"
+      "       [--duration seconds] [--connections 1,4] [--pipeline 1,16,128] [--sizes 100]";
+
+  Options opt;
+  for (int i = 1; i < argc; i++) {
+    string arg = argv[i];
+    bool has_value = (i + 1 < argc);
+    if (arg == "--mock") {
+      opt.mock = true;
+    } else if (arg == "--host" && has_value) {
+      opt.host = argv[++i];
+    } else if (arg == "--port" && has_value) {
+      opt.port = stoi(argv[++i]);
+    } else if (arg == "--command" && has_value) {
+      opt.command = argv[++i];
+    } else if (arg == "--rate" && has_value) {
+      opt.rate = stod(argv[++i]);
+    } else if (arg == "--duration" && has_value) {
+      opt.duration = stod(argv[++i]);
+    } else if (arg == "--connections" && has_value) {
+      opt.connections = parseList(argv[++i]);
+    } else if (arg == "--pipeline" && has_value) {
+      opt.pipeline = parseList(argv[++i]);
+    } else if (arg == "--sizes" && has_value) {
+      opt.sizes = parseList(argv[++i]);
+    } else {
+      cerr << usage_string << endl;
+      return 1;
+    }
+  }
+
+  // Measure Redox alone, without a real server
+  MockServer server;
+  if (opt.mock) {
+    if (!server.start()) {
+      cerr << "Could not start the mock server." << endl;
+      return 1;
+    }
+    opt.host = "127.0.0.1";
+    opt.port = server.port();
+  }
+
+  cout << "Open loop at " << opt.rate << " " << opt.command << "/s for " << opt.duration
+       << "s per run, latencies in us from the intended send time." << endl;
+  cout << setw(6) << "conns" << setw(9) << "pipeline" << setw(8) << "size" << setw(11)
+       << "done/s" << setw(10) << "p50" << setw(10) << "p99" << setw(11) << "p99.9"
+       << setw(11) << "max" << setw(8) << "errors" << setw(8) << "late" << endl;
+
+  for (int connections : opt.connections)
+    for (int depth : opt.pipeline)
+      for (int size : opt.sizes)
+        if (!runOnce(opt, connections, depth, size))
+          return 1;
+
+  return 0;
+}
@@ -29,8 +29,7 @@ int main(int argc, char *argv[]) {
   };
 
   subscriber.psubscribe("news", got_message, subscribed, unsubscribed);
-  subscriber.subscribe("sports", got_message, subscribed, unsubscribed);
-  subscriber.subscribe("other", got_message, subscribed, unsubscribed);
+  subscriber.subscribe({"sports", "other"}, got_message, subscribed, unsubscribed);
 
   this_thread::sleep_for(chrono::milliseconds(10));
 
@@ -23,3 +23,9 @@
 #include "redox/client.hpp"
 #include "redox/command.hpp"
 #include "redox/subscriber.hpp"
+#include "redox/multiplexer.hpp"
+#include "redox/sharded.hpp"
+#include "redox/streams.hpp"
+#include "redox/metrics.hpp"
+#include "redox/event_loop.hpp"
+#include "redox/backend.hpp"
@@ -0,0 +1,319 @@
+/*
+* Redox - A modern, asynchronous, and wicked fast C++11 client for Redis
+*
+*    https://github.com/hmartiro/redox
+*
+* Copyright 2015 - Hayk Martirosyan <hayk.mart at gmail dot com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#pragma once
+
+#include <stddef.h>
+#include <sys/uio.h>
+#include <memory>
+#include <vector>
+#include <deque>
+
+#include <ev.h>
+#include <hiredis/hiredis.h>
+#include <hiredis/async.h>
+
+#ifdef REDOX_IO_URING
+struct io_uring_sqe;
+struct io_uring_cqe;
+#endif
+
+namespace redox {
+
+/**
+* Options of the socket of a connection, set when connecting.
+*/
+struct SocketOptions {
+
+  // Disable Nagle's algorithm (TCP_NODELAY), as hiredis does by default. TCP only.
+  bool no_delay = true;
+
+  // Kernel send and receive buffer sizes in bytes (SO_SNDBUF, SO_RCVBUF), zero
+  // for the system defaults
+  int send_buffer = 0;
+  int receive_buffer = 0;
+
+  // Busy poll the device queue for up to [busy_poll_us] microseconds when
+  // waiting for data (SO_BUSY_POLL), zero for off. Going over the
+  // net.core.busy_read sysctl needs CAP_NET_ADMIN.
+  int busy_poll_us = 0;
+
+  // Send keepalive probes after [keepalive_s] idle seconds, zero for off. TCP only.
+  int keepalive_s = 0;
+};
+
+/**
+* When commands given to hiredis are written to the socket. By default they
+* are written as soon as the socket is writable, which with many producers
+* means many small writes. Holding them back a little writes them together.
+*/
+struct FlushPolicy {
+
+  // Hold commands back for up to [max_delay_us] microseconds, zero for not at all
+  unsigned max_delay_us = 0;
+
+  // Write them out sooner once this many bytes or commands are held, zero for no limit
+  size_t max_bytes = 0;
+  size_t max_commands = 0;
+};
+
+/**
+* Does the socket I/O of a hiredis context, driven by a libev event loop. It
+* is attached through the hooks hiredis gives event libraries, and is used by
+* a single connection.
+*/
+class Backend {
+
+public:
+  virtual ~Backend() {}
+
+  /**
+  * Takes over the socket I/O of [ctx] on [loop]. Returns false on failure.
+  */
+  virtual bool attach(struct ev_loop *loop, redisAsyncContext *ctx) = 0;
+
+  /**
+  * Returns true if everything given to hiredis has been written to the socket.
+  */
+  virtual bool flushed() = 0;
+
+  /**
+  * Holds writes back following [policy]. Call before attaching.
+  */
+  void flushPolicy(const FlushPolicy &policy) { policy_ = policy; }
+
+  /**
+  * Allocates buffers on NUMA [node], or anywhere if -1. Call before attaching.
+  */
+  void numaNode(int node) { numa_node_ = node; }
+
+  /**
+  * Writes out any commands held back, for one that someone is waiting on.
+  */
+  void flush();
+
+  /**
+  * Adds bytes to the output buffer after what hiredis has added, as part of
+  * the last command.
+  */
+  void append(const char *data, size_t len);
+
+  /**
+  * Adds caller memory to the output buffer the same way, to be written from
+  * where it is, keeping [owner] until written or the connection is gone. By
+  * default it is copied.
+  */
+  virtual void splice(const std::vector<struct iovec> &pieces, const std::shared_ptr<void> &owner);
+
+protected:
+  // Sets up holding writes back, when attaching
+  void initHolding();
+
+  // Counts a command added to the output buffer. Returns true while writes are
+  // held back, starting the delay timer if needed, and false once they are due.
+  bool holdBack();
+
+  // Stops holding writes back
+  void release();
+
+  // Whether writes are held back
+  bool holding() const { return holding_; }
+
+  // Starts writing out the output buffer, once released
+  virtual void write() = 0;
+
+  struct ev_loop *loop_ = nullptr;
+  redisAsyncContext *ctx_ = nullptr;
+  FlushPolicy policy_;
+  int numa_node_ = -1;
+
+private:
+  static void onDelay(struct ev_loop *loop, ev_timer *timer, int revents);
+
+  ev_timer delay_timer_;
+  size_t held_ = 0; // Commands since the last write
+  bool holding_ = false;
+};
+
+/**
+* The default: writes and reads every time the socket is ready, like hiredis'
+* own libev adapter, and follows the flush policy. Spliced memory is written
+* together with the output buffer around it with writev, without copying.
+*/
+class LibevBackend : public Backend {
+
+public:
+  bool attach(struct ev_loop *loop, redisAsyncContext *ctx) override;
+  bool flushed() override;
+  void splice(const std::vector<struct iovec> &pieces, const std::shared_ptr<void> &owner) override;
+
+protected:
+  void write() override;
+
+private:
+  // Hooks called by hiredis
+  static void addRead(void *privdata);
+  static void delRead(void *privdata);
+  static void addWrite(void *privdata);
+  static void delWrite(void *privdata);
+  static void cleanup(void *privdata);
+
+  // The socket is ready
+  static void onRead(struct ev_loop *loop, ev_io *w, int revents);
+  static void onWrite(struct ev_loop *loop, ev_io *w, int revents);
+
+  // Writes the output buffer and spliced memory in one go, instead of hiredis
+  void writeSpliced();
+
+  ev_io watcher_read_;
+  ev_io watcher_write_;
+  bool reading_ = false;
+  bool writing_ = false;
+  bool closed_ = false;
+
+  // Memory to write at an offset of the output buffer, in order
+  struct Splice {
+    size_t offset;
+    std::vector<struct iovec> pieces;
+    size_t size;
+    size_t written;
+    std::shared_ptr<void> owner;
+  };
+  std::deque<Splice> splices_;
+};
+
+/**
+* Options of the io_uring backend.
+*/
+struct IoUringOptions {
+
+  // Size of the submission queue
+  unsigned entries = 8;
+
+  // Bytes read or written by one operation, in buffers registered with the kernel
+  size_t buffer_size = 1 << 16;
+
+  // Have a kernel thread poll the submission queue, so submitting takes no
+  // system call, after [sqpoll_idle_ms] without work it goes to sleep
+  bool sqpoll = false;
+  unsigned sqpoll_idle_ms = 1000;
+};
+
+#ifdef REDOX_IO_URING
+
+/**
+* Reads and writes through an io_uring instance of its own, into registered
+* buffers. A read is kept in flight at all times, and all commands added to
+* the output buffer during one event loop iteration go out as one write,
+* submitted together with the read in at most one system call, unless held
+* back by the flush policy. Completions are picked up by watching the ring
+* from the libev event loop. Needs Linux 5.1 or later, and 5.11 for
+* unprivileged SQPOLL.
+*/
+class IoUringBackend : public Backend {
+
+public:
+  explicit IoUringBackend(const IoUringOptions &options = IoUringOptions());
+  ~IoUringBackend();
+
+  bool attach(struct ev_loop *loop, redisAsyncContext *ctx) override;
+  bool flushed() override;
+
+  /**
+  * Returns true if the kernel supports io_uring with these options.
+  */
+  static bool supported(const IoUringOptions &options);
+
+protected:
+  // Picked up before the loop waits for events
+  void write() override {}
+
+private:
+  // Operations, as the user data of submissions
+  enum Op { READ = 1, WRITE = 2, POLL = 3 };
+
+  // Maps the rings and registers the buffers, or tears them down
+  bool setup();
+  void teardown();
+
+  // Queues operations, and submits all queued ones
+  struct io_uring_sqe *nextSqe();
+  void queueRead();
+  void queueWrite();
+  void queuePoll();
+  void submit();
+
+  // Handles all completions
+  void complete();
+  void completed(Op op, int res);
+
+  // Hooks called by hiredis
+  static void addRead(void *privdata);
+  static void delRead(void *privdata);
+  static void addWrite(void *privdata);
+  static void delWrite(void *privdata);
+  static void cleanup(void *privdata);
+
+  // Completions are ready, or the loop is about to wait for events
+  static void onRing(struct ev_loop *loop, ev_io *w, int revents);
+  static void onPrepare(struct ev_loop *loop, ev_prepare *w, int revents);
+
+  IoUringOptions options_;
+
+  ev_io watcher_ring_;
+  ev_prepare watcher_prepare_;
+
+  // The rings, mapped from the kernel
+  int ring_fd_ = -1;
+  void *sq_map_ = nullptr;
+  size_t sq_map_size_ = 0;
+  void *cq_map_ = nullptr;
+  size_t cq_map_size_ = 0;
+  struct io_uring_sqe *sqes_ = nullptr;
+  size_t sqes_size_ = 0;
+  unsigned *sq_head_, *sq_tail_, *sq_mask_, *sq_flags_, *sq_array_;
+  unsigned *cq_head_, *cq_tail_, *cq_mask_;
+  struct io_uring_cqe *cqes_;
+  unsigned sq_entries_ = 0;
+  unsigned to_submit_ = 0;
+
+  // Registered read and write buffers, one after the other
+  char *buffers_ = nullptr;
+  size_t write_len_ = 0; // Bytes in the write buffer
+  size_t write_off_ = 0; // Of which written
+
+  // What hiredis wants, and what is in flight
+  bool reading_ = false;
+  bool writing_ = false;
+  bool read_in_flight_ = false;
+  bool write_in_flight_ = false;
+  bool poll_in_flight_ = false;
+
+  // The context was freed, possibly while handling completions
+  bool closed_ = false;
+  bool completing_ = false;
+
+  IoUringBackend(const IoUringBackend &) = delete;
+  IoUringBackend &operator=(const IoUringBackend &) = delete;
+};
+
+#endif
+
+} // End namespace
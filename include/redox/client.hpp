@@ -29,7 +29,11 @@
 #include <atomic>
 
 #include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
 #include <queue>
+#include <deque>
 #include <set>
 #include <unordered_map>
 #include <unordered_set>
@@ -39,7 +43,12 @@
 #include <hiredis/adapters/libev.h>
 
 #include "utils/logger.hpp"
+#include "utils/resp.hpp"
+#include "utils/tracing.hpp"
 #include "command.hpp"
+#include "metrics.hpp"
+#include "event_loop.hpp"
+#include "backend.hpp"
 
 namespace redox {
 
@@ -89,19 +98,119 @@ public:
   */
   void noWait(bool state);
 
+  /**
+  * Runs this client on one of the event loops of [group], shared with other
+  * clients, instead of on an event loop and thread of its own. Call before
+  * connecting. No-wait mode does not apply to a shared event loop.
+  */
+  void attach(EventLoopGroup &group);
+
+  /**
+  * Places the event loop thread following [options]: pinned to CPUs, with a
+  * scheduling policy, and allocating on the local NUMA node. Call before
+  * connecting. For a shared event loop, give them to the EventLoopGroup.
+  */
+  void threadOptions(const ThreadOptions &options);
+
+  /**
+  * Enables or disables doing the socket I/O through io_uring instead of libev
+  * readiness events, see IoUringBackend. Call before connecting. Returns false,
+  * and keeps using libev, if Redox was built without io_uring (the io_uring
+  * CMake option) or the kernel does not support it. Default is off.
+  */
+  bool ioUring(bool state, const IoUringOptions &options = IoUringOptions());
+
+  /**
+  * Sets when commands are written to the socket, see FlushPolicy. Holding them
+  * back for a few microseconds writes the commands of many producers together.
+  * Synchronous commands are written out right away. Call before connecting.
+  */
+  void flushPolicy(const FlushPolicy &policy);
+
+  /**
+  * Enables or disables discarding the replies of fire() commands on the server.
+  * If enabled, each batch of fire() commands sent by the event loop is wrapped in
+  * CLIENT REPLY OFF / ON, so the server does not write a reply for every command
+  * and hiredis does not parse them. Errors in those commands are then not
+  * reported. Requires Redis 3.2 or later. Default is off.
+  */
+  void discardReplies(bool state);
+
+  /**
+  * Enables or disables timing of commands into latency histograms per command
+  * name: time spent queued, time waiting on the server, and time spent in the
+  * callback. Counters and gauges in metrics() are always kept. Default is off.
+  */
+  void collectMetrics(bool state);
+
+  /**
+  * Returns a snapshot of the latency histograms, queue depths, byte and reply
+  * counters, and connection events. Safe to call from any thread at any time.
+  */
+  MetricsSnapshot metrics();
+
+  /**
+  * Enables or disables recording high-resolution timestamps of the stages of
+  * every command: created, dequeued by the event loop, handed to hiredis,
+  * written to the socket, reply parsed, and callback returned. They are read
+  * with Command::timeline(), from within the callback. Default is off.
+  */
+  void recordTimeline(bool state);
+
+  /**
+  * Also writes the timeline of every reply to a binary file at [path], as one
+  * TraceRecord each. Records are buffered and written by the event loop, and
+  * the file is closed on disconnect or with an empty path. Returns false if
+  * the file could not be opened.
+  */
+  bool traceFile(const std::string &path);
+
+  /**
+  * Enables the stall watchdog, which times every command callback and every
+  * iteration of the event loop. One that takes longer than [seconds] blocks
+  * all other commands, so it is logged as a warning and kept in a bounded log
+  * of the latest stalls. The time the loop is busy and idle is also added up
+  * in metrics(). Zero disables it, which is the default.
+  */
+  void stallThreshold(double seconds);
+
+  /**
+  * Returns the latest stalls found by the watchdog, oldest first.
+  */
+  std::vector<Stall> stalls();
+
+  /**
+  * Enables the client-side slow log, which keeps the latest [capacity]
+  * commands whose end-to-end latency exceeds [seconds], as felt by the
+  * caller: from creating the command until its callback returns. Each comes
+  * with its reply size and the time spent queued, being written, waiting on
+  * the network and server, and in the callback. Call before connecting;
+  * afterwards only the threshold can be changed. Zero disables it.
+  */
+  void slowLog(double seconds, size_t capacity = 128);
+
+  /**
+  * Returns the commands in the slow log, oldest first. Never blocks the
+  * event loop.
+  */
+  std::vector<SlowCommand> slowCommands();
+
   /**
   * Connects to Redis over TCP and starts an event loop in a separate thread. Returns
-  * true once everything is ready, or false on failure.
+  * true once everything is ready, or false on failure. Socket options that can
+  * not be set are logged as warnings.
   */
   bool connect(const std::string &host = REDIS_DEFAULT_HOST, const int port = REDIS_DEFAULT_PORT,
-               std::function<void(int)> connection_callback = nullptr);
+               std::function<void(int)> connection_callback = nullptr,
+               const SocketOptions &options = SocketOptions());
 
   /**
   * Connects to Redis over a unix socket and starts an event loop in a separate
   * thread. Returns true once everything is ready, or false on failure.
   */
   bool connectUnix(const std::string &path = REDIS_DEFAULT_PATH,
-                   std::function<void(int)> connection_callback = nullptr);
+                   std::function<void(int)> connection_callback = nullptr,
+                   const SocketOptions &options = SocketOptions());
 
   /**
   * Disconnect from Redis, shut down the event loop, then return. A simple
@@ -173,6 +282,63 @@ public:
   void commandDelayed(const std::vector<std::string> &cmd,
                       const std::function<void(Command<ReplyT> &)> &callback, double after);
 
+  /**
+  * Sends a command without creating a Command object, for fire-and-forget use
+  * where nobody reads the reply. The command is serialized straight into a shared
+  * send buffer and its reply is only counted, or not sent at all if
+  * discardReplies() is enabled. Keeps its order with all other commands.
+  * Non-blocking call.
+  */
+  void fire(const std::vector<std::string> &cmd);
+
+  /**
+  * Same as the methods above, for a command serialized at the call site with
+  * cmd(), such as rdx.command<int>(redox::cmd("INCRBY", key, 42), callback).
+  * No vector of arguments or strings are built along the way.
+  */
+  template <class ReplyT>
+  void command(FormattedCommand cmd,
+               const std::function<void(Command<ReplyT> &)> &callback = nullptr);
+  void command(FormattedCommand cmd);
+  template <class ReplyT> Command<ReplyT> &commandSync(FormattedCommand cmd);
+  bool commandSync(FormattedCommand cmd);
+  template <class ReplyT>
+  Command<ReplyT> &commandLoop(FormattedCommand cmd,
+                               const std::function<void(Command<ReplyT> &)> &callback,
+                               double repeat, double after = 0.0);
+  template <class ReplyT>
+  void commandDelayed(FormattedCommand cmd,
+                      const std::function<void(Command<ReplyT> &)> &callback, double after);
+  void fire(const FormattedCommand &cmd);
+
+  /**
+  * Returns the number of commands sent with fire(), publish() or spublish().
+  */
+  long firedCommands() const { return fired_commands_; }
+
+  /**
+  * Returns the number of fired commands that the server has processed, as
+  * seen from their replies or from the end of a discarded batch.
+  */
+  long firedAcked() const { return fired_acked_; }
+
+  /**
+  * Returns the number of fired commands that got an error reply. Always
+  * zero when replies are discarded.
+  */
+  long firedErrors() const { return fired_errors_; }
+
+  /**
+  * Asynchronously sends a batch of commands that are already serialized in RESP,
+  * back to back in [frames], with [ends] holding the end offset of each one. The
+  * callback is invoked for every reply in order, with the index of the command and
+  * the reply, or nullptr if the connection was lost. The reply is freed when the
+  * callback returns. Like fire(), no Command objects are created, and the batch
+  * keeps its order with all other commands.
+  */
+  void commandFormatted(const std::string &frames, const std::vector<size_t> &ends,
+                        const std::function<void(size_t, redisReply *)> &callback);
+
   // ------------------------------------------------
   // Utility methods
   // ------------------------------------------------
@@ -213,10 +379,17 @@ public:
 
   /**
   * Redis PUBLISH command wrapper - publish the given message to all subscribers.
-  * Non-blocking call.
+  * Sent like fire(). Non-blocking call.
   */
   void publish(const std::string &topic, const std::string &msg);
 
+  /**
+  * Redis SPUBLISH command wrapper - publish the given message to all subscribers
+  * of a sharded topic (Redis 7). The server must own the slot of the topic.
+  * Sent like fire(). Non-blocking call.
+  */
+  void spublish(const std::string &topic, const std::string &msg);
+
   // ------------------------------------------------
   // Public members
   // ------------------------------------------------
@@ -249,19 +422,71 @@ private:
   Command<ReplyT> &createCommand(const std::vector<std::string> &cmd,
                                  const std::function<void(Command<ReplyT> &)> &callback = nullptr,
                                  double repeat = 0.0, double after = 0.0, bool free_memory = true);
+  template <class ReplyT>
+  Command<ReplyT> &createCommand(FormattedCommand &&cmd,
+                                 const std::function<void(Command<ReplyT> &)> &callback = nullptr,
+                                 double repeat = 0.0, double after = 0.0, bool free_memory = true);
+
+  // Queues a new command, given as arguments or already formatted
+  template <class ReplyT>
+  Command<ReplyT> &queueCommand(const std::vector<std::string> &cmd, FormattedCommand &&formatted,
+                                const std::function<void(Command<ReplyT> &)> &callback,
+                                double repeat, double after, bool free_memory);
+
+  // Base of fire(), publish() and spublish(). Appends one command, written by
+  // the given function into the send buffer, to the fire-and-forget queue.
+  template <class Formatter> void fireFormatted(const Formatter &format);
+
+  // Send the queued fire-and-forget commands with the given indices, and the
+  // formatted batches among them
+  void sendFired(size_t begin, size_t end);
+
+  // Send queued fire-and-forget commands that are not part of a batch
+  void sendFiredFrames(size_t begin, size_t end);
+
+  // A batch from commandFormatted, owned by hiredis callbacks once sent
+  struct FormattedBatch {
+    std::function<void(size_t, redisReply *)> callback;
+    size_t count;
+    size_t next; // Index of the next reply
+  };
+
+  // Callback given to hiredis for the commands of a formatted batch
+  static void formattedCallback(redisAsyncContext *ctx, void *r, void *privdata);
+
+  // Callback given to hiredis for fire-and-forget commands, with the number
+  // of commands acknowledged by the reply as privdata
+  static void firedCallback(redisAsyncContext *ctx, void *r, void *privdata);
 
   // Setup code for the constructors
   // Return true on success, false on failure
   bool initEv();
   bool initHiredis();
+  void initSocket(const SocketOptions &options, bool tcp);
 
   // Callbacks invoked on server connection/disconnection
   static void connectedCallback(const redisAsyncContext *c, int status);
   static void disconnectedCallback(const redisAsyncContext *c, int status);
 
+  // Runs the event loop and waits until connected, or until failing to
+  bool startEventLoop();
+
   // Main event loop, run in a separate thread
   void runEventLoop();
 
+  // Locks a shared event loop to set up watchers on it, or does nothing
+  std::unique_lock<std::mutex> lockEventLoop();
+
+  // Start and stop all of our watchers on the event loop
+  void startWatchers();
+  void stopWatchers();
+
+  // Disconnects on a shared event loop, instead of breaking it
+  static void shutdownOnLoop(struct ev_loop *loop, ev_async *async, int revents);
+
+  // Last steps of shutting down, then lets go of wait()
+  void finishExit();
+
   // Return the command map corresponding to the templated reply type
   template <class ReplyT> std::unordered_map<long, Command<ReplyT> *> &getCommandMap();
 
@@ -329,12 +554,30 @@ private:
   // User connect/disconnect callbacks
   std::function<void(int)> user_connection_callback_;
 
-  // Dynamically allocated libev event loop
+  // Dynamically allocated libev event loop, or a shared one
   struct ev_loop *evloop_;
 
+  // Group and loop this client is attached to, if sharing one
+  EventLoopGroup *group_ = nullptr;
+  EventLoopGroup::Loop *group_loop_ = nullptr;
+  bool group_started_ = false; // Watchers set up, so exit is signalled
+
+  // Used by a shared event loop only, to shut down once
+  bool shutting_down_ = false;
+  bool shut_down_ = false;
+
   // No-wait mode for high-performance
   std::atomic_bool nowait_ = {false};
 
+  // Placement of the event loop thread
+  ThreadOptions thread_options_;
+
+  // Does the socket I/O, created on connecting
+  std::unique_ptr<Backend> backend_;
+  bool io_uring_ = false;
+  IoUringOptions io_uring_options_;
+  FlushPolicy flush_policy_;
+
   // Asynchronous watchers
   ev_async watcher_command_; // For processing commands
   ev_async watcher_stop_;    // For breaking the loop
@@ -377,9 +620,75 @@ private:
       commands_unordered_set_string_;
   std::mutex command_map_guard_; // Guards access to all of the above
 
-  // Command IDs pending to be sent to the server
-  std::queue<long> command_queue_;
-  std::mutex queue_guard_;
+  // Command IDs pending to be sent to the server, each with the number of
+  // fire-and-forget commands queued before it
+  std::queue<std::pair<long, size_t>> command_queue_;
+
+  // Fire-and-forget commands pending to be sent to the server, serialized
+  // back to back, and the end offset of each one
+  std::string fire_buf_;
+  std::vector<size_t> fire_ends_;
+
+  // Formatted batches in the above, by index of their first command
+  std::vector<std::pair<size_t, FormattedBatch *>> fire_batches_;
+  size_t next_batch_ = 0; // Next one to send, used by the event loop
+  std::mutex queue_guard_; // Guards all of the above
+
+  // Counters of fire-and-forget commands
+  std::atomic_bool discard_replies_ = {false};
+  std::atomic_long fired_commands_ = {0};
+  std::atomic_long fired_acked_ = {0};
+  std::atomic_long fired_errors_ = {0};
+
+  // Built-in metrics, with latencies only timed if enabled
+  Metrics metrics_;
+  std::atomic_bool collect_metrics_ = {false};
+
+  // Timelines of commands, recorded if enabled or needed for metrics
+  std::atomic_bool record_timeline_ = {false};
+  bool timed() const {
+    return record_timeline_ || collect_metrics_ || tracing_ || (slow_threshold_ns_ > 0);
+  }
+
+  // Timelines of commands submitted but not seen written out yet, used by
+  // the event loop only
+  std::vector<CommandTimeline *> unflushed_;
+  ev_check watcher_flushed_;
+
+  // Stamps the commands in unflushed_ once hiredis has written them out
+  static void checkFlushed(struct ev_loop *loop, ev_check *check, int revents);
+
+  // Binary trace file of command timelines, if enabled
+  FILE *trace_file_ = nullptr;
+  std::atomic_bool tracing_ = {false};
+  std::mutex trace_guard_;
+
+  // Writes the timeline of a reply to the trace file
+  void traceCommand(long id, int status, const std::string &name, const CommandTimeline &t);
+
+  // Stall watchdog, disabled if the threshold is zero
+  std::atomic_llong stall_threshold_ns_ = {0};
+  ev_check watcher_awake_;   // Before any event of a loop iteration
+  ev_prepare watcher_sleep_; // Before waiting for events
+  std::chrono::steady_clock::time_point loop_awake_;
+  std::chrono::steady_clock::time_point loop_asleep_;
+  bool stalled_callback_ = false; // In this loop iteration
+
+  // Bounded log of the latest stalls
+  static const size_t MAX_STALLS = 128;
+  std::deque<Stall> stalls_;
+  std::mutex stalls_guard_;
+
+  // Time loop iterations
+  static void loopAwake(struct ev_loop *loop, ev_check *check, int revents);
+  static void loopAsleep(struct ev_loop *loop, ev_prepare *prepare, int revents);
+
+  // Adds a stall to the log
+  void recordStall(const std::string &cmd, long long ns);
+
+  // Client-side slow log, disabled if the threshold is zero
+  std::atomic_llong slow_threshold_ns_ = {0};
+  std::unique_ptr<SlowLog> slow_log_;
 
   // Commands IDs pending to be freed by the event loop
   std::queue<long> commands_to_free_;
@@ -401,6 +710,22 @@ template <class ReplyT>
 Command<ReplyT> &Redox::createCommand(const std::vector<std::string> &cmd,
                                       const std::function<void(Command<ReplyT> &)> &callback,
                                       double repeat, double after, bool free_memory) {
+  return queueCommand(cmd, FormattedCommand(), callback, repeat, after, free_memory);
+}
+
+template <class ReplyT>
+Command<ReplyT> &Redox::createCommand(FormattedCommand &&cmd,
+                                      const std::function<void(Command<ReplyT> &)> &callback,
+                                      double repeat, double after, bool free_memory) {
+  return queueCommand(std::vector<std::string>(), std::move(cmd), callback, repeat, after,
+                      free_memory);
+}
+
+template <class ReplyT>
+Command<ReplyT> &Redox::queueCommand(const std::vector<std::string> &cmd,
+                                     FormattedCommand &&formatted,
+                                     const std::function<void(Command<ReplyT> &)> &callback,
+                                     double repeat, double after, bool free_memory) {
   {
     std::unique_lock<std::mutex> ul(running_lock_);
     if (!running_) {
@@ -408,14 +733,25 @@ Command<ReplyT> &Redox::createCommand(const std::vector<std::string> &cmd,
     }
   }
 
-  auto *c = new Command<ReplyT>(this, commands_created_.fetch_add(1), cmd, 
+  auto *c = new Command<ReplyT>(this, commands_created_.fetch_add(1), cmd, std::move(formatted),
                                 callback, repeat, after, free_memory, logger_);
+  if (timed())
+    c->timeline_.created = std::chrono::steady_clock::now();
+  metrics_.queued.fetch_add(1, std::memory_order_relaxed);
+
+  // A formatted command goes by its serialized form, whose header is the count
+  const std::string &frame = c->formatted_.data();
+  if (frame.empty()) {
+    REDOX_PROBE3(command__create, c->id_, cmd.empty() ? "" : cmd[0].c_str(), cmd.size());
+  } else {
+    REDOX_PROBE3(command__create, c->id_, frame.c_str(), atol(frame.c_str() + 1));
+  }
 
   std::lock_guard<std::mutex> lg(queue_guard_);
   std::lock_guard<std::mutex> lg2(command_map_guard_);
 
   getCommandMap<ReplyT>()[c->id_] = c;
-  command_queue_.push(c->id_);
+  command_queue_.emplace(c->id_, fire_ends_.size());
 
   // Signal the event loop to process this command
   ev_async_send(evloop_, &watcher_command_);
@@ -423,6 +759,24 @@ Command<ReplyT> &Redox::createCommand(const std::vector<std::string> &cmd,
   return *c;
 }
 
+template <class Formatter> void Redox::fireFormatted(const Formatter &format) {
+  {
+    std::unique_lock<std::mutex> ul(running_lock_);
+    if (!running_) {
+      throw std::runtime_error("[ERROR] Need to connect Redox before running commands!");
+    }
+  }
+
+  std::lock_guard<std::mutex> lg(queue_guard_);
+
+  format(fire_buf_);
+  fire_ends_.push_back(fire_buf_.size());
+  fired_commands_++;
+
+  // Signal the event loop to send it
+  ev_async_send(evloop_, &watcher_command_);
+}
+
 template <class ReplyT>
 void Redox::command(const std::vector<std::string> &cmd,
                     const std::function<void(Command<ReplyT> &)> &callback) {
@@ -448,4 +802,28 @@ template <class ReplyT> Command<ReplyT> &Redox::commandSync(const std::vector<st
   return c;
 }
 
+template <class ReplyT>
+void Redox::command(FormattedCommand cmd, const std::function<void(Command<ReplyT> &)> &callback) {
+  createCommand(std::move(cmd), callback);
+}
+
+template <class ReplyT>
+Command<ReplyT> &Redox::commandLoop(FormattedCommand cmd,
+                                    const std::function<void(Command<ReplyT> &)> &callback,
+                                    double repeat, double after) {
+  return createCommand(std::move(cmd), callback, repeat, after, false);
+}
+
+template <class ReplyT>
+void Redox::commandDelayed(FormattedCommand cmd,
+                           const std::function<void(Command<ReplyT> &)> &callback, double after) {
+  createCommand(std::move(cmd), callback, 0, after, true);
+}
+
+template <class ReplyT> Command<ReplyT> &Redox::commandSync(FormattedCommand cmd) {
+  auto &c = createCommand<ReplyT>(std::move(cmd), nullptr, 0, 0, false);
+  c.wait();
+  return c;
+}
+
 } // End namespace redis
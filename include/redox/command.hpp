@@ -21,19 +21,193 @@
 #pragma once
 
 #include <string>
+#include <cstring>
+#include <vector>
+#include <memory>
 #include <functional>
 #include <atomic>
+#include <chrono>
+#include <cstdint>
 #include <mutex>
 #include <condition_variable>
 
+#include <sys/uio.h>
+
 #include <hiredis/adapters/libev.h>
 #include <hiredis/async.h>
 
 #include "utils/logger.hpp"
+#include "utils/resp.hpp"
 
 namespace redox {
 
 class Redox;
+struct CommandMetrics;
+
+/**
+* Bytes owned by the caller, passed to cmd() without copying them into a
+* string first.
+*/
+class View {
+public:
+  View(const char *data, size_t size) : data_(data), size_(size) {}
+  const char *data() const { return data_; }
+  size_t size() const { return size_; }
+
+private:
+  const char *data_;
+  size_t size_;
+};
+
+/**
+* Large bytes owned by the caller, in one or more pieces like an iovec array,
+* for arguments of cmd() that are not copied at all. They are written to the
+* socket straight from where they are, with writev, and must stay valid and
+* unchanged until [release] is called. That happens on the event loop thread
+* once the command is freed and the bytes are written, or the connection is
+* gone. Below SPLICE_MIN bytes, copying is cheaper: they are copied into the
+* command, and released as soon as the Buffer is destroyed.
+*/
+class Buffer {
+public:
+  static const size_t SPLICE_MIN = 16384;
+
+  Buffer(const char *data, size_t size, const std::function<void()> &release = nullptr)
+      : Buffer(std::vector<struct iovec>{{(void *)data, size}}, release) {}
+
+  Buffer(const struct iovec *iov, size_t count, const std::function<void()> &release = nullptr)
+      : Buffer(std::vector<struct iovec>(iov, iov + count), release) {}
+
+  /**
+  * Returns the total number of bytes.
+  */
+  size_t size() const { return size_; }
+
+  /**
+  * Returns the pieces.
+  */
+  const std::vector<struct iovec> &pieces() const { return iov_; }
+
+private:
+  Buffer(std::vector<struct iovec> &&iov, const std::function<void()> &release) : iov_(iov) {
+    for (const struct iovec &piece : iov_)
+      size_ += piece.iov_len;
+
+    // Shared by all copies, and by the backend while writing
+    if (release)
+      owner_ = std::shared_ptr<void>(nullptr, [release](void *) { release(); });
+  }
+
+  std::vector<struct iovec> iov_;
+  size_t size_ = 0;
+  std::shared_ptr<void> owner_;
+
+  friend class Redox;
+};
+
+// Arguments of cmd() that are Buffers, for resp::formatCommand()
+inline size_t argLength(const Buffer &buffer) { return buffer.size(); }
+inline bool inlined(const Buffer &buffer, size_t len) { return len < Buffer::SPLICE_MIN; }
+inline char *writeData(char *p, const Buffer &buffer, size_t len) {
+  for (const struct iovec &piece : buffer.pieces()) {
+    memcpy(p, piece.iov_base, piece.iov_len);
+    p += piece.iov_len;
+  }
+  return p;
+}
+
+/**
+* A command already serialized in the Redis protocol, made by cmd(). It runs
+* like a vector of arguments with Redox::command() and the like, but without
+* building one.
+*/
+class FormattedCommand {
+public:
+  /**
+  * Returns the serialized command, without the data of large Buffers.
+  */
+  const std::string &data() const { return data_; }
+
+private:
+  FormattedCommand() {}
+
+  // Adds the large Buffers among the arguments, to where they go
+  void addSplices(std::vector<size_t> &holes) {}
+  template <class First, class... Rest>
+  void addSplices(std::vector<size_t> &holes, First &&first, Rest &&... rest) {
+    addSplice(holes, first);
+    addSplices(holes, std::forward<Rest>(rest)...);
+  }
+  template <class T> void addSplice(std::vector<size_t> &holes, const T &) {}
+  void addSplice(std::vector<size_t> &holes, const Buffer &buffer) {
+    if (!inlined(buffer, buffer.size()))
+      splices_.push_back(Splice{holes[splices_.size()], buffer});
+  }
+
+  std::string data_;
+
+  // Large Buffers, by offset in data_
+  struct Splice {
+    size_t offset;
+    Buffer buffer;
+  };
+  std::vector<Splice> splices_;
+
+  template <class Name, class... Args> friend FormattedCommand cmd(Name &&name, Args &&... args);
+  friend class Redox;
+  template <class ReplyT> friend class Command;
+};
+
+/**
+* Serializes a command from its arguments at the call site, for example
+* cmd("INCRBY", key, 42). Arguments can be strings, string literals, C
+* strings, integers, views of bytes such as View, with data() and size(),
+* and Buffers. The only allocation is for the serialized command, of the
+* exact size, and large Buffers are left out of it.
+*/
+template <class Name, class... Args> FormattedCommand cmd(Name &&name, Args &&... args) {
+  static_assert(!std::is_same<typename std::decay<Name>::type, Buffer>::value,
+                "hiredis needs the name of a command in one piece.");
+
+  FormattedCommand c;
+  std::vector<size_t> holes;
+  resp::formatCommand(c.data_, &holes, std::forward<Name>(name), std::forward<Args>(args)...);
+  if (!holes.empty())
+    c.addSplices(holes, std::forward<Args>(args)...);
+  return c;
+}
+
+/**
+* High-resolution timestamps of the stages of a command, recorded if enabled
+* with Redox::recordTimeline(). Stages not reached yet are zero. For repeating
+* commands they describe the latest run.
+*/
+struct CommandTimeline {
+  typedef std::chrono::steady_clock::time_point time_point;
+  time_point created;   // Command created in the user thread
+  time_point dequeued;  // Taken off the command queue by the event loop
+  time_point submitted; // Handed to hiredis
+  time_point flushed;   // Written to the socket
+  time_point parsed;    // Reply parsed, right before the callback
+  time_point returned;  // Callback returned
+};
+
+/**
+* One record of the binary trace file written by Redox::traceFile(), in host
+* byte order. Times are nanoseconds on std::chrono::steady_clock, or zero for
+* stages not reached.
+*/
+struct TraceRecord {
+  int64_t id;
+  int32_t status;
+  char name[20]; // Command name, truncated and zero-padded
+  int64_t created;
+  int64_t dequeued;
+  int64_t submitted;
+  int64_t flushed;
+  int64_t parsed;
+  int64_t returned;
+};
 
 /**
 * The Command class represents a single command string to be sent to
@@ -91,19 +265,44 @@ public:
   */
   std::string cmd() const;
 
+  /**
+  * Returns the timestamps of this command, if Redox::recordTimeline() is
+  * enabled. Within the callback, every stage up to parsed is set.
+  */
+  const CommandTimeline &timeline() const { return timeline_; }
+
   // Allow public access to constructed data
   Redox *const rdx_;
   const long id_;
   const std::vector<std::string> cmd_;
+  const FormattedCommand formatted_; // Instead of cmd_, if made with cmd()
   const double repeat_;
   const double after_;
   const bool free_memory_;
 
 private:
-  Command(Redox *rdx, long id, const std::vector<std::string> &cmd,
+  Command(Redox *rdx, long id, const std::vector<std::string> &cmd, FormattedCommand &&formatted,
           const std::function<void(Command<ReplyT> &)> &callback, double repeat, double after,
           bool free_memory, log::Logger &logger);
 
+  // The arguments of the command, parsed back if formatted. Not for the send path.
+  std::vector<std::string> args() const {
+    if (formatted_.data_.empty())
+      return cmd_;
+    std::vector<size_t> holes;
+    for (const FormattedCommand::Splice &splice : formatted_.splices_)
+      holes.push_back(splice.offset);
+    return resp::parseCommand(formatted_.data_, SIZE_MAX, holes);
+  }
+
+  // The name of the command, never a Buffer
+  std::string name() const {
+    if (formatted_.data_.empty())
+      return cmd_.empty() ? std::string() : cmd_[0];
+    std::vector<std::string> first = resp::parseCommand(formatted_.data_, 1);
+    return first.empty() ? std::string() : first[0];
+  }
+
   // Handles a new reply from the server
   void processReply(redisReply *r);
 
@@ -139,6 +338,10 @@ private:
   // How many messages sent to server but not received reply
   std::atomic_int pending_ = {0};
 
+  // Submissions counted in Metrics::in_flight, until their first reply. Only
+  // used from the event loop thread.
+  long unanswered_ = 0;
+
   // Whether a repeating or delayed command is canceled
   std::atomic_bool canceled_ = {false};
 
@@ -157,6 +360,12 @@ private:
   // Passed on from Redox class
   log::Logger &logger_;
 
+  // Timestamps, set only while they are recorded
+  CommandTimeline timeline_;
+
+  // Histograms for metrics, set only while they are collected
+  CommandMetrics *metrics_ = nullptr;
+
   // Explicitly delete copy constructor and assignment operator,
   // Command objects should never be copied because they hold
   // state with a network resource.
@@ -0,0 +1,127 @@
+/*
+* Redox - A modern, asynchronous, and wicked fast C++11 client for Redis
+*
+*    https://github.com/hmartiro/redox
+*
+* Copyright 2015 - Hayk Martirosyan <hayk.mart at gmail dot com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <functional>
+
+#include <ev.h>
+
+#include "utils/placement.hpp"
+
+namespace redox {
+
+/**
+* A fixed number of libev event loops, each run by its own thread, that many
+* Redox and Subscriber instances can share instead of running a thread each.
+* Every client attached with attach() goes to the loop with the fewest
+* clients, so they spread evenly over the threads.
+*
+* Each loop is guarded by a mutex that its thread only lets go of while
+* waiting for events, which makes it safe to start watchers on it from other
+* threads through run(). Disconnect all attached clients before destroying
+* the group.
+*/
+class EventLoopGroup {
+
+public:
+  /**
+  * Starts [threads] event loops, or one per core if zero.
+  */
+  explicit EventLoopGroup(size_t threads = 0);
+
+  /**
+  * Same, with the threads placed following [options], except that with CPUs
+  * given, each thread is pinned to one of them in turn, and zero [threads]
+  * means one per CPU given. Throws std::runtime_error if a thread cannot be
+  * placed.
+  */
+  explicit EventLoopGroup(const ThreadOptions &options, size_t threads = 0);
+
+  /**
+  * Runs a loop created by the caller, in one thread owned by the group and
+  * placed following [options]. The loop must not be run elsewhere, and its
+  * userdata and release callbacks are taken over. It is not destroyed with
+  * the group.
+  */
+  explicit EventLoopGroup(struct ev_loop *loop, const ThreadOptions &options = ThreadOptions());
+
+  /**
+  * Stops the event loops and joins their threads.
+  */
+  ~EventLoopGroup();
+
+  /**
+  * Returns the number of event loops.
+  */
+  size_t size() const { return loops_.size(); }
+
+  /**
+  * Returns an event loop, by index.
+  */
+  struct ev_loop *loop(size_t index) { return loops_[index]->ev; }
+
+  /**
+  * Calls [fn] with an event loop while holding its lock, then wakes the loop
+  * up so that it picks up any watchers started by [fn].
+  */
+  void run(size_t index, const std::function<void(struct ev_loop *)> &fn);
+
+private:
+  struct Loop {
+    struct ev_loop *ev = nullptr;
+    bool owned = true;
+    std::mutex lock;
+    ev_async wake; // To apply changes, or exit
+    std::atomic_bool exit = {false};
+    std::thread thread;
+    int numa_node = -1; // Of the thread, if allocating locally
+    long clients = 0;   // Guarded by clients_guard_
+  };
+
+  // Starts running a loop in a thread placed following [options], and stops
+  // all loops
+  void start(Loop *l, const ThreadOptions &options);
+  void stop();
+
+  // Picks the loop with the fewest clients for a new one, and lets go of it
+  Loop *acquire();
+  void release(Loop *l);
+
+  static void onWake(struct ev_loop *loop, ev_async *async, int revents);
+  static void releaseLock(struct ev_loop *loop);
+  static void acquireLock(struct ev_loop *loop);
+
+  std::vector<std::unique_ptr<Loop>> loops_;
+  std::mutex clients_guard_;
+
+  EventLoopGroup(const EventLoopGroup &) = delete;
+  EventLoopGroup &operator=(const EventLoopGroup &) = delete;
+
+  // Access to attach clients to loops
+  friend class Redox;
+};
+
+} // End namespace
@@ -0,0 +1,230 @@
+/*
+* Redox - A modern, asynchronous, and wicked fast C++11 client for Redis
+*
+*    https://github.com/hmartiro/redox
+*
+* Copyright 2015 - Hayk Martirosyan <hayk.mart at gmail dot com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <unordered_map>
+#include <chrono>
+#include <cstdint>
+
+#include <hiredis/hiredis.h>
+
+#include "utils/histogram.hpp"
+
+namespace redox {
+
+/**
+* Latency histograms of one command name, in nanoseconds.
+*/
+struct CommandMetrics {
+  Histogram queued;   // Created until handed to hiredis
+  Histogram server;   // Handed to hiredis until the reply is received
+  Histogram callback; // Reply received until the callback returns
+};
+
+/**
+* A copy of the metrics of a Redox instance at one point in time.
+*/
+struct MetricsSnapshot {
+
+  // Latencies by command name
+  struct Command {
+    std::string name;
+    Histogram::Snapshot queued;
+    Histogram::Snapshot server;
+    Histogram::Snapshot callback;
+  };
+  std::vector<Command> commands;
+
+  // Commands waiting to be sent, and sent without a reply yet
+  long queued = 0;
+  long in_flight = 0;
+
+  // Protocol bytes of commands sent and replies received
+  unsigned long long bytes_out = 0;
+  unsigned long long bytes_in = 0;
+
+  // Replies by Command status code, at index status + 1 (from NO_REPLY
+  // to TIMEOUT)
+  std::vector<long> statuses;
+
+  long connects = 0;
+  long connect_errors = 0;
+  long disconnects = 0;
+  long disconnect_errors = 0;
+
+  // Time the event loop spent processing events and waiting for them, and
+  // the number of stalls, if the stall watchdog is enabled
+  unsigned long long loop_busy_ns = 0;
+  unsigned long long loop_idle_ns = 0;
+  long stalls = 0;
+
+  /**
+  * Returns the fraction of time the event loop was busy, from 0 to 1.
+  */
+  double loopBusyRatio() const {
+    unsigned long long total = loop_busy_ns + loop_idle_ns;
+    return (total == 0) ? 0 : (double)loop_busy_ns / total;
+  }
+};
+
+/**
+* A stall of the event loop found by the stall watchdog: either one callback,
+* or a whole loop iteration, that took longer than the threshold.
+*/
+struct Stall {
+  std::chrono::system_clock::time_point time;
+  std::string cmd; // Command of the callback, or empty for a loop iteration
+  double duration; // In seconds
+};
+
+/**
+* A command of the client-side slow log, with the time it spent in each
+* stage, in seconds.
+*/
+struct SlowCommand {
+  std::chrono::system_clock::time_point time; // When the callback returned
+  std::string cmd;    // Command string, truncated
+  int status;         // Reply status
+  size_t reply_bytes; // Reply size in the Redis protocol
+  double total;       // Created (or last submitted, if looping) until the callback returned
+  double queued;      // Created until handed to hiredis, zero if looping
+  double write;       // Handed to hiredis until written to the socket
+  double server;      // Written until the reply was parsed: network, server and parsing
+  double callback;    // Callback
+};
+
+/**
+* A fixed-size ring of the latest slow commands. Written by the event loop
+* thread only, and readable from any thread without locks: every slot is a
+* seqlock, so a reader skips a slot it sees being overwritten.
+*/
+class SlowLog {
+
+public:
+  // Longer command strings are truncated
+  static const size_t MAX_CMD = 64;
+
+  explicit SlowLog(size_t capacity);
+
+  /**
+  * Adds a command, overwriting the oldest one if full. Times are in
+  * nanoseconds. Only called from the event loop thread.
+  */
+  void record(const std::vector<std::string> &cmd, int status, size_t reply_bytes,
+              int64_t total, int64_t queued, int64_t write, int64_t server, int64_t callback);
+
+  /**
+  * Returns a copy of the commands in the ring, oldest first.
+  */
+  std::vector<SlowCommand> dump() const;
+
+  /**
+  * Returns the number of commands ever recorded.
+  */
+  long count() const { return (long)next_.load(std::memory_order_relaxed); }
+
+private:
+  struct Entry {
+    int64_t time; // Nanoseconds on the system clock
+    int32_t status;
+    uint32_t cmd_len;
+    uint64_t reply_bytes;
+    int64_t total;
+    int64_t queued;
+    int64_t write;
+    int64_t server;
+    int64_t callback;
+    char cmd[MAX_CMD];
+  };
+
+  // Odd sequence numbers while being written
+  struct Slot {
+    std::atomic<uint64_t> seq = {0};
+    Entry entry;
+  };
+
+  size_t capacity_;
+  std::unique_ptr<Slot[]> slots_;
+  std::atomic<uint64_t> next_ = {0};
+};
+
+/**
+* The metrics of a Redox instance. Counters are relaxed atomics, so they
+* are wait-free to update from any thread. Histograms are only recorded
+* from the event loop thread, and everything is copied out by snapshot().
+*/
+class Metrics {
+
+public:
+  // Further command names share one entry, to bound memory
+  static const size_t MAX_COMMANDS = 256;
+
+  // Number of Command status codes, from NO_REPLY to TIMEOUT
+  static const int NUM_STATUSES = 7;
+
+  /**
+  * Returns the histograms of a command name, ignoring case. Only called
+  * from the event loop thread.
+  */
+  CommandMetrics *command(const std::string &name);
+
+  /**
+  * Returns a copy of all metrics.
+  */
+  MetricsSnapshot snapshot();
+
+  /**
+  * Returns the size of a reply in the Redis protocol.
+  */
+  static size_t replySize(const redisReply *r);
+
+  std::atomic_long queued = {0};
+  std::atomic_long in_flight = {0};
+  std::atomic_ullong bytes_out = {0};
+  std::atomic_ullong bytes_in = {0};
+  std::atomic_long statuses[NUM_STATUSES] = {};
+  std::atomic_long connects = {0};
+  std::atomic_long connect_errors = {0};
+  std::atomic_long disconnects = {0};
+  std::atomic_long disconnect_errors = {0};
+  std::atomic_ullong loop_busy_ns = {0};
+  std::atomic_ullong loop_idle_ns = {0};
+  std::atomic_long stalls = {0};
+
+private:
+  struct NoCaseHash {
+    size_t operator()(const std::string &s) const;
+  };
+  struct NoCaseEqual {
+    bool operator()(const std::string &a, const std::string &b) const;
+  };
+
+  std::unordered_map<std::string, std::unique_ptr<CommandMetrics>, NoCaseHash, NoCaseEqual>
+      commands_;
+  std::mutex commands_guard_; // Guards inserts, and reads from other threads
+};
+
+} // End namespace
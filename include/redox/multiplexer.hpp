@@ -0,0 +1,158 @@
+/*
+* Redox - A modern, asynchronous, and wicked fast C++11 client for Redis
+*
+*    https://github.com/hmartiro/redox
+*
+* Copyright 2015 - Hayk Martirosyan <hayk.mart at gmail dot com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#pragma once
+
+#include <memory>
+#include <vector>
+
+#include "subscriber.hpp"
+
+namespace redox {
+
+/**
+* The Multiplexer shares one Subscriber connection among many local
+* listeners. It holds a single server-side subscription per topic or
+* pattern, reference counted by the listeners of that topic, and fans
+* every message out to all of them from one shared buffer.
+*/
+class Multiplexer {
+
+public:
+  /**
+  * Listener callback, invoked with the topic and a shared message buffer.
+  * Listeners can keep the buffer around without copying it.
+  */
+  typedef std::function<void(const std::string &, const std::shared_ptr<const std::string> &)>
+      Listener;
+
+  /**
+  * Constructor. Same as Redox.
+  */
+  Multiplexer(std::ostream &log_stream = std::cout, log::Level log_level = log::Warning);
+
+  /**
+  * Same as .connect() on a Subscriber instance.
+  */
+  bool connect(const std::string &host = REDIS_DEFAULT_HOST, const int port = REDIS_DEFAULT_PORT,
+               std::function<void(int)> connection_callback = nullptr,
+               const SocketOptions &options = SocketOptions()) {
+    return sub_.connect(host, port, connection_callback, options);
+  }
+
+  /**
+  * Same as .connectUnix() on a Subscriber instance.
+  */
+  bool connectUnix(const std::string &path = REDIS_DEFAULT_PATH,
+                   std::function<void(int)> connection_callback = nullptr,
+                   const SocketOptions &options = SocketOptions()) {
+    return sub_.connectUnix(path, connection_callback, options);
+  }
+
+  /**
+  * Same as .stop() on a Subscriber instance. Listeners that are still
+  * attached stay registered, but nothing is subscribed to again.
+  */
+  void stop();
+
+  /**
+  * Same as .disconnect() on a Subscriber instance.
+  */
+  void disconnect();
+
+  /**
+  * Same as .wait() on a Subscriber instance.
+  */
+  void wait() { sub_.wait(); }
+
+  /**
+  * Adds a listener to a topic, subscribing on the server if it is the first
+  * listener of that topic. Returns an ID to pass to unlisten().
+  */
+  long listen(const std::string &topic, Listener listener);
+
+  /**
+  * Adds a listener to a topic pattern, psubscribing on the server if it is
+  * the first listener of that pattern. Returns an ID to pass to unlisten().
+  */
+  long plisten(const std::string &pattern, Listener listener);
+
+  /**
+  * Removes a listener. Unsubscribes on the server if it was the last
+  * listener of its topic or pattern.
+  */
+  void unlisten(long id);
+
+  /**
+  * Returns the number of local listeners of a topic or pattern.
+  */
+  size_t listeners(const std::string &topic);
+
+  /**
+  * The underlying Subscriber, for settings such as noWait() or deliverAsync().
+  */
+  Subscriber &subscriber() { return sub_; }
+
+private:
+  typedef std::vector<std::pair<long, Listener>> ListenerList;
+
+  // State of one server-side subscription
+  struct Topic {
+    std::string name;
+    bool pattern;
+
+    // Replaced as a whole when listeners come and go, so that messages
+    // can be fanned out without holding the lock
+    std::shared_ptr<const ListenerList> listeners;
+
+    // Waiting for the server to acknowledge an unsubscribe
+    bool unsubscribing = false;
+  };
+
+  // Base for listen and plisten
+  long listenBase(const std::string &topic, bool pattern, Listener listener);
+
+  // Send the [p]subscribe command for a topic
+  void subscribeTopic(const std::shared_ptr<Topic> &t);
+
+  // Fan a message out to every listener of a topic
+  void fanOut(const std::shared_ptr<Topic> &t, const std::string &topic,
+              const std::shared_ptr<const std::string> &msg);
+
+  // Invoked when the server acknowledges an unsubscribe
+  void unsubscribed(const std::shared_ptr<Topic> &t);
+
+  // Logger for the multiplexer itself
+  log::Logger logger_;
+
+  Subscriber sub_;
+
+  // Topics and patterns by name, and the topic of each listener ID
+  std::unordered_map<std::string, std::shared_ptr<Topic>> topics_;
+  std::unordered_map<std::string, std::shared_ptr<Topic>> patterns_;
+  std::unordered_map<long, std::shared_ptr<Topic>> listener_topics_;
+  long next_id_ = 0;
+
+  // Set once stopping, so that unsubscribe acknowledgements do not resubscribe
+  bool stopping_ = false;
+  std::mutex guard_; // Guards all of the above, and Topic contents
+};
+
+} // End namespace
@@ -0,0 +1,258 @@
+/*
+* Redox - A modern, asynchronous, and wicked fast C++11 client for Redis
+*
+*    https://github.com/hmartiro/redox
+*
+* Copyright 2015 - Hayk Martirosyan <hayk.mart at gmail dot com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#pragma once
+
+#include <deque>
+#include <map>
+#include <memory>
+#include <vector>
+
+#include "client.hpp"
+#include "subscriber.hpp"
+
+namespace redox {
+
+/**
+* Map of Redis Cluster hash slots to the nodes that own them.
+*/
+class SlotMap {
+
+public:
+  static const int NUM_SLOTS = 16384;
+
+  /**
+  * Returns the hash slot of a key or topic, honoring {hash tags}.
+  */
+  static int keySlot(const std::string &key);
+
+  /**
+  * Loads the slot map from a cluster node with CLUSTER SLOTS. Blocking call.
+  * Returns true on success.
+  */
+  bool load(Redox &rdx);
+
+  /**
+  * Returns the "host:port" address of the node that owns the slot, or an
+  * empty string if the slot is not assigned.
+  */
+  std::string owner(int slot) const;
+
+  /**
+  * Records that a slot is owned by the given "host:port" address, for
+  * example after a MOVED redirection.
+  */
+  void assign(int slot, const std::string &addr);
+
+  /**
+  * Splits a "host:port" address. Returns false if it is malformed.
+  */
+  static bool splitAddr(const std::string &addr, std::string &host, int &port);
+
+private:
+  // Index into nodes_ of the owner of each slot, or -1
+  std::vector<int> owners_;
+  std::vector<std::string> nodes_;
+};
+
+/**
+* Subscribes to sharded topics (Redis 7 SSUBSCRIBE) across the nodes of a
+* cluster. Topics are hashed to slots, and each node that owns a subscribed
+* slot gets its own Subscriber connection, so message throughput scales with
+* the number of shards. When the server drops a subscription because its
+* slot moved, the slot map is reloaded and the topic is subscribed to again
+* on its new owner.
+*/
+class ShardedSubscriber {
+
+public:
+  /**
+  * Constructor. Same as Redox.
+  */
+  ShardedSubscriber(std::ostream &log_stream = std::cout, log::Level log_level = log::Warning);
+
+  /**
+  * Disconnects from all nodes.
+  */
+  ~ShardedSubscriber();
+
+  /**
+  * Connects to one node of the cluster and loads the slot map from it.
+  * Returns true once everything is ready, or false on failure.
+  */
+  bool connect(const std::string &host = REDIS_DEFAULT_HOST, const int port = REDIS_DEFAULT_PORT);
+
+  /**
+  * Unsubscribes and disconnects from all nodes.
+  */
+  void disconnect();
+
+  /**
+  * Subscribe to a sharded topic on the node that owns its slot.
+  *
+  * msg_callback: invoked whenever a message is received.
+  * sub_callback: invoked when successfully subscribed, including after a slot move
+  * err_callback: invoked on some error state
+  */
+  void ssubscribe(const std::string &topic,
+                  std::function<void(const std::string &, const std::string &)> msg_callback,
+                  std::function<void(const std::string &)> sub_callback = nullptr,
+                  std::function<void(const std::string &, int)> err_callback = nullptr);
+
+  /**
+  * Unsubscribe from a sharded topic.
+  */
+  void sunsubscribe(const std::string &topic);
+
+  /**
+  * Reloads the slot map and moves every subscription whose slot changed
+  * owner. Happens automatically when the server drops a subscription.
+  * Blocking call. Returns true on success.
+  */
+  bool refresh();
+
+  /**
+  * Return the sharded topics that are subscribed to, on any node.
+  */
+  std::set<std::string> ssubscribedTopics();
+
+private:
+  // A subscribed topic, and the node it is subscribed on
+  struct Channel {
+    std::string node;
+    bool active = false;
+    std::function<void(const std::string &, const std::string &)> msg_callback;
+    std::function<void(const std::string &)> sub_callback;
+    std::function<void(const std::string &, int)> err_callback;
+  };
+
+  // Return the Subscriber for the given node, connecting if needed, or nullptr
+  Subscriber *nodeSubscriber(const std::string &addr);
+
+  // Send SSUBSCRIBE for the topic to the given node
+  void subscribeOnNode(const std::string &topic, const std::string &addr, const Channel &ch);
+
+  // Invoked when a node drops the subscription of a topic
+  void dropped(const std::string &topic, const std::string &addr);
+
+  // Refreshes the slot map on request, run in a separate thread
+  void runRefreshThread();
+
+  std::ostream &log_stream_;
+  log::Level log_level_;
+  log::Logger logger_;
+
+  // Connection used to load the slot map
+  Redox ctl_;
+  bool ctl_connected_ = false;
+  SlotMap slots_;
+
+  // Subscriber connection of each node, by "host:port"
+  std::map<std::string, std::unique_ptr<Subscriber>> nodes_;
+  std::mutex nodes_guard_;
+
+  std::unordered_map<std::string, Channel> channels_;
+  std::mutex guard_; // Guards channels_ and slots_
+
+  // Refresh requests from the event loop threads
+  std::thread refresh_thread_;
+  bool refresh_requested_ = false;
+  bool refresh_exit_ = false;
+  std::mutex refresh_guard_;
+  std::condition_variable refresh_cv_;
+};
+
+/**
+* Publishes to sharded topics (Redis 7 SPUBLISH) across the nodes of a
+* cluster, sending each message to the node that owns the slot of its topic.
+* MOVED redirections update the slot map and the message is resent, from a
+* separate thread since it may have to connect to a new node.
+*/
+class ShardedPublisher {
+
+public:
+  /**
+  * Constructor. Same as Redox.
+  */
+  ShardedPublisher(std::ostream &log_stream = std::cout, log::Level log_level = log::Warning);
+
+  /**
+  * Disconnects from all nodes.
+  */
+  ~ShardedPublisher();
+
+  /**
+  * Connects to one node of the cluster and loads the slot map from it.
+  * Returns true once everything is ready, or false on failure.
+  */
+  bool connect(const std::string &host = REDIS_DEFAULT_HOST, const int port = REDIS_DEFAULT_PORT);
+
+  /**
+  * Disconnects from all nodes.
+  */
+  void disconnect();
+
+  /**
+  * Publish the given message to a sharded topic. Non-blocking call.
+  */
+  void spublish(const std::string &topic, const std::string &msg);
+
+  /**
+  * Reloads the slot map. Blocking call. Returns true on success.
+  */
+  bool refresh();
+
+private:
+  // Return the Redox client for the given node, connecting if needed, or nullptr
+  Redox *nodeClient(const std::string &addr);
+
+  // Send the message to the given node, following one MOVED redirection
+  void publishOnNode(const std::string &addr, const std::string &topic, const std::string &msg,
+                     bool redirected);
+
+  // A message to resend to the node named by a MOVED redirection
+  struct Redirect {
+    std::string addr;
+    std::string topic;
+    std::string msg;
+  };
+
+  // Resends redirected messages, run in a separate thread
+  void runRedirectThread();
+
+  std::ostream &log_stream_;
+  log::Level log_level_;
+  log::Logger logger_;
+
+  SlotMap slots_;
+  std::mutex slots_guard_;
+
+  std::map<std::string, std::unique_ptr<Redox>> nodes_;
+  std::mutex nodes_guard_;
+
+  // Redirections from the event loop threads, which must not block on a connect
+  std::thread redirect_thread_;
+  std::deque<Redirect> redirects_;
+  bool redirect_exit_ = false;
+  std::mutex redirect_guard_;
+  std::condition_variable redirect_cv_;
+};
+
+} // End namespace
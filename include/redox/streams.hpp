@@ -0,0 +1,505 @@
+/*
+* Redox - A modern, asynchronous, and wicked fast C++11 client for Redis
+*
+*    https://github.com/hmartiro/redox
+*
+* Copyright 2015 - Hayk Martirosyan <hayk.mart at gmail dot com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#pragma once
+
+#include <chrono>
+#include <vector>
+
+#include "client.hpp"
+
+namespace redox {
+
+/**
+* A batch of entries read from Redis streams. All names, IDs, fields and
+* values are stored back to back in one buffer, which is reused from batch
+* to batch, and are accessed as slices of it. Slices are only valid while
+* the batch is being handled.
+*/
+class StreamBatch {
+
+public:
+  /**
+  * A view of bytes in the batch buffer.
+  */
+  struct Slice {
+    const char *data;
+    size_t len;
+
+    std::string str() const { return std::string(data, len); }
+  };
+
+  /**
+  * Returns the number of entries in the batch.
+  */
+  size_t size() const { return entries_.size(); }
+
+  /**
+  * Returns the name of the stream of entry i.
+  */
+  Slice stream(size_t i) const { return slice(entries_[i].stream); }
+
+  /**
+  * Returns the ID of entry i.
+  */
+  Slice id(size_t i) const { return slice(entries_[i].id); }
+
+  /**
+  * Returns the number of field-value pairs of entry i.
+  */
+  size_t fields(size_t i) const { return entries_[i].num_fields; }
+
+  /**
+  * Returns the name of field f of entry i.
+  */
+  Slice field(size_t i, size_t f) const { return slice(fields_[entries_[i].first_field + 2 * f]); }
+
+  /**
+  * Returns the value of field f of entry i.
+  */
+  Slice value(size_t i, size_t f) const {
+    return slice(fields_[entries_[i].first_field + 2 * f + 1]);
+  }
+
+private:
+  // Offset and length of a slice in data_
+  struct Span {
+    size_t off;
+    size_t len;
+  };
+
+  struct Entry {
+    Span stream;
+    Span id;
+    size_t first_field;
+    size_t num_fields;
+  };
+
+  Slice slice(const Span &s) const { return {data_.data() + s.off, s.len}; }
+
+  // Empty the batch, keeping the capacity
+  void clear() {
+    data_.clear();
+    entries_.clear();
+    fields_.clear();
+  }
+
+  // Copy bytes into the buffer
+  Span append(const char *data, size_t len) {
+    Span s = {data_.size(), len};
+    data_.append(data, len);
+    return s;
+  }
+
+  std::string data_;
+  std::vector<Entry> entries_;
+  std::vector<Span> fields_; // Field and value of each pair
+
+  friend class StreamConsumer;
+};
+
+/**
+* Reads Redis streams as a member of a consumer group. A blocking XREADGROUP
+* is always kept in flight on a dedicated connection, and entries are decoded
+* straight from the reply into a StreamBatch that is handed to the handler.
+* Acknowledgements are batched by count or age and pipelined with XACK on a
+* second connection, and entries left pending by dead consumers are
+* reclaimed with XAUTOCLAIM.
+*/
+class StreamConsumer {
+
+public:
+  /**
+  * Constructor. Same as Redox.
+  */
+  StreamConsumer(std::ostream &log_stream = std::cout, log::Level log_level = log::Warning);
+
+  /**
+  * Stops reading and disconnects.
+  */
+  ~StreamConsumer();
+
+  /**
+  * Connects both connections over TCP. Returns true once everything is
+  * ready, or false on failure.
+  */
+  bool connect(const std::string &host = REDIS_DEFAULT_HOST, const int port = REDIS_DEFAULT_PORT);
+
+  /**
+  * Connects both connections over a unix socket. Returns true once
+  * everything is ready, or false on failure.
+  */
+  bool connectUnix(const std::string &path = REDIS_DEFAULT_PATH);
+
+  /**
+  * Stops reading, waits for the outstanding read to return, sends the
+  * pending acknowledgements, and disconnects. Blocking call.
+  */
+  void disconnect();
+
+  /**
+  * Maximum number of entries per read, and the time in milliseconds that
+  * a read blocks for when there are none. Set before start(). Defaults are
+  * 100 entries and 100 ms. A block time below 1 ms is raised to 1 ms, as
+  * the read must return for disconnect() to finish.
+  */
+  void readSize(size_t count, int block_ms);
+
+  /**
+  * Acknowledgements are sent once [count] of them are pending, or once
+  * the oldest is [interval] seconds old. The age is checked whenever a
+  * read returns, so it is at least the block time of reads. Defaults are
+  * 100 and 0.1 seconds.
+  */
+  void ackBatch(size_t count, double interval);
+
+  /**
+  * Every [interval] seconds, claims up to [count] entries of each stream
+  * that were delivered to other consumers and not acknowledged for
+  * [min_idle] seconds, and delivers them to the handler. Disabled if
+  * [interval] is 0, which is the default.
+  */
+  void autoClaim(double min_idle, double interval, size_t count = 100);
+
+  /**
+  * Creates a consumer group on a stream, and the stream itself if needed,
+  * starting at the given ID. Returns true on success or if the group
+  * already exists. Blocking call.
+  */
+  bool createGroup(const std::string &stream, const std::string &group,
+                   const std::string &start_id = "$");
+
+  /**
+  * Starts reading the given streams as [consumer] of [group]. The handler
+  * is invoked from the event loop thread with every batch of new or
+  * claimed entries. If auto_ack is true, entries are acknowledged when
+  * the handler returns, otherwise by calling ack().
+  */
+  void start(const std::string &group, const std::string &consumer,
+             const std::vector<std::string> &streams,
+             std::function<void(const StreamBatch &)> handler, bool auto_ack = true);
+
+  /**
+  * Queues an acknowledgement of an entry. Can be called from any thread.
+  */
+  void ack(const std::string &stream, const std::string &id);
+
+  /**
+  * Sends all pending acknowledgements now.
+  */
+  void flushAcks();
+
+  /**
+  * Returns the number of entries read, claimed from other consumers, and
+  * acknowledged.
+  */
+  long readEntries() const { return read_entries_; }
+  long claimedEntries() const { return claimed_entries_; }
+  long ackedEntries() const { return acked_entries_; }
+
+private:
+  // Send the next XREADGROUP, preceded by an XAUTOCLAIM if one is due
+  void read();
+
+  // Invoked with the reply of XREADGROUP
+  void onRead(Command<redisReply *> &c);
+
+  // Invoked with the reply of XAUTOCLAIM for a stream
+  void onClaim(Command<redisReply *> &c, size_t stream_index);
+
+  // Decode [id, [field, value, ...]] entries of a stream into batch_
+  void decodeEntries(const char *stream, size_t len, redisReply *entries);
+
+  // Hand batch_ to the handler, and queue its acknowledgements
+  void deliver();
+
+  // Flush acknowledgements if enough are pending or the oldest is too old
+  void maybeFlushAcks();
+
+  // Signal that no read is in flight anymore
+  void readStopped();
+
+  log::Logger logger_;
+
+  // Connection with the blocking read always in flight
+  Redox rdx_;
+
+  // Connection for acknowledgements and group management
+  Redox ctl_;
+  bool connected_ = false;
+
+  // Settings
+  size_t read_count_ = 100;
+  int block_ms_ = 100;
+  size_t ack_count_ = 100;
+  double ack_interval_ = 0.1;
+  double claim_min_idle_ = 0;
+  double claim_interval_ = 0;
+  size_t claim_count_ = 100;
+
+  // Set by start()
+  std::string group_;
+  std::string consumer_;
+  std::vector<std::string> streams_;
+  std::vector<std::string> read_cmd_;
+  std::function<void(const StreamBatch &)> handler_;
+  bool auto_ack_ = true;
+
+  // Only touched from the event loop thread of rdx_
+  StreamBatch batch_;
+  std::vector<std::string> claim_cursors_;
+  std::chrono::steady_clock::time_point last_claim_;
+
+  // Pending acknowledgements by stream
+  std::unordered_map<std::string, std::vector<std::string>> acks_;
+  size_t num_acks_ = 0;
+  std::chrono::steady_clock::time_point oldest_ack_;
+  std::mutex acks_guard_;
+
+  // Whether a read is in flight, and a request to stop reading
+  bool reading_ = false;
+  std::atomic_bool stopping_ = {false};
+  std::mutex reading_guard_;
+  std::condition_variable reading_cv_;
+
+  std::atomic_long read_entries_ = {0};
+  std::atomic_long claimed_entries_ = {0};
+  std::atomic_long acked_entries_ = {0};
+};
+
+/**
+* Appends entries to Redis streams at high rates. Entries are serialized as
+* XADD commands into a buffer per stream, and each buffer is sent as one
+* pipelined batch once it holds enough entries or its oldest entry is old
+* enough. The ID assigned to each entry is reported back asynchronously, and
+* memory is bounded by a limit on entries not yet acknowledged by the server.
+*/
+class StreamProducer {
+
+public:
+  /**
+  * Reply callback, invoked from the event loop thread with the stream, the
+  * sequence number returned by add(), and the ID of the entry, which is
+  * empty if it could not be added.
+  */
+  typedef std::function<void(const std::string &, long, const std::string &)> ReplyCallback;
+
+  /**
+  * Constructor. Same as Redox.
+  */
+  StreamProducer(std::ostream &log_stream = std::cout, log::Level log_level = log::Warning);
+
+  /**
+  * Flushes and disconnects.
+  */
+  ~StreamProducer();
+
+  /**
+  * Same as .connect() on a Redox instance.
+  */
+  bool connect(const std::string &host = REDIS_DEFAULT_HOST, const int port = REDIS_DEFAULT_PORT);
+
+  /**
+  * Same as .connectUnix() on a Redox instance.
+  */
+  bool connectUnix(const std::string &path = REDIS_DEFAULT_PATH);
+
+  /**
+  * Sends all buffered entries, waits for their replies, and disconnects.
+  * Blocking call.
+  */
+  void disconnect();
+
+  /**
+  * The buffer of a stream is sent once it holds [count] entries, or once
+  * its oldest entry is [interval] seconds old, never if 0. Defaults are
+  * 1000 entries and 0.005 seconds.
+  */
+  void batchSize(size_t count, double interval);
+
+  /**
+  * Trims each stream to about [len] entries with MAXLEN ~ on every XADD.
+  * Disabled if 0, which is the default.
+  */
+  void maxLen(size_t len);
+
+  /**
+  * Maximum number of entries buffered or waiting for a reply. Once reached,
+  * add() blocks or fails until replies come back. Default is 1000000.
+  */
+  void maxPending(size_t entries);
+
+  /**
+  * Sets the callback that receives the ID of every entry. Set before adding
+  * entries.
+  */
+  void onReply(ReplyCallback callback);
+
+  /**
+  * Queues an entry with the given field-value pairs, [field, value, ...].
+  * Returns its sequence number, or -1 if the producer is at maxPending()
+  * and block is false, or if the connection is lost. Entries that were
+  * buffered when it was lost are failed through the reply callback. Can be
+  * called from any thread.
+  */
+  long add(const std::string &stream, const std::vector<std::string> &fields,
+           bool block = true);
+
+  /**
+  * Queues an entry with a single field-value pair, without building a vector.
+  */
+  long add(const std::string &stream, const std::string &field, const std::string &value,
+           bool block = true);
+
+  /**
+  * Sends the buffers of all streams now.
+  */
+  void flush();
+
+  /**
+  * Returns the number of entries added, acknowledged with an ID, and failed.
+  */
+  long added() const { return added_; }
+  long acked() const { return acked_; }
+  long failed() const { return failed_; }
+
+  /**
+  * Returns the number of entries buffered or waiting for a reply.
+  */
+  long pending() const { return pending_; }
+
+private:
+  // Entries of a stream not sent yet
+  struct Buffer {
+    std::string frames;
+    std::vector<size_t> ends;
+    std::vector<long> seqs;
+    std::chrono::steady_clock::time_point oldest;
+  };
+
+  // Base of both add() methods. The formatter appends the field-value pairs.
+  template <class Formatter>
+  long addBase(const std::string &stream, size_t num_args, const Formatter &format, bool block);
+
+  // Send the buffer of a stream as one batch. Called with guard_ held.
+  // Returns false if rdx_ is not running, leaving the batch in unsent_.
+  bool send(const std::string &stream, Buffer &buf);
+
+  // Fails the batches in unsent_. Called without guard_ held.
+  void failUnsent();
+
+  // Invoked by rdx_ when its connection state changes
+  void connectionChanged(int state);
+
+  // No more replies will come, wakes up anyone waiting for them
+  void connectionLost();
+
+  // Invoked with the reply to the entry at [index] of a batch of [count]
+  void reply(const std::string &stream, long seq, size_t index, size_t count, redisReply *r);
+
+  // Sends buffers whose oldest entry is too old, run in a separate thread
+  void runFlushThread();
+
+  log::Logger logger_;
+  Redox rdx_;
+  bool connected_ = false;
+  std::atomic_bool lost_ = {false}; // Connection lost, no more replies
+
+  // Settings
+  size_t batch_count_ = 1000;
+  double batch_interval_ = 0.005;
+  std::string max_len_;
+  long max_pending_ = 1000000;
+  ReplyCallback reply_callback_;
+
+  std::unordered_map<std::string, Buffer> buffers_;
+  std::vector<std::pair<std::string, std::vector<long>>> unsent_; // Stream and seqs
+  long next_seq_ = 0;
+  std::mutex guard_; // Guards all of the above
+
+  // Entries buffered or in flight, and a CV to wait for room
+  std::atomic_long pending_ = {0};
+  std::mutex space_guard_;
+  std::condition_variable space_cv_;
+
+  std::thread flush_thread_;
+  bool flush_exit_ = false;
+  std::condition_variable flush_cv_;
+
+  std::atomic_long added_ = {0};
+  std::atomic_long acked_ = {0};
+  std::atomic_long failed_ = {0};
+};
+
+// ------------------------------------------------
+// Implementation of templated methods
+// ------------------------------------------------
+
+template <class Formatter>
+long StreamProducer::addBase(const std::string &stream, size_t num_args, const Formatter &format,
+                             bool block) {
+
+  if (lost_)
+    return -1;
+
+  // Wait for room outside of guard_, since replies free it up
+  if (pending_ >= max_pending_) {
+    if (!block)
+      return -1;
+    std::unique_lock<std::mutex> ul(space_guard_);
+    space_cv_.wait(ul, [this] { return (pending_ < max_pending_) || lost_; });
+    if (lost_)
+      return -1;
+  }
+  pending_++;
+
+  std::unique_lock<std::mutex> ul(guard_);
+
+  Buffer &buf = buffers_[stream];
+  if (buf.ends.empty())
+    buf.oldest = std::chrono::steady_clock::now();
+
+  // XADD stream [MAXLEN ~ len] * field value ...
+  resp::appendHeader(buf.frames, 3 + (max_len_.empty() ? 0 : 3) + num_args);
+  resp::appendArg(buf.frames, "XADD", 4);
+  resp::appendArg(buf.frames, stream);
+  if (!max_len_.empty()) {
+    resp::appendArg(buf.frames, "MAXLEN", 6);
+    resp::appendArg(buf.frames, "~", 1);
+    resp::appendArg(buf.frames, max_len_);
+  }
+  resp::appendArg(buf.frames, "*", 1);
+  format(buf.frames);
+
+  long seq = next_seq_++;
+  buf.ends.push_back(buf.frames.size());
+  buf.seqs.push_back(seq);
+  added_++;
+
+  if ((buf.ends.size() >= batch_count_) && !send(stream, buf)) {
+    ul.unlock();
+    failUnsent();
+    return -1;
+  }
+
+  return seq;
+}
+
+} // End namespace
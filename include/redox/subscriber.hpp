@@ -20,13 +20,38 @@
 
 #pragma once
 
+#include <memory>
+#include <deque>
+#include <initializer_list>
+
 #include "client.hpp"
+#include "utils/bounded_queue.hpp"
 
 namespace redox {
 
 class Subscriber {
 
+  // Callbacks given to a single subscribe() or psubscribe() call
+  struct Handlers;
+
 public:
+  // Overflow policies for the delivery queue
+  static const int BLOCK = 0;       // Event loop waits for room, pushing back on the socket
+  static const int DROP_OLDEST = 1; // Discard the oldest queued message
+  static const int DROP_NEWEST = 2; // Discard the incoming message
+
+  /**
+  * A message received on a topic, as handed out by the delivery queue.
+  */
+  struct Message {
+    std::string topic;
+    std::string msg;
+
+  private:
+    std::shared_ptr<Handlers> handlers_;
+    friend class Subscriber;
+  };
+
   /**
   * Constructor. Same as Redox.
   */
@@ -42,24 +67,38 @@ public:
   */
   void noWait(bool state) { rdx_.noWait(state); }
 
+  /**
+  * Same as .attach() on a Redox instance.
+  */
+  void attach(EventLoopGroup &group) { rdx_.attach(group); }
+
+  /**
+  * Same as .threadOptions() on a Redox instance.
+  */
+  void threadOptions(const ThreadOptions &options) { rdx_.threadOptions(options); }
+
   /**
   * Same as .connect() on a Redox instance.
   */
   bool connect(const std::string &host = REDIS_DEFAULT_HOST, const int port = REDIS_DEFAULT_PORT,
-               std::function<void(int)> connection_callback = nullptr) {
-    return rdx_.connect(host, port, connection_callback);
+               std::function<void(int)> connection_callback = nullptr,
+               const SocketOptions &options = SocketOptions()) {
+    return rdx_.connect(host, port, connection_callback, options);
   }
 
   /**
   * Same as .connectUnix() on a Redox instance.
   */
   bool connectUnix(const std::string &path = REDIS_DEFAULT_PATH,
-                   std::function<void(int)> connection_callback = nullptr) {
-    return rdx_.connectUnix(path, connection_callback);
+                   std::function<void(int)> connection_callback = nullptr,
+                   const SocketOptions &options = SocketOptions()) {
+    return rdx_.connectUnix(path, connection_callback, options);
   }
 
   /**
-  * Same as .stop() on a Redox instance.
+  * Waits for pending subscriptions to be acknowledged, unsubscribes from
+  * everything with one UNSUBSCRIBE and one PUNSUBSCRIBE, then does the same
+  * as .stop() on a Redox instance once the server confirms.
   */
   void stop();
 
@@ -86,6 +125,27 @@ public:
                  std::function<void(const std::string &)> unsub_callback = nullptr,
                  std::function<void(const std::string &, int)> err_callback = nullptr);
 
+  /**
+  * Subscribe to many topics with a single SUBSCRIBE command. The callbacks
+  * are shared by all of the given topics, and are invoked with the topic
+  * that the event refers to.
+  */
+  void subscribe(const std::vector<std::string> &topics,
+                 std::function<void(const std::string &, const std::string &)> msg_callback,
+                 std::function<void(const std::string &)> sub_callback = nullptr,
+                 std::function<void(const std::string &)> unsub_callback = nullptr,
+                 std::function<void(const std::string &, int)> err_callback = nullptr);
+
+  // Disambiguates subscribe({"a", "b"}, ...) from the single topic version
+  void subscribe(std::initializer_list<std::string> topics,
+                 std::function<void(const std::string &, const std::string &)> msg_callback,
+                 std::function<void(const std::string &)> sub_callback = nullptr,
+                 std::function<void(const std::string &)> unsub_callback = nullptr,
+                 std::function<void(const std::string &, int)> err_callback = nullptr) {
+    subscribe(std::vector<std::string>(topics), msg_callback, sub_callback, unsub_callback,
+              err_callback);
+  }
+
   /**
   * Subscribe to a topic with a pattern.
   *
@@ -99,6 +159,74 @@ public:
                   std::function<void(const std::string &)> unsub_callback = nullptr,
                   std::function<void(const std::string &, int)> err_callback = nullptr);
 
+  /**
+  * Subscribe to many patterns with a single PSUBSCRIBE command. The callbacks
+  * are shared by all of the given patterns.
+  */
+  void psubscribe(const std::vector<std::string> &topics,
+                  std::function<void(const std::string &, const std::string &)> msg_callback,
+                  std::function<void(const std::string &)> sub_callback = nullptr,
+                  std::function<void(const std::string &)> unsub_callback = nullptr,
+                  std::function<void(const std::string &, int)> err_callback = nullptr);
+
+  // Disambiguates psubscribe({"a*", "b*"}, ...) from the single pattern version
+  void psubscribe(std::initializer_list<std::string> topics,
+                  std::function<void(const std::string &, const std::string &)> msg_callback,
+                  std::function<void(const std::string &)> sub_callback = nullptr,
+                  std::function<void(const std::string &)> unsub_callback = nullptr,
+                  std::function<void(const std::string &, int)> err_callback = nullptr) {
+    psubscribe(std::vector<std::string>(topics), msg_callback, sub_callback, unsub_callback,
+               err_callback);
+  }
+
+  /**
+  * Subscribe to a sharded topic (Redis 7 SSUBSCRIBE). The server must own
+  * the slot of the topic; see ShardedSubscriber for cluster-wide routing.
+  *
+  * unsub_callback is also invoked when the server drops the subscription
+  * because the slot of the topic moved to another node.
+  */
+  void ssubscribe(const std::string topic,
+                  std::function<void(const std::string &, const std::string &)> msg_callback,
+                  std::function<void(const std::string &)> sub_callback = nullptr,
+                  std::function<void(const std::string &)> unsub_callback = nullptr,
+                  std::function<void(const std::string &, int)> err_callback = nullptr);
+
+  /**
+  * Subscribe to many sharded topics with a single SSUBSCRIBE command. All of
+  * the topics must hash to the same slot.
+  */
+  void ssubscribe(const std::vector<std::string> &topics,
+                  std::function<void(const std::string &, const std::string &)> msg_callback,
+                  std::function<void(const std::string &)> sub_callback = nullptr,
+                  std::function<void(const std::string &)> unsub_callback = nullptr,
+                  std::function<void(const std::string &, int)> err_callback = nullptr);
+
+  /**
+  * Subscribe to topics in conflating mode. Instead of invoking a callback for
+  * every message, only the newest message of each topic is kept in a slot
+  * table, and consumers pull from it with drainConflated() at their own pace.
+  * Memory is bounded by the number of topics, however fast they publish.
+  */
+  void subscribeConflated(const std::vector<std::string> &topics,
+                          std::function<void(const std::string &)> sub_callback = nullptr,
+                          std::function<void(const std::string &)> unsub_callback = nullptr,
+                          std::function<void(const std::string &, int)> err_callback = nullptr);
+
+  /**
+  * Registers a new consumer of the conflated slot table and returns its ID.
+  * Each reader tracks separately which topics changed since its last drain.
+  */
+  int conflatedReader();
+
+  /**
+  * Invokes the callback with the newest message of each conflated topic that
+  * changed since this reader's last drain, and returns how many there were.
+  * A given reader must only be drained from one thread at a time.
+  */
+  size_t drainConflated(int reader,
+                        std::function<void(const std::string &, const std::string &)> callback);
+
   /**
   * Unsubscribe from a topic.
   *
@@ -115,6 +243,41 @@ public:
   void punsubscribe(const std::string topic,
                     std::function<void(const std::string &, int)> err_callback = nullptr);
 
+  /**
+  * Enables a delivery stage between the event loop and the user. Instead of
+  * invoking msg_callbacks on the event loop thread, incoming messages are
+  * pushed into a bounded lock-free queue of [capacity] messages and delivered
+  * by [num_threads] consumer threads, so a slow consumer does not stall the
+  * socket. Call before subscribing.
+  *
+  * overflow_policy: BLOCK, DROP_OLDEST or DROP_NEWEST when the queue is full
+  * batch_callback: if given, receives up to [max_batch] messages at a time
+  *                 instead of the per-topic msg_callbacks being invoked
+  *
+  * With more than one consumer thread, messages are not delivered in order.
+  */
+  void deliverAsync(size_t capacity, int num_threads, int overflow_policy = BLOCK,
+                    std::function<void(const std::vector<Message> &)> batch_callback = nullptr,
+                    size_t max_batch = 64);
+
+  /**
+  * Returns the number of messages discarded by the delivery queue overflow policy.
+  */
+  long deliveryDropped() const { return delivery_dropped_; }
+
+  /**
+  * Returns the number of messages waiting in the delivery queue.
+  */
+  size_t deliveryDepth() const { return delivery_queue_ ? delivery_queue_->size() : 0; }
+
+  /**
+  * Unsubscribe from a sharded topic.
+  *
+  * err_callback: invoked on some error state
+  */
+  void sunsubscribe(const std::string topic,
+                    std::function<void(const std::string &, int)> err_callback = nullptr);
+
   /**
   * Return the topics that are subscribed() to.
   */
@@ -131,18 +294,103 @@ public:
     return psubscribed_topics_;
   }
 
+  /**
+  * Return the sharded topics that are ssubscribed() to.
+  */
+  std::set<std::string> ssubscribedTopics() {
+    std::lock_guard<std::mutex> lg(ssubscribed_topics_guard_);
+    return ssubscribed_topics_;
+  }
+
 private:
+  // Shared by every topic subscribed to in that call
+  struct Handlers {
+    std::function<void(const std::string &, const std::string &)> msg_callback;
+    std::function<void(const std::string &)> sub_callback;
+    std::function<void(const std::string &)> unsub_callback;
+    std::function<void(const std::string &, int)> err_callback;
+    bool conflate = false;
+
+    // Instead of msg_callback, takes the message as a shared buffer
+    std::function<void(const std::string &, const std::shared_ptr<const std::string> &)>
+        shared_callback;
+  };
+
+  // Newest message of a conflated topic
+  struct Slot {
+    std::string topic;
+    std::string msg;
+    bool received = false;
+  };
+
+  // A reader's view of one slot
+  struct ReaderSlot {
+    bool dirty = false;
+    std::string value;
+  };
+
+  // Consumer of the slot table, with the slot IDs changed since its last drain
+  struct Reader {
+    std::deque<ReaderSlot> slots;
+    std::vector<size_t> changed;
+    std::vector<std::pair<const std::string *, const std::string *>> draining;
+  };
+
+  typedef std::unordered_map<std::string, std::shared_ptr<Handlers>> HandlerMap;
+
   // Base for subscribe and psubscribe
-  void subscribeBase(const std::string cmd_name, const std::string topic,
+  void subscribeBase(const std::string cmd_name, const std::vector<std::string> &topics,
                      std::function<void(const std::string &, const std::string &)> msg_callback,
                      std::function<void(const std::string &)> sub_callback = nullptr,
                      std::function<void(const std::string &)> unsub_callback = nullptr,
-                     std::function<void(const std::string &, int)> err_callback = nullptr);
+                     std::function<void(const std::string &, int)> err_callback = nullptr,
+                     bool conflate = false,
+                     std::function<void(const std::string &,
+                                        const std::shared_ptr<const std::string> &)>
+                         shared_callback = nullptr);
+
+  // Subscribe with the message built straight into a shared buffer, for the
+  // Multiplexer to fan out without copying it again
+  void subscribeShared(
+      const std::string cmd_name, const std::string &topic,
+      std::function<void(const std::string &, const std::shared_ptr<const std::string> &)>
+          msg_callback,
+      std::function<void(const std::string &)> unsub_callback) {
+    subscribeBase(cmd_name, {topic}, nullptr, nullptr, unsub_callback, nullptr, false,
+                  msg_callback);
+  }
+  friend class Multiplexer;
+
+  // Return the dispatch table for the given [p|s]subscribe command
+  HandlerMap &handlersFor(const std::string &cmd_name);
 
-  // Base for unsubscribe and punsubscribe
+  // Base for unsubscribe, punsubscribe and sunsubscribe
   void unsubscribeBase(const std::string cmd_name, const std::string topic,
                        std::function<void(const std::string &, int)> err_callback = nullptr);
 
+  // Single entry point for every reply to a [p]subscribe command. Routes
+  // messages and acknowledgements to the registered handlers.
+  void dispatch(Command<redisReply *> &c);
+
+  // Hand a message to its handlers, either directly or through the delivery queue
+  void deliver(const std::shared_ptr<Handlers> &h, const char *topic, size_t topic_len,
+               const char *msg, size_t msg_len);
+
+  // Store a message in the slot table of a conflated topic
+  void conflate(const char *topic, size_t topic_len, const char *msg, size_t msg_len);
+
+  // Main loop of a delivery consumer thread
+  void runDeliveryThread();
+
+  // Stop and join the delivery consumer threads
+  void stopDelivery();
+
+  // Mark the given number of pending subscriptions as resolved
+  void subsResolved(int n);
+
+  // Return the handlers registered for the given topic, or nullptr
+  std::shared_ptr<Handlers> findHandlers(HandlerMap &handlers, const char *topic, size_t len);
+
   // Underlying Redis client
   Redox rdx_;
 
@@ -155,8 +403,19 @@ private:
   std::set<std::string> psubscribed_topics_;
   std::mutex psubscribed_topics_guard_;
 
+  std::set<std::string> ssubscribed_topics_;
+  std::mutex ssubscribed_topics_guard_;
+
+  // Dispatch tables of topics, patterns and sharded topics (both pending
+  // and acknowledged) to their handlers
+  HandlerMap channel_handlers_;
+  HandlerMap pattern_handlers_;
+  HandlerMap shard_handlers_;
+  std::mutex handlers_guard_;
+
   // Set of persisting commands, so that we can cancel them
   std::set<Command<redisReply *> *> commands_;
+  std::mutex commands_guard_;
 
   // Reference to rdx_.logger_ for convenience
   log::Logger &logger_;
@@ -164,9 +423,33 @@ private:
   // CVs to wait for unsubscriptions
   std::condition_variable cv_unsub_;
   std::condition_variable cv_punsub_;
+  std::condition_variable cv_sunsub_;
+
+  // Delivery queue and its consumer threads, if enabled
+  std::unique_ptr<BoundedQueue<Message>> delivery_queue_;
+  std::vector<std::thread> delivery_threads_;
+  int delivery_policy_ = BLOCK;
+  std::function<void(const std::vector<Message> &)> delivery_batch_callback_;
+  size_t delivery_max_batch_ = 64;
+  std::atomic_long delivery_dropped_ = {0};
+  std::atomic_bool delivery_exit_ = {false};
+
+  // Consumers sleep on this CV when the queue is empty
+  std::mutex delivery_idle_guard_;
+  std::condition_variable delivery_idle_cv_;
+  std::atomic_int delivery_idle_ = {0};
+
+  // Slot table for conflated topics. Deques keep references to slots
+  // valid while new topics are added.
+  std::deque<Slot> slots_;
+  std::unordered_map<std::string, size_t> slot_index_;
+  std::vector<std::unique_ptr<Reader>> readers_;
+  std::mutex slots_guard_;
 
-  // Pending subscriptions
+  // Pending subscriptions, and a CV to wait for them to be acknowledged
   std::atomic_int num_pending_subs_ = {0};
+  std::mutex pending_subs_guard_;
+  std::condition_variable cv_pending_subs_;
 };
 
 } // End namespace
@@ -0,0 +1,142 @@
+/*
+* Redox - A modern, asynchronous, and wicked fast C++11 client for Redis
+*
+*    https://github.com/hmartiro/redox
+*
+* Copyright 2015 - Hayk Martirosyan <hayk.mart at gmail dot com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <cstddef>
+#include <cstdint>
+
+namespace redox {
+
+/**
+* A bounded, lock-free, multi-producer multi-consumer queue. Each slot
+* carries a sequence number that tells producers and consumers whether it
+* is free or full for their lap around the ring, so push() and pop() are
+* a single CAS on the shared position in the uncontended case.
+*
+* Adapted from Dmitry Vyukov's bounded MPMC queue.
+*/
+template <class T> class BoundedQueue {
+
+public:
+  /**
+  * Constructor. The capacity is rounded up to a power of two.
+  */
+  explicit BoundedQueue(size_t capacity) : mask_(roundUp(capacity) - 1),
+      cells_(new Cell[mask_ + 1]) {
+    for (size_t i = 0; i <= mask_; i++)
+      cells_[i].seq.store(i, std::memory_order_relaxed);
+  }
+
+  /**
+  * Moves the value into the queue. Returns false if the queue is full.
+  */
+  bool push(T &&value) {
+    Cell *cell;
+    size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+    while (true) {
+      cell = &cells_[pos & mask_];
+      size_t seq = cell->seq.load(std::memory_order_acquire);
+      intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+      if (diff == 0) {
+        if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+          break;
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = enqueue_pos_.load(std::memory_order_relaxed);
+      }
+    }
+    cell->data = std::move(value);
+    cell->seq.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  /**
+  * Moves the oldest value out of the queue. Returns false if the queue is empty.
+  */
+  bool pop(T &value) {
+    Cell *cell;
+    size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+    while (true) {
+      cell = &cells_[pos & mask_];
+      size_t seq = cell->seq.load(std::memory_order_acquire);
+      intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+      if (diff == 0) {
+        if (dequeue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+          break;
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = dequeue_pos_.load(std::memory_order_relaxed);
+      }
+    }
+    value = std::move(cell->data);
+    cell->seq.store(pos + mask_ + 1, std::memory_order_release);
+    return true;
+  }
+
+  /**
+  * Returns the number of slots in the queue.
+  */
+  size_t capacity() const { return mask_ + 1; }
+
+  /**
+  * Returns the number of queued values. Only a snapshot if other threads
+  * are pushing or popping.
+  */
+  size_t size() const {
+    size_t head = dequeue_pos_.load(std::memory_order_relaxed);
+    size_t tail = enqueue_pos_.load(std::memory_order_relaxed);
+    return (tail > head) ? (tail - head) : 0;
+  }
+
+private:
+  struct Cell {
+    std::atomic<size_t> seq;
+    T data;
+  };
+
+  static size_t roundUp(size_t n) {
+    size_t cap = 2;
+    while (cap < n)
+      cap <<= 1;
+    return cap;
+  }
+
+  const size_t mask_;
+  std::unique_ptr<Cell[]> cells_;
+
+  // Keep the two positions on separate cache lines, since one is
+  // written by producers and the other by consumers. Padded rather than
+  // aligned, since operator new ignores over-alignment before C++17.
+  char pad0_[64];
+  std::atomic<size_t> enqueue_pos_ = {0};
+  char pad1_[64 - sizeof(std::atomic<size_t>)];
+  std::atomic<size_t> dequeue_pos_ = {0};
+  char pad2_[64 - sizeof(std::atomic<size_t>)];
+
+  BoundedQueue(const BoundedQueue &) = delete;
+  BoundedQueue &operator=(const BoundedQueue &) = delete;
+};
+
+} // End namespace redox
@@ -0,0 +1,164 @@
+/*
+* Redox - A modern, asynchronous, and wicked fast C++11 client for Redis
+*
+*    https://github.com/hmartiro/redox
+*
+* Copyright 2015 - Hayk Martirosyan <hayk.mart at gmail dot com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+namespace redox {
+
+/**
+* A histogram of non-negative integer values, such as latencies in
+* nanoseconds, in the style of HdrHistogram. Each power of two is split
+* into 16 linear sub-buckets, so any recorded value is known to within
+* about 6%, over the whole 64-bit range, in a fixed 8 KB of buckets.
+*
+* record() is wait-free and can be called from any thread. snapshot()
+* copies the buckets with relaxed loads, so it never blocks recording.
+*/
+class Histogram {
+
+public:
+  static const int SUB_BITS = 4;
+  static const int SUB_BUCKETS = 1 << SUB_BITS;
+  static const int NUM_BUCKETS = (64 - SUB_BITS + 1) * SUB_BUCKETS;
+
+  /**
+  * A copy of the histogram at one point in time.
+  */
+  class Snapshot {
+
+  public:
+    Snapshot() : counts(NUM_BUCKETS, 0) {}
+
+    /**
+    * Returns the mean of the recorded values.
+    */
+    double mean() const { return (count == 0) ? 0 : (double)sum / count; }
+
+    /**
+    * Returns the value below which the given fraction (0 to 1) of the
+    * recorded values fall, as the upper edge of its bucket.
+    */
+    uint64_t percentile(double fraction) const {
+      if (count == 0)
+        return 0;
+      uint64_t target = (uint64_t)(fraction * count);
+      if (target >= count)
+        target = count - 1;
+      uint64_t seen = 0;
+      for (int i = 0; i < NUM_BUCKETS; i++) {
+        seen += counts[i];
+        if (seen > target)
+          return (highest(i) < max) ? highest(i) : max;
+      }
+      return max;
+    }
+
+    /**
+    * Adds the values of another snapshot into this one.
+    */
+    void merge(const Snapshot &other) {
+      for (int i = 0; i < NUM_BUCKETS; i++)
+        counts[i] += other.counts[i];
+      count += other.count;
+      sum += other.sum;
+      if (other.max > max)
+        max = other.max;
+    }
+
+    std::vector<uint64_t> counts; // By bucket index
+    uint64_t count = 0;
+    uint64_t sum = 0;
+    uint64_t max = 0;
+  };
+
+  Histogram() {
+    for (int i = 0; i < NUM_BUCKETS; i++)
+      buckets_[i].store(0, std::memory_order_relaxed);
+  }
+
+  /**
+  * Records one value.
+  */
+  void record(uint64_t value) {
+    buckets_[index(value)].fetch_add(1, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+    sum_.fetch_add(value, std::memory_order_relaxed);
+    uint64_t max = max_.load(std::memory_order_relaxed);
+    while ((value > max) && !max_.compare_exchange_weak(max, value, std::memory_order_relaxed)) {
+    }
+  }
+
+  /**
+  * Returns a copy of the histogram.
+  */
+  Snapshot snapshot() const {
+    Snapshot s;
+    for (int i = 0; i < NUM_BUCKETS; i++)
+      s.counts[i] = buckets_[i].load(std::memory_order_relaxed);
+    s.count = count_.load(std::memory_order_relaxed);
+    s.sum = sum_.load(std::memory_order_relaxed);
+    s.max = max_.load(std::memory_order_relaxed);
+    return s;
+  }
+
+  /**
+  * Returns the bucket index of a value.
+  */
+  static int index(uint64_t value) {
+    if (value < (uint64_t)SUB_BUCKETS)
+      return (int)value;
+    int exponent = 63 - __builtin_clzll(value);
+    int shift = exponent - SUB_BITS;
+    return (shift + 1) * SUB_BUCKETS + (int)((value >> shift) & (SUB_BUCKETS - 1));
+  }
+
+  /**
+  * Returns the lowest and highest values that fall in a bucket.
+  */
+  static uint64_t lowest(int index) {
+    if (index < SUB_BUCKETS)
+      return index;
+    int shift = index / SUB_BUCKETS - 1;
+    return (uint64_t)(SUB_BUCKETS + index % SUB_BUCKETS) << shift;
+  }
+
+  static uint64_t highest(int index) {
+    if (index < SUB_BUCKETS)
+      return index;
+    int shift = index / SUB_BUCKETS - 1;
+    return lowest(index) + (((uint64_t)1 << shift) - 1);
+  }
+
+private:
+  std::atomic<uint64_t> buckets_[NUM_BUCKETS];
+  std::atomic<uint64_t> count_ = {0};
+  std::atomic<uint64_t> sum_ = {0};
+  std::atomic<uint64_t> max_ = {0};
+
+  Histogram(const Histogram &) = delete;
+  Histogram &operator=(const Histogram &) = delete;
+};
+
+} // End namespace redox
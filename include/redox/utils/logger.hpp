@@ -12,6 +12,12 @@
 #include <mutex>
 #include <memory>
 #include <fstream>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <condition_variable>
+
+#include "bounded_queue.hpp"
 
 namespace redox {
 namespace log {
@@ -51,8 +57,25 @@ public:
   void level(Level l) { m_loglevel = l; }
   Level level() { return m_loglevel; }
 
+  // True if messages of the given level are written
+  bool enabled(Level l) const { return m_loglevel <= l; }
+
   void log(Level l, std::string oMessage);
 
+  /**
+  * Switches to asynchronous output. Messages are copied into fixed-size
+  * records in a lock-free ring of [capacity] records, and a background
+  * thread formats and writes them in batches, so logging never blocks the
+  * caller. Messages longer than a record are truncated, and messages are
+  * dropped while the ring is full. Call once, before logging starts.
+  */
+  void async(size_t capacity = 8192);
+
+  /**
+  * Returns the number of messages dropped because the ring was full.
+  */
+  long dropped() const { return m_dropped; }
+
   Logstream operator()(Level l = Level::Info) { return Logstream(*this, l); }
 
   // Helpers
@@ -66,6 +89,17 @@ public:
 private:
   const tm *getLocalTime();
 
+  // One message in the ring of the asynchronous sink
+  struct Record {
+    std::chrono::system_clock::time_point time;
+    Level level;
+    unsigned short len;
+    char text[230];
+  };
+
+  // Drains the ring to the stream, run in a separate thread
+  void runWriter();
+
 private:
   std::mutex m_lock;
 
@@ -75,7 +109,30 @@ private:
   tm m_time;
 
   Level m_loglevel;
+
+  // Asynchronous sink, if enabled
+  std::unique_ptr<BoundedQueue<Record>> m_queue;
+  std::thread m_writer;
+  std::atomic_bool m_exit = {false};
+  std::mutex m_exit_lock;
+  std::condition_variable m_exit_cv;
+  std::atomic_long m_dropped = {0};
 };
 
 } // End namespace
 } // End namespace
+
+/**
+* Level-gated logging. The level is checked before a Logstream is created,
+* so nothing after the macro is evaluated when the level is disabled:
+*
+*   REDOX_LOG(logger_, Error) << cmd() << ": " << last_error_;
+*
+* Prefer it over logger_.error() << ... wherever the message is costly to
+* build or the line is on a hot path.
+*/
+#define REDOX_LOG(logger, lvl)                                                                     \
+  if (!(logger).enabled(redox::log::lvl))                                                          \
+    ;                                                                                              \
+  else                                                                                             \
+    (logger)(redox::log::lvl)
@@ -0,0 +1,67 @@
+/*
+* Redox - A modern, asynchronous, and wicked fast C++11 client for Redis
+*
+*    https://github.com/hmartiro/redox
+*
+* Copyright 2015 - Hayk Martirosyan <hayk.mart at gmail dot com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <stddef.h>
+
+namespace redox {
+
+/**
+* Where and how an event loop thread runs. By default it is left to the
+* scheduler, which may move it between cores and costs cache misses and
+* latency spikes. Linux only, except for the scheduling policy.
+*/
+struct ThreadOptions {
+
+  // CPUs the thread may run on, empty for any
+  std::vector<int> cpus;
+
+  // Scheduling policy (SCHED_FIFO, SCHED_RR, ...) and its priority, -1 to
+  // keep the default. Real-time policies need CAP_SYS_NICE or an rtprio limit.
+  int policy = -1;
+  int priority = 0;
+
+  // Allocate the memory of the thread, and of the buffers of its connections,
+  // on the NUMA node of its CPUs, whatever the policy of the process
+  bool numa_local = false;
+};
+
+/**
+* Applies [options] to the calling thread. Returns false and says what failed
+* in [error] on failure, having applied what it could.
+*/
+bool placeThread(const ThreadOptions &options, std::string &error);
+
+/**
+* Returns the NUMA node that all of [cpus] are on, or -1 if there are none,
+* they span nodes, or it is not known.
+*/
+int numaNode(const std::vector<int> &cpus);
+
+/**
+* Prefers NUMA [node] for the pages of [addr, addr + length), moving those
+* already there. Returns false on failure.
+*/
+bool bindMemory(void *addr, size_t length, int node);
+
+} // End namespace
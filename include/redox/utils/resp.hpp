@@ -0,0 +1,292 @@
+/*
+* Redox - A modern, asynchronous, and wicked fast C++11 client for Redis
+*
+*    https://github.com/hmartiro/redox
+*
+* Copyright 2015 - Hayk Martirosyan <hayk.mart at gmail dot com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+namespace redox {
+namespace resp {
+
+/**
+* Helpers to serialize commands in the Redis protocol (RESP) straight into
+* a caller-owned buffer. Appending to a buffer that is reused keeps the
+* send path free of allocations once the buffer has grown to size.
+*/
+
+/**
+* Appends a decimal number and CRLF.
+*/
+inline void appendNumber(std::string &out, size_t n) {
+  char digits[24];
+  char *p = digits + sizeof(digits);
+  do {
+    *--p = '0' + (n % 10);
+    n /= 10;
+  } while (n != 0);
+  out.append(p, digits + sizeof(digits) - p);
+  out.append("\r\n", 2);
+}
+
+/**
+* Appends the header of a command with the given number of arguments.
+*/
+inline void appendHeader(std::string &out, size_t argc) {
+  out.push_back('*');
+  appendNumber(out, argc);
+}
+
+/**
+* Appends one argument of a command as a bulk string.
+*/
+inline void appendArg(std::string &out, const char *data, size_t len) {
+  out.push_back('$');
+  appendNumber(out, len);
+  out.append(data, len);
+  out.append("\r\n", 2);
+}
+
+inline void appendArg(std::string &out, const std::string &arg) {
+  appendArg(out, arg.data(), arg.size());
+}
+
+/**
+* Returns the number of decimal digits of a number.
+*/
+inline size_t numDigits(uint64_t n) {
+  size_t digits = 1;
+  while (n >= 10) {
+    n /= 10;
+    digits++;
+  }
+  return digits;
+}
+
+/**
+* Returns the serialized size of a command header, and of one argument.
+*/
+inline size_t headerSize(size_t argc) { return 1 + numDigits(argc) + 2; }
+inline size_t argSize(size_t len) { return 1 + numDigits(len) + 2 + len + 2; }
+
+/**
+* Appends a whole command.
+*/
+inline void appendCommand(std::string &out, const std::vector<std::string> &cmd) {
+  appendHeader(out, cmd.size());
+  for (const std::string &arg : cmd)
+    appendArg(out, arg);
+}
+
+/**
+* Writes the decimal digits of a number so that they end at [end], two at a
+* time.
+*/
+inline void writeDigits(char *end, uint64_t n) {
+  static const char pairs[] = "00010203040506070809101112131415161718192021222324"
+                              "25262728293031323334353637383940414243444546474849"
+                              "50515253545556575859606162636465666768697071727374"
+                              "75767778798081828384858687888990919293949596979899";
+  while (n >= 100) {
+    const char *pair = pairs + 2 * (n % 100);
+    n /= 100;
+    *--end = pair[1];
+    *--end = pair[0];
+  }
+  if (n >= 10) {
+    *--end = pairs[2 * n + 1];
+    *--end = pairs[2 * n];
+  } else {
+    *--end = '0' + n;
+  }
+}
+
+// Writes a decimal number and CRLF, returning the end
+inline char *writeNumber(char *p, uint64_t n) {
+  p += numDigits(n);
+  writeDigits(p, n);
+  *p++ = '\r';
+  *p++ = '\n';
+  return p;
+}
+
+// Whether an argument is a run of bytes, with data() and size()
+template <class T> class IsBytes {
+  template <class U>
+  static auto test(const U *u)
+      -> decltype(static_cast<const char *>(u->data()), u->size(), std::true_type());
+  template <class U> static std::false_type test(...);
+
+public:
+  static const bool value = decltype(test<T>(nullptr))::value;
+};
+
+// Arguments of commands from appendCommandArgs() by type: the length of one,
+// and writing its data. Bytes (std::string, or any view with data() and
+// size()) are read in place, C strings, string literals and char arrays
+// measured, the latter no further than their size, and integers formatted
+// straight into the output.
+template <class T>
+typename std::enable_if<IsBytes<T>::value, size_t>::type argLength(const T &bytes) {
+  return bytes.size();
+}
+
+template <class T>
+typename std::enable_if<IsBytes<T>::value, char *>::type writeData(char *p, const T &bytes,
+                                                                  size_t len) {
+  memcpy(p, bytes.data(), len);
+  return p + len;
+}
+
+template <size_t N> size_t argLength(const char (&str)[N]) { return strnlen(str, N - 1); }
+template <size_t N> size_t argLength(char (&str)[N]) { return strnlen(str, N - 1); }
+
+template <class T>
+typename std::enable_if<std::is_same<T, const char *>::value || std::is_same<T, char *>::value,
+                        size_t>::type
+argLength(T str) {
+  return strlen(str);
+}
+
+inline char *writeData(char *p, const char *str, size_t len) {
+  memcpy(p, str, len);
+  return p + len;
+}
+
+template <class T> bool negative(T n, std::true_type) { return n < 0; }
+template <class T> bool negative(T, std::false_type) { return false; }
+
+template <class T>
+typename std::enable_if<std::is_integral<T>::value && !std::is_same<T, bool>::value, size_t>::type
+argLength(T n) {
+  bool minus = negative(n, std::is_signed<T>());
+  return minus + numDigits(minus ? 0 - (uint64_t)n : (uint64_t)n);
+}
+
+template <class T>
+typename std::enable_if<std::is_integral<T>::value && !std::is_same<T, bool>::value, char *>::type
+writeData(char *p, T n, size_t len) {
+  bool minus = negative(n, std::is_signed<T>());
+  if (minus)
+    *p = '-';
+  writeDigits(p + len, minus ? 0 - (uint64_t)n : (uint64_t)n);
+  return p + len;
+}
+
+// Whether the data of an argument goes into the output. Types whose data is
+// written from where it is instead overload this, see redox::Buffer.
+template <class T> bool inlined(const T &, size_t) { return true; }
+
+// Bytes one argument adds to the output, less its data if that is not
+// inlined but left as a hole
+template <class T>
+size_t payloadSize(const T &arg, size_t len, const std::vector<size_t> *holes) {
+  if ((holes == nullptr) || inlined(arg, len))
+    return argSize(len);
+  return argSize(len) - len;
+}
+
+// Writes one argument as a bulk string, of the given length, or only its
+// header if its data is not inlined, adding where the data goes to [holes]
+template <class T>
+char *writeArg(char *p, const T &arg, size_t len, const char *begin,
+               std::vector<size_t> *holes) {
+  *p++ = '$';
+  p = writeNumber(p, len);
+  if ((holes == nullptr) || inlined(arg, len))
+    p = writeData(p, arg, len);
+  else
+    holes->push_back(p - begin);
+  *p++ = '\r';
+  *p++ = '\n';
+  return p;
+}
+
+/**
+* Appends a whole command made of [args], which can be strings, string
+* literals, views with data() and size(), and integers. Its size is worked
+* out first, so the output grows at most once, and no other copies of the
+* arguments are made. Given [holes], arguments whose data is not inlined
+* leave a hole between their header and CRLF, whose offset in [out] goes
+* to [holes].
+*/
+template <class... Args>
+void formatCommand(std::string &out, std::vector<size_t> *holes, Args &&... args) {
+
+  static_assert(sizeof...(Args) > 0, "A command needs a name.");
+  const size_t lens[] = {argLength(args)...};
+
+  size_t size = headerSize(sizeof...(Args));
+  const size_t *len = lens;
+  int sizes[] = {(size += payloadSize(args, *len++, holes), 0)...};
+  (void)sizes;
+
+  size_t begin = out.size();
+  out.resize(begin + size);
+  char *p = &out[begin];
+  *p++ = '*';
+  p = writeNumber(p, sizeof...(Args));
+
+  len = lens;
+  int expand[] = {(p = writeArg(p, args, *len++, out.data(), holes), 0)...};
+  (void)expand;
+}
+
+template <class... Args> void appendCommandArgs(std::string &out, Args &&... args) {
+  formatCommand(out, nullptr, std::forward<Args>(args)...);
+}
+
+/**
+* Returns the arguments of a serialized command, at most [max] of them.
+* Arguments at [holes], left by formatCommand(), are shown by their size.
+* Used when a command needs to be shown, not on the send path.
+*/
+inline std::vector<std::string> parseCommand(const std::string &frame, size_t max = SIZE_MAX,
+                                             const std::vector<size_t> &holes = {}) {
+
+  std::vector<std::string> args;
+  if (frame.empty() || (frame[0] != '*'))
+    return args;
+
+  char *end;
+  size_t argc = strtoul(frame.c_str() + 1, &end, 10);
+  size_t at = end - frame.c_str() + 2;
+  auto hole = holes.begin();
+  for (size_t i = 0; (i < argc) && (i < max) && (at < frame.size()); i++) {
+    size_t len = strtoul(frame.c_str() + at + 1, &end, 10);
+    at = end - frame.c_str() + 2;
+    if ((hole != holes.end()) && (*hole == at)) {
+      args.push_back("<" + std::to_string(len) + " bytes>");
+      hole++;
+      at += 2;
+    } else {
+      args.emplace_back(frame, at, len);
+      at += len + 2;
+    }
+  }
+  return args;
+}
+
+} // End namespace resp
+} // End namespace redox
@@ -0,0 +1,54 @@
+/*
+* Redox - A modern, asynchronous, and wicked fast C++11 client for Redis
+*
+*    https://github.com/hmartiro/redox
+*
+* Copyright 2015 - Hayk Martirosyan <hayk.mart at gmail dot com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#pragma once
+
+/**
+* USDT (statically defined) tracepoints under the provider "redox", for
+* perf, bpftrace and SystemTap. Compiled in when REDOX_USDT is defined (the
+* CMake option usdt), and otherwise compiled out along with their arguments.
+*
+* A probe is a single nop until a tracer attaches to it, so arguments should
+* be values already at hand. List them with:
+*
+*   bpftrace -l 'usdt:/usr/lib/libredox.so:redox:*'
+*/
+
+#ifdef REDOX_USDT
+
+#include <sys/sdt.h>
+
+#define REDOX_PROBE1(name, a) DTRACE_PROBE1(redox, name, a)
+#define REDOX_PROBE2(name, a, b) DTRACE_PROBE2(redox, name, a, b)
+#define REDOX_PROBE3(name, a, b, c) DTRACE_PROBE3(redox, name, a, b, c)
+
+#else
+
+#define REDOX_PROBE1(name, a)                                                                      \
+  do {                                                                                             \
+  } while (0)
+#define REDOX_PROBE2(name, a, b)                                                                   \
+  do {                                                                                             \
+  } while (0)
+#define REDOX_PROBE3(name, a, b, c)                                                                \
+  do {                                                                                             \
+  } while (0)
+
+#endif
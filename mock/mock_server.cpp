@@ -0,0 +1,552 @@
+/*
+* Redox - A modern, asynchronous, and wicked fast C++11 client for Redis
+*
+*    https://github.com/hmartiro/redox
+*
+* Copyright 2015 - Hayk Martirosyan <hayk.mart at gmail dot com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <fnmatch.h>
+#include <string.h>
+#include <signal.h>
+#include <ctype.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <algorithm>
+#include "mock_server.hpp"
+
+using namespace std;
+
+namespace redox {
+
+namespace {
+
+typedef chrono::steady_clock::time_point time_point;
+
+// libev's init macros trip strict aliasing warnings in C++
+template <typename tio, typename tcb> void mock_ev_io_init(tio io, tcb cb, int fd, int events) {
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wstrict-aliasing"
+  ev_io_init(io, cb, fd, events);
+#pragma GCC diagnostic pop
+}
+
+template <typename ttimer, typename tcb> void mock_ev_timer_init(ttimer timer, tcb cb) {
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wstrict-aliasing"
+  ev_timer_init(timer, cb, 0, 0);
+#pragma GCC diagnostic pop
+}
+
+template <typename ttimer> void mock_ev_timer_set(ttimer timer, double after) {
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wstrict-aliasing"
+  ev_timer_set(timer, after, 0);
+#pragma GCC diagnostic pop
+}
+
+template <typename tev> bool mock_ev_is_active(tev ev) {
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wstrict-aliasing"
+  return ev_is_active(ev);
+#pragma GCC diagnostic pop
+}
+
+template <typename tev, typename tcb> void mock_ev_async_init(tev ev, tcb cb) {
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wstrict-aliasing"
+  ev_async_init(ev, cb);
+#pragma GCC diagnostic pop
+}
+
+string upper(string s) {
+  for (char &ch : s)
+    ch = toupper((unsigned char)ch);
+  return s;
+}
+
+/**
+* Parses one command, an array of bulk strings, from [in] at [pos]. Returns 1
+* and advances [pos] if complete, 0 if more data is needed, or -1 on a
+* protocol error.
+*/
+int parseCommand(const string &in, size_t &pos, vector<string> &args) {
+
+  size_t p = pos;
+
+  // Reads a number terminated by CRLF after a type byte
+  auto number = [&in, &p](char type, long &n) -> int {
+    if (p >= in.size())
+      return 0;
+    if (in[p] != type)
+      return -1;
+    size_t end = in.find("\r\n", p);
+    if (end == string::npos)
+      return 0;
+    char *stop;
+    n = strtol(in.c_str() + p + 1, &stop, 10);
+    if (stop != in.c_str() + end)
+      return -1;
+    p = end + 2;
+    return 1;
+  };
+
+  long argc;
+  int r = number('*', argc);
+  if (r <= 0)
+    return r;
+
+  args.clear();
+  for (long i = 0; i < argc; i++) {
+    long len;
+    r = number('$', len);
+    if (r <= 0)
+      return r;
+    if ((len < 0) || (p + len + 2 > in.size()))
+      return (len < 0) ? -1 : 0;
+    args.emplace_back(in, p, len);
+    p += len + 2;
+  }
+
+  pos = p;
+  return 1;
+}
+
+} // anonymous
+
+struct MockServer::Connection {
+  MockServer *server;
+  int fd;
+  ev_io watcher_read;
+  ev_io watcher_write;
+  ev_timer watcher_delay;
+
+  string in;
+  string out;
+  size_t out_pos = 0;
+  bool writing = false;
+
+  // Data waiting out the injected latency, by due time
+  deque<pair<time_point, string>> delayed;
+
+  set<string> channels;
+  set<string> patterns;
+  long commands = 0;
+  bool reply_off = false;
+};
+
+MockServer::MockServer() : random_(random_device()()) {}
+
+MockServer::~MockServer() { stop(); }
+
+bool MockServer::start(int port) {
+
+  signal(SIGPIPE, SIG_IGN);
+
+  listen_fd_ = socket(AF_INET, SOCK_STREAM, 0);
+  if (listen_fd_ < 0)
+    return false;
+
+  int on = 1;
+  setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+  sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(port);
+
+  socklen_t addr_len = sizeof(addr);
+  if ((bind(listen_fd_, (sockaddr *)&addr, sizeof(addr)) != 0) || (listen(listen_fd_, 128) != 0) ||
+      (getsockname(listen_fd_, (sockaddr *)&addr, &addr_len) != 0)) {
+    ::close(listen_fd_);
+    listen_fd_ = -1;
+    return false;
+  }
+  port_ = ntohs(addr.sin_port);
+  fcntl(listen_fd_, F_SETFL, fcntl(listen_fd_, F_GETFL) | O_NONBLOCK);
+
+  loop_ = ev_loop_new(EVFLAG_AUTO);
+  ev_set_userdata(loop_, (void *)this);
+
+  mock_ev_io_init(&watcher_accept_, onAccept, listen_fd_, EV_READ);
+  ev_io_start(loop_, &watcher_accept_);
+
+  mock_ev_async_init(&watcher_control_, onControl);
+  ev_async_start(loop_, &watcher_control_);
+
+  stop_ = false;
+  thread_ = thread([this] { ev_run(loop_, 0); });
+  return true;
+}
+
+void MockServer::stop() {
+
+  if (!thread_.joinable())
+    return;
+
+  stop_ = true;
+  ev_async_send(loop_, &watcher_control_);
+  thread_.join();
+
+  ev_loop_destroy(loop_);
+  loop_ = nullptr;
+  ::close(listen_fd_);
+  listen_fd_ = -1;
+}
+
+void MockServer::reply(const string &cmd, const string &resp) {
+  handle(cmd, [resp](const vector<string> &) { return resp; });
+}
+
+void MockServer::handle(const string &cmd, Handler handler) {
+  lock_guard<mutex> lg(handlers_guard_);
+  handlers_[upper(cmd)] = handler;
+}
+
+void MockServer::latency(double seconds, double jitter) {
+  latency_ns_ = (long long)(seconds * 1e9);
+  jitter_ns_ = (long long)(jitter * 1e9);
+}
+
+void MockServer::partialWrites(size_t max_bytes) { max_write_ = max_bytes; }
+
+void MockServer::disconnectAfter(long commands) { disconnect_after_ = commands; }
+
+void MockServer::disconnectAll() {
+  if (loop_ == nullptr)
+    return;
+  disconnect_ = true;
+  ev_async_send(loop_, &watcher_control_);
+}
+
+string MockServer::status(const string &s) { return "+" + s + "\r\n"; }
+
+string MockServer::error(const string &s) { return "-" + s + "\r\n"; }
+
+string MockServer::integer(long long n) { return ":" + to_string(n) + "\r\n"; }
+
+string MockServer::bulk(const string &s) { return "$" + to_string(s.size()) + "\r\n" + s + "\r\n"; }
+
+string MockServer::nil() { return "$-1\r\n"; }
+
+string MockServer::array(const vector<string> &bulks) {
+  string out = "*" + to_string(bulks.size()) + "\r\n";
+  for (const string &s : bulks)
+    out += bulk(s);
+  return out;
+}
+
+void MockServer::onAccept(struct ev_loop *loop, ev_io *w, int revents) {
+
+  MockServer *server = (MockServer *)ev_userdata(loop);
+
+  int fd = accept(w->fd, nullptr, nullptr);
+  if (fd < 0)
+    return;
+
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  int on = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+  Connection *c = new Connection();
+  c->server = server;
+  c->fd = fd;
+
+  mock_ev_io_init(&c->watcher_read, onRead, fd, EV_READ);
+  mock_ev_io_init(&c->watcher_write, onWrite, fd, EV_WRITE);
+  mock_ev_timer_init(&c->watcher_delay, onDelay);
+  c->watcher_read.data = c->watcher_write.data = c->watcher_delay.data = c;
+  ev_io_start(loop, &c->watcher_read);
+
+  server->connections_.insert(c);
+  server->connections_accepted_++;
+}
+
+void MockServer::onRead(struct ev_loop *loop, ev_io *w, int revents) {
+
+  Connection *c = (Connection *)w->data;
+  MockServer *server = c->server;
+
+  char buf[16384];
+  ssize_t n = read(c->fd, buf, sizeof(buf));
+  if (n == 0 || ((n < 0) && (errno != EAGAIN) && (errno != EINTR))) {
+    server->close(c);
+    return;
+  }
+  if (n < 0)
+    return;
+  c->in.append(buf, n);
+
+  size_t pos = 0;
+  vector<string> args;
+  while (true) {
+    int r = parseCommand(c->in, pos, args);
+    if (r < 0) {
+      server->close(c);
+      return;
+    }
+    if (r == 0)
+      break;
+    if (!server->execute(c, args))
+      return;
+  }
+  c->in.erase(0, pos);
+}
+
+void MockServer::onWrite(struct ev_loop *loop, ev_io *w, int revents) {
+
+  Connection *c = (Connection *)w->data;
+  MockServer *server = c->server;
+
+  size_t len = c->out.size() - c->out_pos;
+  size_t max_write = server->max_write_;
+  if ((max_write > 0) && (len > max_write))
+    len = max_write;
+
+  ssize_t n = write(c->fd, c->out.data() + c->out_pos, len);
+  if (n < 0) {
+    if ((errno != EAGAIN) && (errno != EINTR))
+      server->close(c);
+    return;
+  }
+
+  c->out_pos += n;
+  if (c->out_pos == c->out.size()) {
+    c->out.clear();
+    c->out_pos = 0;
+    c->writing = false;
+    ev_io_stop(loop, &c->watcher_write);
+  }
+}
+
+void MockServer::onDelay(struct ev_loop *loop, ev_timer *w, int revents) {
+
+  Connection *c = (Connection *)w->data;
+  MockServer *server = c->server;
+
+  auto now = chrono::steady_clock::now();
+  while (!c->delayed.empty() && (c->delayed.front().first <= now)) {
+    server->flush(c, c->delayed.front().second);
+    c->delayed.pop_front();
+  }
+
+  if (!c->delayed.empty()) {
+    double wait = chrono::duration<double>(c->delayed.front().first - now).count();
+    mock_ev_timer_set(&c->watcher_delay, wait);
+    ev_timer_start(loop, &c->watcher_delay);
+  }
+}
+
+void MockServer::onControl(struct ev_loop *loop, ev_async *w, int revents) {
+
+  MockServer *server = (MockServer *)ev_userdata(loop);
+
+  if (server->disconnect_.exchange(false) || server->stop_) {
+    set<Connection *> connections = server->connections_;
+    for (Connection *c : connections)
+      server->close(c);
+  }
+
+  if (server->stop_) {
+    ev_io_stop(loop, &server->watcher_accept_);
+    ev_async_stop(loop, &server->watcher_control_);
+    ev_break(loop, EVBREAK_ALL);
+  }
+}
+
+bool MockServer::execute(Connection *c, vector<string> &args) {
+
+  commands_received_++;
+  c->commands++;
+
+  long disconnect_after = disconnect_after_;
+  if ((disconnect_after > 0) && (c->commands >= disconnect_after)) {
+    close(c);
+    return false;
+  }
+
+  if (args.empty())
+    return true;
+
+  string name = upper(args[0]);
+
+  Handler handler;
+  {
+    lock_guard<mutex> lg(handlers_guard_);
+    auto it = handlers_.find(name);
+    if (it != handlers_.end())
+      handler = it->second;
+  }
+
+  string resp = handler ? handler(args) : builtin(c, name, args);
+
+  // Only the reply to CLIENT REPLY ON gets through while replies are off
+  if (!resp.empty() && !c->reply_off)
+    send(c, resp);
+  return true;
+}
+
+string MockServer::builtin(Connection *c, const string &name, const vector<string> &args) {
+
+  if (name == "PING")
+    return (args.size() > 1) ? bulk(args[1]) : status("PONG");
+
+  if ((name == "ECHO") && (args.size() == 2))
+    return bulk(args[1]);
+
+  if ((name == "GET") && (args.size() == 2)) {
+    auto it = store_.find(args[1]);
+    return (it == store_.end()) ? nil() : bulk(it->second);
+  }
+
+  if ((name == "SET") && (args.size() >= 3)) {
+    store_[args[1]] = args[2];
+    return status("OK");
+  }
+
+  if ((name == "DEL") && (args.size() >= 2)) {
+    long deleted = 0;
+    for (size_t i = 1; i < args.size(); i++)
+      deleted += store_.erase(args[i]);
+    return integer(deleted);
+  }
+
+  if (((name == "INCR") && (args.size() == 2)) || ((name == "INCRBY") && (args.size() == 3))) {
+    string &value = store_[args[1]];
+    char *stop;
+    long long n = value.empty() ? 0 : strtoll(value.c_str(), &stop, 10);
+    if (!value.empty() && (*stop != '\0'))
+      return error("ERR value is not an integer or out of range");
+    long long by = (args.size() == 3) ? strtoll(args[2].c_str(), &stop, 10) : 1;
+    if ((args.size() == 3) && (args[2].empty() || (*stop != '\0')))
+      return error("ERR value is not an integer or out of range");
+    value = to_string(n + by);
+    return integer(n + by);
+  }
+
+  if ((name == "CLIENT") && (args.size() == 3) && (upper(args[1]) == "REPLY")) {
+    string mode = upper(args[2]);
+    c->reply_off = (mode != "ON");
+    return (mode == "ON") ? status("OK") : string();
+  }
+
+  if ((name == "SUBSCRIBE") || (name == "UNSUBSCRIBE") || (name == "PSUBSCRIBE") ||
+      (name == "PUNSUBSCRIBE"))
+    return subscribe(c, name, args);
+
+  if ((name == "PUBLISH") && (args.size() == 3))
+    return integer(publish(args[1], args[2]));
+
+  return error("ERR unknown command '" + args[0] + "'");
+}
+
+string MockServer::subscribe(Connection *c, const string &name, const vector<string> &args) {
+
+  bool pattern = (name[0] == 'P');
+  bool sub = (name.find("UNSUB") == string::npos);
+  set<string> &topics = pattern ? c->patterns : c->channels;
+  string kind = name;
+  transform(kind.begin(), kind.end(), kind.begin(), ::tolower);
+
+  vector<string> names(args.begin() + 1, args.end());
+  if (!sub && names.empty())
+    names.assign(topics.begin(), topics.end());
+
+  string resp;
+  auto confirm = [&](const string *topic) {
+    long count = c->channels.size() + c->patterns.size();
+    resp += "*3\r\n" + bulk(kind) + (topic ? bulk(*topic) : nil()) + integer(count);
+  };
+
+  if (names.empty())
+    confirm(nullptr);
+  for (const string &topic : names) {
+    if (sub)
+      topics.insert(topic);
+    else
+      topics.erase(topic);
+    confirm(&topic);
+  }
+  return resp;
+}
+
+long MockServer::publish(const string &channel, const string &msg) {
+
+  long receivers = 0;
+  for (Connection *c : connections_) {
+    if (c->channels.count(channel)) {
+      send(c, array({"message", channel, msg}));
+      receivers++;
+    }
+    for (const string &pattern : c->patterns) {
+      if (fnmatch(pattern.c_str(), channel.c_str(), 0) == 0) {
+        send(c, array({"pmessage", pattern, channel, msg}));
+        receivers++;
+      }
+    }
+  }
+  return receivers;
+}
+
+void MockServer::send(Connection *c, const string &data) {
+
+  long long latency = latency_ns_;
+  long long jitter = jitter_ns_;
+  if ((latency == 0) && (jitter == 0) && c->delayed.empty()) {
+    flush(c, data);
+    return;
+  }
+
+  if (jitter > 0)
+    latency += uniform_int_distribution<long long>(0, jitter)(random_);
+
+  // Replies stay in order, so none is due before the one ahead of it
+  auto now = chrono::steady_clock::now();
+  time_point due = now + chrono::nanoseconds(latency);
+  if (!c->delayed.empty() && (due < c->delayed.back().first))
+    due = c->delayed.back().first;
+  c->delayed.emplace_back(due, data);
+
+  if (!mock_ev_is_active(&c->watcher_delay)) {
+    mock_ev_timer_set(&c->watcher_delay, chrono::duration<double>(due - now).count());
+    ev_timer_start(loop_, &c->watcher_delay);
+  }
+}
+
+void MockServer::flush(Connection *c, const string &data) {
+  c->out += data;
+  if (!c->writing) {
+    c->writing = true;
+    ev_io_start(loop_, &c->watcher_write);
+  }
+}
+
+void MockServer::close(Connection *c) {
+  ev_io_stop(loop_, &c->watcher_read);
+  ev_io_stop(loop_, &c->watcher_write);
+  ev_timer_stop(loop_, &c->watcher_delay);
+  ::close(c->fd);
+  connections_.erase(c);
+  delete c;
+}
+
+} // End namespace
@@ -0,0 +1,180 @@
+/*
+* Redox - A modern, asynchronous, and wicked fast C++11 client for Redis
+*
+*    https://github.com/hmartiro/redox
+*
+* Copyright 2015 - Hayk Martirosyan <hayk.mart at gmail dot com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <set>
+#include <deque>
+#include <random>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <unordered_map>
+
+#include <ev.h>
+
+namespace redox {
+
+/**
+* An embeddable RESP server on its own libev event loop, to test and
+* benchmark clients without a real Redis. It answers PING, ECHO, GET, SET,
+* DEL, INCR, INCRBY, CLIENT REPLY and pub/sub (SUBSCRIBE, PSUBSCRIBE, their
+* unsubscribes and PUBLISH) from memory, and any command can be given a
+* canned reply or a scripted handler instead.
+*
+* Faults can be injected: latency with jitter before every reply (replies
+* stay in order), writes split into small chunks, and dropped connections.
+*
+* All methods can be called from any thread, while the server runs.
+*/
+class MockServer {
+
+public:
+  // Returns the RESP-encoded reply to a command, or an empty string for none
+  typedef std::function<std::string(const std::vector<std::string> &)> Handler;
+
+  MockServer();
+  ~MockServer();
+
+  /**
+  * Starts listening on 127.0.0.1:[port], or on a free port if zero, and runs
+  * the event loop in a separate thread. Returns false on failure.
+  */
+  bool start(int port = 0);
+
+  /**
+  * Closes all connections, stops the event loop and waits for it.
+  */
+  void stop();
+
+  /**
+  * Returns the port being listened on.
+  */
+  int port() const { return port_; }
+
+  /**
+  * Answers every [cmd] (ignoring case) with the RESP-encoded [resp].
+  */
+  void reply(const std::string &cmd, const std::string &resp);
+
+  /**
+  * Answers every [cmd] (ignoring case) by calling [handler] with its arguments,
+  * from the event loop thread.
+  */
+  void handle(const std::string &cmd, Handler handler);
+
+  /**
+  * Delays every reply and published message by [seconds], plus a uniformly
+  * random extra of up to [jitter] seconds. Zero for no delay, the default.
+  */
+  void latency(double seconds, double jitter = 0);
+
+  /**
+  * Writes at most [max_bytes] per write to a socket, so clients receive
+  * replies split at arbitrary points. Zero for no limit, the default.
+  */
+  void partialWrites(size_t max_bytes);
+
+  /**
+  * Drops every connection, without a reply, upon its [commands]th command.
+  * Zero for never, the default.
+  */
+  void disconnectAfter(long commands);
+
+  /**
+  * Drops all current connections.
+  */
+  void disconnectAll();
+
+  /**
+  * Returns the number of commands received, and of connections accepted.
+  */
+  long commandsReceived() const { return commands_received_; }
+  long connectionsAccepted() const { return connections_accepted_; }
+
+  // RESP encoding of replies
+  static std::string status(const std::string &s);
+  static std::string error(const std::string &s);
+  static std::string integer(long long n);
+  static std::string bulk(const std::string &s);
+  static std::string nil();
+  static std::string array(const std::vector<std::string> &bulks);
+
+private:
+  struct Connection;
+
+  // Event loop callbacks
+  static void onAccept(struct ev_loop *loop, ev_io *w, int revents);
+  static void onRead(struct ev_loop *loop, ev_io *w, int revents);
+  static void onWrite(struct ev_loop *loop, ev_io *w, int revents);
+  static void onDelay(struct ev_loop *loop, ev_timer *w, int revents);
+  static void onControl(struct ev_loop *loop, ev_async *w, int revents);
+
+  // Runs one command, returns false if the connection was closed
+  bool execute(Connection *c, std::vector<std::string> &args);
+
+  // Built-in commands
+  std::string builtin(Connection *c, const std::string &name, const std::vector<std::string> &args);
+  std::string subscribe(Connection *c, const std::string &name,
+                        const std::vector<std::string> &args);
+  long publish(const std::string &channel, const std::string &msg);
+
+  // Queues data to a connection, after the injected latency
+  void send(Connection *c, const std::string &data);
+  void flush(Connection *c, const std::string &data);
+  void close(Connection *c);
+
+  int listen_fd_ = -1;
+  int port_ = 0;
+
+  struct ev_loop *loop_ = nullptr;
+  ev_io watcher_accept_;
+  ev_async watcher_control_;
+  std::thread thread_;
+  std::atomic_bool stop_ = {false};
+  std::atomic_bool disconnect_ = {false};
+
+  // Used by the event loop only
+  std::set<Connection *> connections_;
+  std::unordered_map<std::string, std::string> store_;
+  std::mt19937 random_;
+
+  // Canned replies and handlers by upper case command name
+  std::unordered_map<std::string, Handler> handlers_;
+  std::mutex handlers_guard_;
+
+  // Injected faults
+  std::atomic_llong latency_ns_ = {0};
+  std::atomic_llong jitter_ns_ = {0};
+  std::atomic<size_t> max_write_ = {0};
+  std::atomic_long disconnect_after_ = {0};
+
+  std::atomic_long commands_received_ = {0};
+  std::atomic_long connections_accepted_ = {0};
+
+  MockServer(const MockServer &) = delete;
+  MockServer &operator=(const MockServer &) = delete;
+};
+
+} // End namespace
@@ -0,0 +1,271 @@
+/*
+* Redox - A modern, asynchronous, and wicked fast C++11 client for Redis
+*
+*    https://github.com/hmartiro/redox
+*
+* Copyright 2015 - Hayk Martirosyan <hayk.mart at gmail dot com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#include <errno.h>
+#include <unistd.h>
+#include <algorithm>
+
+#include "backend.hpp"
+#include "utils/ev_wrappers.hpp"
+
+using namespace std;
+
+namespace redox {
+
+namespace {
+
+// Pieces written by one writev, within IOV_MAX
+const size_t MAX_PIECES = 64;
+
+} // anonymous
+
+void Backend::initHolding() {
+  redox_ev_init(&delay_timer_, onDelay);
+  delay_timer_.data = (void *)this;
+}
+
+bool Backend::holdBack() {
+
+  if ((policy_.max_delay_us == 0) || !(ctx_->c.flags & REDIS_CONNECTED))
+    return false;
+
+  held_++;
+  if (((policy_.max_commands != 0) && (held_ >= policy_.max_commands)) ||
+      ((policy_.max_bytes != 0) && (sdslen(ctx_->c.obuf) >= policy_.max_bytes))) {
+    release();
+    return false;
+  }
+
+  if (!holding_) {
+    redox_ev_timer_set(&delay_timer_, policy_.max_delay_us / 1e6, 0);
+    ev_timer_start(loop_, &delay_timer_);
+    holding_ = true;
+  }
+  return true;
+}
+
+void Backend::release() {
+  held_ = 0;
+  if (holding_) {
+    if (loop_ != nullptr)
+      ev_timer_stop(loop_, &delay_timer_);
+    holding_ = false;
+  }
+}
+
+void Backend::flush() {
+  if (holding_) {
+    release();
+    write();
+  }
+}
+
+void Backend::append(const char *data, size_t len) {
+  ctx_->c.obuf = sdscatlen(ctx_->c.obuf, data, len);
+}
+
+void Backend::splice(const vector<struct iovec> &pieces, const shared_ptr<void> &owner) {
+  for (const struct iovec &piece : pieces)
+    append((const char *)piece.iov_base, piece.iov_len);
+}
+
+void Backend::onDelay(struct ev_loop *loop, ev_timer *timer, int revents) {
+  Backend *b = (Backend *)timer->data;
+  b->held_ = 0;
+  b->holding_ = false;
+  b->write();
+}
+
+bool LibevBackend::attach(struct ev_loop *loop, redisAsyncContext *ctx) {
+
+  // Nothing should already be attached to the context
+  if (ctx->ev.data != nullptr)
+    return false;
+
+  loop_ = loop;
+  ctx_ = ctx;
+
+  ctx->ev.addRead = addRead;
+  ctx->ev.delRead = delRead;
+  ctx->ev.addWrite = addWrite;
+  ctx->ev.delWrite = delWrite;
+  ctx->ev.cleanup = cleanup;
+  ctx->ev.data = (void *)this;
+
+  redox_ev_io_init(&watcher_read_, onRead, ctx->c.fd, EV_READ);
+  watcher_read_.data = (void *)this;
+  redox_ev_io_init(&watcher_write_, onWrite, ctx->c.fd, EV_WRITE);
+  watcher_write_.data = (void *)this;
+  initHolding();
+
+  return true;
+}
+
+bool LibevBackend::flushed() {
+  return closed_ || ((sdslen(ctx_->c.obuf) == 0) && splices_.empty());
+}
+
+void LibevBackend::splice(const vector<struct iovec> &pieces, const shared_ptr<void> &owner) {
+  size_t size = 0;
+  for (const struct iovec &piece : pieces)
+    size += piece.iov_len;
+  splices_.push_back(Splice{sdslen(ctx_->c.obuf), pieces, size, 0, owner});
+}
+
+void LibevBackend::writeSpliced() {
+
+  // The output buffer up to each splice, the splice, and what is after the last
+  struct iovec iov[MAX_PIECES];
+  size_t count = 0;
+  size_t at = 0;
+  size_t included = 0;
+  sds obuf = ctx_->c.obuf;
+  for (const Splice &s : splices_) {
+    if (s.offset > at)
+      iov[count++] = {obuf + at, s.offset - at};
+    at = s.offset;
+
+    size_t skip = s.written;
+    for (const struct iovec &piece : s.pieces) {
+      if (count == MAX_PIECES)
+        break;
+      if (skip >= piece.iov_len) {
+        skip -= piece.iov_len;
+        continue;
+      }
+      iov[count++] = {(char *)piece.iov_base + skip, piece.iov_len - skip};
+      skip = 0;
+    }
+
+    // The rest goes in the next write
+    if (count == MAX_PIECES)
+      break;
+    included++;
+  }
+  if ((included == splices_.size()) && (sdslen(obuf) > at) && (count < MAX_PIECES))
+    iov[count++] = {obuf + at, sdslen(obuf) - at};
+
+  ssize_t n = writev(ctx_->c.fd, iov, count);
+  if (n < 0) {
+    if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))
+      return;
+
+    // Broken for good, so hiredis fails writing too and disconnects
+    splices_.clear();
+    redisAsyncHandleWrite(ctx_);
+    return;
+  }
+
+  // Account for what was written, from the output buffer and the splices
+  size_t left = n;
+  size_t obuf_written = 0;
+  while ((left > 0) && !splices_.empty()) {
+    Splice &s = splices_.front();
+    size_t before = min(left, s.offset - obuf_written);
+    obuf_written += before;
+    left -= before;
+    if (left == 0)
+      break;
+
+    size_t part = min(left, s.size - s.written);
+    s.written += part;
+    left -= part;
+    if (s.written < s.size)
+      break;
+    splices_.pop_front();
+  }
+  obuf_written += left;
+
+  if (obuf_written > 0) {
+    sdsrange(ctx_->c.obuf, obuf_written, -1);
+    for (Splice &s : splices_)
+      s.offset -= obuf_written;
+  }
+
+  if ((sdslen(ctx_->c.obuf) == 0) && splices_.empty())
+    delWrite(this);
+  addRead(this);
+}
+
+void LibevBackend::write() {
+  if (!writing_) {
+    writing_ = true;
+    ev_io_start(loop_, &watcher_write_);
+  }
+}
+
+void LibevBackend::addRead(void *privdata) {
+  LibevBackend *b = (LibevBackend *)privdata;
+  if (!b->reading_) {
+    b->reading_ = true;
+    ev_io_start(b->loop_, &b->watcher_read_);
+  }
+}
+
+void LibevBackend::delRead(void *privdata) {
+  LibevBackend *b = (LibevBackend *)privdata;
+  if (b->reading_) {
+    b->reading_ = false;
+    ev_io_stop(b->loop_, &b->watcher_read_);
+  }
+}
+
+void LibevBackend::addWrite(void *privdata) {
+
+  // Goes out with what is being written already
+  LibevBackend *b = (LibevBackend *)privdata;
+  if (b->writing_)
+    return;
+
+  if (!b->holdBack())
+    b->write();
+}
+
+void LibevBackend::delWrite(void *privdata) {
+  LibevBackend *b = (LibevBackend *)privdata;
+  if (b->writing_) {
+    b->writing_ = false;
+    ev_io_stop(b->loop_, &b->watcher_write_);
+  }
+}
+
+void LibevBackend::cleanup(void *privdata) {
+  LibevBackend *b = (LibevBackend *)privdata;
+  delRead(privdata);
+  delWrite(privdata);
+  b->splices_.clear();
+  b->release();
+  b->closed_ = true;
+  b->ctx_ = nullptr;
+}
+
+void LibevBackend::onRead(struct ev_loop *loop, ev_io *w, int revents) {
+  redisAsyncHandleRead(((LibevBackend *)w->data)->ctx_);
+}
+
+void LibevBackend::onWrite(struct ev_loop *loop, ev_io *w, int revents) {
+  LibevBackend *b = (LibevBackend *)w->data;
+  if (b->splices_.empty())
+    redisAsyncHandleWrite(b->ctx_);
+  else
+    b->writeSpliced();
+}
+
+} // End namespace
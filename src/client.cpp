@@ -19,30 +19,22 @@
 */
 
 #include <signal.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <algorithm>
 #include "client.hpp"
+#include "utils/ev_wrappers.hpp"
 
 using namespace std;
 
 namespace {
 
-template<typename tev, typename tcb>
-void redox_ev_async_init(tev ev, tcb cb)
-{
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wstrict-aliasing"
-    ev_async_init(ev,cb);
-#pragma GCC diagnostic pop
-}
-
-template<typename ttimer, typename tcb, typename tafter, typename trepeat>
-void redox_ev_timer_init(ttimer timer, tcb cb, tafter after, trepeat repeat)
-{
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wstrict-aliasing"
-    ev_timer_init(timer,cb,after,repeat);
-#pragma GCC diagnostic pop
-}
+// Wrap batches of fire-and-forget commands when discarding replies
+const char REPLY_OFF[] = "*3\r\n$6\r\nCLIENT\r\n$5\r\nREPLY\r\n$3\r\nOFF\r\n";
+const char REPLY_ON[] = "*3\r\n$6\r\nCLIENT\r\n$5\r\nREPLY\r\n$2\r\nON\r\n";
 
 } // anonymous
 
@@ -52,7 +44,7 @@ Redox::Redox(ostream &log_stream, log::Level log_level)
     : logger_(log_stream, log_level), evloop_(nullptr) {}
 
 bool Redox::connect(const string &host, const int port,
-                    function<void(int)> connection_callback) {
+                    function<void(int)> connection_callback, const SocketOptions &options) {
 
   host_ = host;
   port_ = port;
@@ -62,28 +54,20 @@ bool Redox::connect(const string &host, const int port,
     return false;
 
   // Connect over TCP
-  ctx_ = redisAsyncConnect(host.c_str(), port);
-
-  if (!initHiredis())
-    return false;
-
-  event_loop_thread_ = thread([this] { runEventLoop(); });
-
-  // Block until connected and running the event loop, or until
-  // a connection error happens and the event loop exits
   {
-    unique_lock<mutex> ul(running_lock_);
-    running_waiter_.wait(ul, [this] {
-      lock_guard<mutex> lg(connect_lock_);
-      return running_ || connect_state_ == CONNECT_ERROR;
-    });
+    unique_lock<mutex> ul = lockEventLoop();
+    ctx_ = redisAsyncConnect(host.c_str(), port);
+
+    if (!initHiredis())
+      return false;
+    initSocket(options, true);
   }
 
-  // Return if succeeded
-  return getConnectState() == CONNECTED;
+  return startEventLoop();
 }
 
-bool Redox::connectUnix(const string &path, function<void(int)> connection_callback) {
+bool Redox::connectUnix(const string &path, function<void(int)> connection_callback,
+                        const SocketOptions &options) {
 
   path_ = path;
   user_connection_callback_ = connection_callback;
@@ -92,25 +76,77 @@ bool Redox::connectUnix(const string &path, function<void(int)> connection_callb
     return false;
 
   // Connect over unix sockets
-  ctx_ = redisAsyncConnectUnix(path.c_str());
+  {
+    unique_lock<mutex> ul = lockEventLoop();
+    ctx_ = redisAsyncConnectUnix(path.c_str());
 
-  if (!initHiredis())
-    return false;
+    if (!initHiredis())
+      return false;
+    initSocket(options, false);
+  }
+
+  return startEventLoop();
+}
+
+bool Redox::startEventLoop() {
 
-  event_loop_thread_ = thread([this] { runEventLoop(); });
+  if (group_loop_ == nullptr) {
+
+    event_loop_thread_ = thread([this] { runEventLoop(); });
+
+    // Block until connected and running the event loop, or until
+    // a connection error happens and the event loop exits
+    {
+      unique_lock<mutex> ul(running_lock_);
+      running_waiter_.wait(ul, [this] {
+        lock_guard<mutex> lg(connect_lock_);
+        return running_ || connect_state_ == CONNECT_ERROR;
+      });
+    }
+
+    // Return if succeeded
+    return getConnectState() == CONNECTED;
+  }
 
-  // Block until connected and running the event loop, or until
-  // a connection error happens and the event loop exits
+  // On a shared event loop, wake it up to connect, and block until done
+  ev_async_send(evloop_, &group_loop_->wake);
   {
-    unique_lock<mutex> ul(running_lock_);
-    running_waiter_.wait(ul, [this] {
-      lock_guard<mutex> lg(connect_lock_);
-      return running_ || connect_state_ == CONNECT_ERROR;
-    });
+    unique_lock<mutex> ul(connect_lock_);
+    connect_waiter_.wait(ul, [this] { return connect_state_ != NOT_YET_CONNECTED; });
+  }
+
+  // Nothing runs on the event loop while we hold it
+  lock_guard<mutex> lg(group_loop_->lock);
+
+  if (getConnectState() != CONNECTED) {
+    if (!shut_down_) {
+      REDOX_LOG(logger_, Warning) << "Did not connect, detaching from the event loop.";
+      shut_down_ = true;
+      stopWatchers();
+      setExited(true);
+    }
+    return false;
+  }
+
+  setRunning(true);
+  return true;
+}
+
+void Redox::attach(EventLoopGroup &group) {
+
+  if (group_loop_ != nullptr || getRunning()) {
+    REDOX_LOG(logger_, Error) << "Attach to an event loop group once, before connecting.";
+    return;
   }
 
-  // Return if succeeded
-  return getConnectState() == CONNECTED;
+  group_ = &group;
+  group_loop_ = group.acquire();
+}
+
+unique_lock<mutex> Redox::lockEventLoop() {
+  if (group_loop_ == nullptr)
+    return unique_lock<mutex>();
+  return unique_lock<mutex>(group_loop_->lock);
 }
 
 void Redox::disconnect() {
@@ -120,7 +156,7 @@ void Redox::disconnect() {
 
 void Redox::stop() {
   to_exit_ = true;
-  logger_.debug() << "stop() called, breaking event loop";
+  REDOX_LOG(logger_, Debug) << "stop() called, breaking event loop";
   ev_async_send(evloop_, &watcher_stop_);
 }
 
@@ -139,20 +175,35 @@ Redox::~Redox() {
   if (event_loop_thread_.joinable())
     event_loop_thread_.join();
 
-  if (evloop_ != nullptr)
+  if (group_loop_ != nullptr) {
+    // Detach from the shared event loop, which goes on
+    if (group_started_)
+      wait();
+    group_->release(group_loop_);
+
+  } else if (evloop_ != nullptr) {
     ev_loop_destroy(evloop_);
+  }
+
+  traceFile("");
+
+  // Formatted batches queued after the event loop exited
+  for (auto &batch : fire_batches_)
+    delete batch.second;
 }
 
 void Redox::connectedCallback(const redisAsyncContext *ctx, int status) {
   Redox *rdx = (Redox *)ctx->data;
 
   if (status != REDIS_OK) {
-    rdx->logger_.fatal() << "Could not connect to Redis: " << ctx->errstr;
-    rdx->logger_.fatal() << "Status: " << status;
+    REDOX_LOG(rdx->logger_, Fatal) << "Could not connect to Redis: " << ctx->errstr;
+    REDOX_LOG(rdx->logger_, Fatal) << "Status: " << status;
+    rdx->metrics_.connect_errors++;
     rdx->setConnectState(CONNECT_ERROR);
 
   } else {
-    rdx->logger_.info() << "Connected to Redis.";
+    REDOX_LOG(rdx->logger_, Info) << "Connected to Redis.";
+    rdx->metrics_.connects++;
     // Disable hiredis automatically freeing reply objects
     ctx->c.reader->fn->freeObject = [](void *reply) {};
     rdx->setConnectState(CONNECTED);
@@ -168,10 +219,12 @@ void Redox::disconnectedCallback(const redisAsyncContext *ctx, int status) {
   Redox *rdx = (Redox *)ctx->data;
 
   if (status != REDIS_OK) {
-    rdx->logger_.error() << "Disconnected from Redis on error: " << ctx->errstr;
+    REDOX_LOG(rdx->logger_, Error) << "Disconnected from Redis on error: " << ctx->errstr;
+    rdx->metrics_.disconnect_errors++;
     rdx->setConnectState(DISCONNECT_ERROR);
   } else {
-    rdx->logger_.info() << "Disconnected from Redis as planned.";
+    REDOX_LOG(rdx->logger_, Info) << "Disconnected from Redis as planned.";
+    rdx->metrics_.disconnects++;
     rdx->setConnectState(DISCONNECTED);
   }
 
@@ -183,13 +236,18 @@ void Redox::disconnectedCallback(const redisAsyncContext *ctx, int status) {
 
 bool Redox::initEv() {
   signal(SIGPIPE, SIG_IGN);
+
+  if (group_loop_ != nullptr) {
+    evloop_ = group_loop_->ev;
+    return true;
+  }
+
   evloop_ = ev_loop_new(EVFLAG_AUTO);
   if (evloop_ == nullptr) {
-    logger_.fatal() << "Could not create a libev event loop.";
+    REDOX_LOG(logger_, Fatal) << "Could not create a libev event loop.";
     setConnectState(INIT_ERROR);
     return false;
   }
-  ev_set_userdata(evloop_, (void *)this); // Back-reference
   return true;
 }
 
@@ -198,46 +256,365 @@ bool Redox::initHiredis() {
   ctx_->data = (void *)this; // Back-reference
 
   if (ctx_->err) {
-    logger_.fatal() << "Could not create a hiredis context: " << ctx_->errstr;
+    REDOX_LOG(logger_, Fatal) << "Could not create a hiredis context: " << ctx_->errstr;
     setConnectState(INIT_ERROR);
     return false;
   }
 
   // Attach event loop to hiredis
-  if (redisLibevAttach(evloop_, ctx_) != REDIS_OK) {
-    logger_.fatal() << "Could not attach libev event loop to hiredis.";
+  backend_.reset(new LibevBackend());
+#ifdef REDOX_IO_URING
+  if (io_uring_)
+    backend_.reset(new IoUringBackend(io_uring_options_));
+#endif
+  backend_->flushPolicy(flush_policy_);
+  if (group_loop_ != nullptr)
+    backend_->numaNode(group_loop_->numa_node);
+  else if (thread_options_.numa_local)
+    backend_->numaNode(numaNode(thread_options_.cpus));
+  if (!backend_->attach(evloop_, ctx_)) {
+    REDOX_LOG(logger_, Fatal) << "Could not attach libev event loop to hiredis.";
     setConnectState(INIT_ERROR);
     return false;
   }
 
   // Set the callbacks to be invoked on server connection/disconnection
   if (redisAsyncSetConnectCallback(ctx_, Redox::connectedCallback) != REDIS_OK) {
-    logger_.fatal() << "Could not attach connect callback to hiredis.";
+    REDOX_LOG(logger_, Fatal) << "Could not attach connect callback to hiredis.";
     setConnectState(INIT_ERROR);
     return false;
   }
 
   if (redisAsyncSetDisconnectCallback(ctx_, Redox::disconnectedCallback) != REDIS_OK) {
-    logger_.fatal() << "Could not attach disconnect callback to hiredis.";
+    REDOX_LOG(logger_, Fatal) << "Could not attach disconnect callback to hiredis.";
     setConnectState(INIT_ERROR);
     return false;
   }
 
+  // A shared event loop runs already, so watch for commands from the start
+  if (group_loop_ != nullptr) {
+    startWatchers();
+    group_started_ = true;
+  }
+
   return true;
 }
 
+void Redox::initSocket(const SocketOptions &options, bool tcp) {
+
+  int fd = ctx_->c.fd;
+  auto set = [this, fd](int level, int name, int value, const char *what) {
+    if (setsockopt(fd, level, name, &value, sizeof(value)) != 0) {
+      REDOX_LOG(logger_, Warning) << "Could not set " << what << ": " << strerror(errno);
+    }
+  };
+
+  if (tcp)
+    set(IPPROTO_TCP, TCP_NODELAY, options.no_delay, "TCP_NODELAY");
+  if (options.send_buffer > 0)
+    set(SOL_SOCKET, SO_SNDBUF, options.send_buffer, "SO_SNDBUF");
+  if (options.receive_buffer > 0)
+    set(SOL_SOCKET, SO_RCVBUF, options.receive_buffer, "SO_RCVBUF");
+#ifdef SO_BUSY_POLL
+  if (options.busy_poll_us > 0)
+    set(SOL_SOCKET, SO_BUSY_POLL, options.busy_poll_us, "SO_BUSY_POLL");
+#else
+  if (options.busy_poll_us > 0) {
+    REDOX_LOG(logger_, Warning) << "SO_BUSY_POLL is not supported on this platform.";
+  }
+#endif
+  if (tcp && (options.keepalive_s > 0)) {
+    if (redisKeepAlive(&ctx_->c, options.keepalive_s) != REDIS_OK) {
+      REDOX_LOG(logger_, Warning) << "Could not enable keepalive: " << ctx_->c.errstr;
+    }
+  }
+}
+
+void Redox::flushPolicy(const FlushPolicy &policy) {
+
+  if (getRunning()) {
+    REDOX_LOG(logger_, Error) << "Set the flush policy before connecting.";
+    return;
+  }
+
+  if (policy.max_delay_us > 0)
+    REDOX_LOG(logger_, Info) << "Holding writes back for up to " << policy.max_delay_us << " us.";
+  else
+    REDOX_LOG(logger_, Info) << "Writing commands out right away.";
+  flush_policy_ = policy;
+}
+
+void Redox::threadOptions(const ThreadOptions &options) {
+
+  if (getRunning() || (group_loop_ != nullptr)) {
+    REDOX_LOG(logger_, Error) << "Place the event loop thread before connecting, "
+                              << "and through the group when attached to one.";
+    return;
+  }
+  thread_options_ = options;
+}
+
 void Redox::noWait(bool state) {
   if (state)
-    logger_.info() << "No-wait mode enabled.";
+    REDOX_LOG(logger_, Info) << "No-wait mode enabled.";
   else
-    logger_.info() << "No-wait mode disabled.";
+    REDOX_LOG(logger_, Info) << "No-wait mode disabled.";
   nowait_ = state;
 }
 
+bool Redox::ioUring(bool state, const IoUringOptions &options) {
+
+  if (getRunning()) {
+    REDOX_LOG(logger_, Error) << "Choose the I/O backend before connecting.";
+    return false;
+  }
+
+#ifdef REDOX_IO_URING
+  if (state && !IoUringBackend::supported(options)) {
+    REDOX_LOG(logger_, Error) << "io_uring is not supported by the kernel, using libev.";
+    io_uring_ = false;
+    return false;
+  }
+
+  if (state)
+    REDOX_LOG(logger_, Info) << "Doing socket I/O through io_uring.";
+  else
+    REDOX_LOG(logger_, Info) << "Doing socket I/O through libev.";
+  io_uring_ = state;
+  io_uring_options_ = options;
+  return true;
+#else
+  if (state) {
+    REDOX_LOG(logger_, Error) << "Redox was built without io_uring, using libev.";
+    return false;
+  }
+  return true;
+#endif
+}
+
+void Redox::discardReplies(bool state) {
+  if (state)
+    REDOX_LOG(logger_, Info) << "Discarding replies of fired commands.";
+  else
+    REDOX_LOG(logger_, Info) << "Counting replies of fired commands.";
+  discard_replies_ = state;
+}
+
+void Redox::collectMetrics(bool state) {
+  if (state)
+    REDOX_LOG(logger_, Info) << "Collecting command latencies.";
+  else
+    REDOX_LOG(logger_, Info) << "Not collecting command latencies.";
+  collect_metrics_ = state;
+}
+
+MetricsSnapshot Redox::metrics() { return metrics_.snapshot(); }
+
+void Redox::recordTimeline(bool state) {
+  if (state)
+    REDOX_LOG(logger_, Info) << "Recording command timelines.";
+  else
+    REDOX_LOG(logger_, Info) << "Not recording command timelines.";
+  record_timeline_ = state;
+}
+
+bool Redox::traceFile(const string &path) {
+
+  lock_guard<mutex> lg(trace_guard_);
+
+  if (trace_file_ != nullptr) {
+    fclose(trace_file_);
+    trace_file_ = nullptr;
+    tracing_ = false;
+  }
+
+  if (path.empty())
+    return true;
+
+  trace_file_ = fopen(path.c_str(), "wb");
+  if (trace_file_ == nullptr) {
+    REDOX_LOG(logger_, Error) << "Could not open trace file " << path << ": " << strerror(errno);
+    return false;
+  }
+
+  // Buffer generously, so the event loop rarely blocks on a write
+  setvbuf(trace_file_, nullptr, _IOFBF, 1 << 20);
+
+  REDOX_LOG(logger_, Info) << "Tracing commands to " << path << ".";
+  tracing_ = true;
+  return true;
+}
+
+void Redox::traceCommand(long id, int status, const string &name, const CommandTimeline &t) {
+
+  if (!tracing_)
+    return;
+
+  auto ns = [](CommandTimeline::time_point tp) -> int64_t {
+    if (tp == CommandTimeline::time_point())
+      return 0;
+    return chrono::duration_cast<chrono::nanoseconds>(tp.time_since_epoch()).count();
+  };
+
+  TraceRecord r;
+  memset(&r, 0, sizeof(r));
+  r.id = id;
+  r.status = status;
+  memcpy(r.name, name.data(), min(name.size(), sizeof(r.name)));
+  r.created = ns(t.created);
+  r.dequeued = ns(t.dequeued);
+  r.submitted = ns(t.submitted);
+  r.flushed = ns(t.flushed);
+  r.parsed = ns(t.parsed);
+  r.returned = ns(t.returned);
+
+  lock_guard<mutex> lg(trace_guard_);
+  if (trace_file_ != nullptr)
+    fwrite(&r, sizeof(r), 1, trace_file_);
+}
+
+void Redox::stallThreshold(double seconds) {
+  if (seconds > 0)
+    REDOX_LOG(logger_, Info) << "Watching for stalls over " << seconds * 1000 << " ms.";
+  else
+    REDOX_LOG(logger_, Info) << "Not watching for stalls.";
+  stall_threshold_ns_ = (seconds > 0) ? (long long)(seconds * 1e9) : 0;
+}
+
+vector<Stall> Redox::stalls() {
+  lock_guard<mutex> lg(stalls_guard_);
+  return vector<Stall>(stalls_.begin(), stalls_.end());
+}
+
+void Redox::slowLog(double seconds, size_t capacity) {
+
+  if (!slow_log_) {
+    if (getRunning()) {
+      REDOX_LOG(logger_, Error) << "Enable the slow log before connecting.";
+      return;
+    }
+    slow_log_.reset(new SlowLog(capacity));
+  }
+
+  if (seconds > 0)
+    REDOX_LOG(logger_, Info) << "Logging commands slower than " << seconds * 1000 << " ms.";
+  else
+    REDOX_LOG(logger_, Info) << "Not logging slow commands.";
+  slow_threshold_ns_ = (seconds > 0) ? (long long)(seconds * 1e9) : 0;
+}
+
+vector<SlowCommand> Redox::slowCommands() {
+  if (!slow_log_)
+    return vector<SlowCommand>();
+  return slow_log_->dump();
+}
+
+void Redox::recordStall(const string &cmd, long long ns) {
+
+  metrics_.stalls++;
+  if (cmd.empty())
+    REDOX_LOG(logger_, Warning) << "Event loop iteration took " << ns / 1e6 << " ms.";
+  else
+    REDOX_LOG(logger_, Warning) << "Callback of \"" << cmd << "\" took " << ns / 1e6 << " ms.";
+
+  Stall s;
+  s.time = chrono::system_clock::now();
+  s.cmd = cmd;
+  s.duration = ns / 1e9;
+
+  lock_guard<mutex> lg(stalls_guard_);
+  if (stalls_.size() == MAX_STALLS)
+    stalls_.pop_front();
+  stalls_.push_back(std::move(s));
+}
+
+void Redox::loopAwake(struct ev_loop *loop, ev_check *check, int revents) {
+
+  Redox *rdx = (Redox *)check->data;
+  if (rdx->stall_threshold_ns_ == 0)
+    return;
+
+  auto now = chrono::steady_clock::now();
+  if (rdx->loop_asleep_ != chrono::steady_clock::time_point()) {
+    rdx->metrics_.loop_idle_ns.fetch_add(
+        chrono::duration_cast<chrono::nanoseconds>(now - rdx->loop_asleep_).count(),
+        memory_order_relaxed);
+  }
+  rdx->loop_awake_ = now;
+  rdx->stalled_callback_ = false;
+}
+
+void Redox::loopAsleep(struct ev_loop *loop, ev_prepare *prepare, int revents) {
+
+  Redox *rdx = (Redox *)prepare->data;
+  long long threshold = rdx->stall_threshold_ns_;
+  if (threshold == 0) {
+    rdx->loop_awake_ = rdx->loop_asleep_ = chrono::steady_clock::time_point();
+    return;
+  }
+
+  auto now = chrono::steady_clock::now();
+  if (rdx->loop_awake_ != chrono::steady_clock::time_point()) {
+    long long busy = chrono::duration_cast<chrono::nanoseconds>(now - rdx->loop_awake_).count();
+    rdx->metrics_.loop_busy_ns.fetch_add(busy, memory_order_relaxed);
+
+    // Unless one callback already explains it
+    if ((busy > threshold) && !rdx->stalled_callback_)
+      rdx->recordStall("", busy);
+  }
+  rdx->loop_asleep_ = now;
+}
+
+void Redox::checkFlushed(struct ev_loop *loop, ev_check *check, int revents) {
+
+  Redox *rdx = (Redox *)check->data;
+  if (rdx->unflushed_.empty())
+    return;
+
+  // Everything submitted so far is out once the output buffer is empty. After
+  // a disconnect, hiredis has freed the context.
+  if ((rdx->getConnectState() != CONNECTED) || !rdx->backend_->flushed())
+    return;
+
+  auto now = chrono::steady_clock::now();
+  for (CommandTimeline *t : rdx->unflushed_) {
+    if (t->flushed == CommandTimeline::time_point())
+      t->flushed = now;
+  }
+  rdx->unflushed_.clear();
+}
+
 void breakEventLoop(struct ev_loop *loop, ev_async *async, int revents) {
   ev_break(loop, EVBREAK_ALL);
 }
 
+void Redox::shutdownOnLoop(struct ev_loop *loop, ev_async *async, int revents) {
+
+  Redox *rdx = (Redox *)async->data;
+
+  // Signalled again by the disconnect callback. Finishing from here rather
+  // than from within hiredis, the backend is not in use as we may be freed.
+  if (rdx->shutting_down_) {
+    if (rdx->getConnectState() != CONNECTED)
+      rdx->finishExit();
+    return;
+  }
+  rdx->shutting_down_ = true;
+
+  REDOX_LOG(rdx->logger_, Info) << "Stop signal detected. Detaching from the event loop.";
+
+  rdx->freeAllCommands();
+  rdx->unflushed_.clear();
+
+  // Finish once signalled by the disconnect callback
+  if (rdx->getConnectState() == CONNECTED) {
+    redisAsyncDisconnect(rdx->ctx_);
+    return;
+  }
+
+  rdx->finishExit();
+}
+
 int Redox::getConnectState() {
   lock_guard<mutex> lk(connect_lock_);
   return connect_state_;
@@ -268,15 +645,19 @@ int Redox::getExited() {
   return exited_;
 }
 void Redox::setExited(bool exited) {
-  {
-    lock_guard<mutex> lg(exit_lock_);
-    exited_ = exited;
-  }
+  // Notify under the lock, as the waiter may destroy us once it returns
+  lock_guard<mutex> lg(exit_lock_);
+  exited_ = exited;
   exit_waiter_.notify_one();
 }
 
 void Redox::runEventLoop() {
 
+  string error;
+  if (!placeThread(thread_options_, error)) {
+    REDOX_LOG(logger_, Error) << "Could not place the event loop thread: " << error;
+  }
+
   // Events to connect to Redox
   ev_run(evloop_, EVRUN_ONCE);
   ev_run(evloop_, EVRUN_NOWAIT);
@@ -288,27 +669,14 @@ void Redox::runEventLoop() {
 
     // Handle connection error
     if (connect_state_ != CONNECTED) {
-      logger_.warning() << "Did not connect, event loop exiting.";
-      setExited(true);
+      REDOX_LOG(logger_, Warning) << "Did not connect, event loop exiting.";
       setRunning(false);
+      setExited(true);
       return;
     }
   }
 
-  // Set up asynchronous watcher which we signal every
-  // time we add a command
-  redox_ev_async_init(&watcher_command_, processQueuedCommands);
-  ev_async_start(evloop_, &watcher_command_);
-
-  // Set up an async watcher to break the loop
-  redox_ev_async_init(&watcher_stop_, breakEventLoop);
-  ev_async_start(evloop_, &watcher_stop_);
-
-  // Set up an async watcher which we signal every time
-  // we want a command freed
-  redox_ev_async_init(&watcher_free_, freeQueuedCommands);
-  ev_async_start(evloop_, &watcher_free_);
-
+  startWatchers();
   setRunning(true);
 
   // Run the event loop, using NOWAIT if enabled for maximum
@@ -321,10 +689,11 @@ void Redox::runEventLoop() {
     }
   }
 
-  logger_.info() << "Stop signal detected. Closing down event loop.";
+  REDOX_LOG(logger_, Info) << "Stop signal detected. Closing down event loop.";
 
   // Signal event loop to free all commands
   freeAllCommands();
+  unflushed_.clear();
 
   // Wait to receive server replies for clean hiredis disconnect
   this_thread::sleep_for(chrono::milliseconds(10));
@@ -337,18 +706,93 @@ void Redox::runEventLoop() {
   // Run once more to disconnect
   ev_run(evloop_, EVRUN_NOWAIT);
 
+  finishExit();
+}
+
+void Redox::startWatchers() {
+
+  // Set up asynchronous watcher which we signal every
+  // time we add a command
+  redox_ev_async_init(&watcher_command_, processQueuedCommands);
+  watcher_command_.data = (void *)this;
+  ev_async_start(evloop_, &watcher_command_);
+
+  // Set up an async watcher to break the loop, or to disconnect
+  // from a shared one
+  if (group_loop_ == nullptr)
+    redox_ev_async_init(&watcher_stop_, breakEventLoop);
+  else
+    redox_ev_async_init(&watcher_stop_, shutdownOnLoop);
+  watcher_stop_.data = (void *)this;
+  ev_async_start(evloop_, &watcher_stop_);
+
+  // Set up an async watcher which we signal every time
+  // we want a command freed
+  redox_ev_async_init(&watcher_free_, freeQueuedCommands);
+  watcher_free_.data = (void *)this;
+  ev_async_start(evloop_, &watcher_free_);
+
+  // Set up a check watcher, run after all other events of a loop iteration,
+  // to notice when hiredis has written out submitted commands
+  redox_ev_check_init(&watcher_flushed_, checkFlushed);
+  redox_ev_set_priority(&watcher_flushed_, EV_MINPRI);
+  watcher_flushed_.data = (void *)this;
+  ev_check_start(evloop_, &watcher_flushed_);
+
+  // Set up watchers around waiting for events, to time loop iterations
+  redox_ev_check_init(&watcher_awake_, loopAwake);
+  redox_ev_set_priority(&watcher_awake_, EV_MAXPRI);
+  watcher_awake_.data = (void *)this;
+  ev_check_start(evloop_, &watcher_awake_);
+  redox_ev_prepare_init(&watcher_sleep_, loopAsleep);
+  watcher_sleep_.data = (void *)this;
+  ev_prepare_start(evloop_, &watcher_sleep_);
+}
+
+void Redox::stopWatchers() {
+  ev_async_stop(evloop_, &watcher_command_);
+  ev_async_stop(evloop_, &watcher_stop_);
+  ev_async_stop(evloop_, &watcher_free_);
+  ev_check_stop(evloop_, &watcher_flushed_);
+  ev_check_stop(evloop_, &watcher_awake_);
+  ev_prepare_stop(evloop_, &watcher_sleep_);
+}
+
+void Redox::finishExit() {
+
+  shut_down_ = true;
+  stopWatchers();
+  traceFile("");
+
+  // Fail formatted batches that were never sent
+  {
+    lock_guard<mutex> lg(queue_guard_);
+    for (auto &batch : fire_batches_) {
+      FormattedBatch *b = batch.second;
+      if (b->callback) {
+        for (size_t i = 0; i < b->count; i++)
+          b->callback(i, nullptr);
+      }
+      delete b;
+    }
+    fire_batches_.clear();
+  }
+
   long created = commands_created_;
   long deleted = commands_deleted_;
   if (created != deleted) {
-    logger_.error() << "All commands were not freed! " << deleted << "/"
+    REDOX_LOG(logger_, Error) << "All commands were not freed! " << deleted << "/"
                     << created;
   }
 
-  // Let go for block_until_stopped method
-  setExited(true);
-  setRunning(false);
+  if (group_loop_ == nullptr)
+    REDOX_LOG(logger_, Info) << "Event thread exited.";
+  else
+    REDOX_LOG(logger_, Info) << "Detached from the event loop.";
 
-  logger_.info() << "Event thread exited.";
+  // Let go for block_until_stopped method, last as it may destroy us
+  setRunning(false);
+  setExited(true);
 }
 
 template <class ReplyT> Command<ReplyT> *Redox::findCommand(long id) {
@@ -369,6 +813,8 @@ void Redox::commandCallback(redisAsyncContext *ctx, void *r, void *privdata) {
   long id = (long)privdata;
   redisReply *reply_obj = (redisReply *)r;
 
+  REDOX_PROBE2(command__reply, id, (reply_obj == nullptr) ? -1 : reply_obj->type);
+
   Command<ReplyT> *c = rdx->findCommand<ReplyT>(id);
   if (c == nullptr) {
     freeReplyObject(reply_obj);
@@ -383,39 +829,94 @@ template <class ReplyT> bool Redox::submitToServer(Command<ReplyT> *c) {
   Redox *rdx = c->rdx_;
   c->pending_++;
 
-  // Construct a char** from the vector
-  vector<const char *> argv;
-  transform(c->cmd_.begin(), c->cmd_.end(), back_inserter(argv),
-            [](const string &s) { return s.c_str(); });
+  const bool timed = rdx->timed();
+  if (timed) {
+    CommandTimeline &t = c->timeline_;
+    t.submitted = chrono::steady_clock::now();
+    t.flushed = t.parsed = t.returned = CommandTimeline::time_point();
+
+    if (rdx->collect_metrics_ && (c->metrics_ == nullptr)) {
+      c->metrics_ = rdx->metrics_.command(c->name());
+
+      // Time in the queue, only meaningful for commands sent right away
+      if ((c->repeat_ == 0) && (c->after_ == 0) && (t.created != CommandTimeline::time_point()))
+        c->metrics_->queued.record(
+            chrono::duration_cast<chrono::nanoseconds>(t.submitted - t.created).count());
+    }
+  }
 
-  // Construct a size_t* of string lengths from the vector
+  // Made with cmd(), the command is serialized already
+  vector<const char *> argv;
   vector<size_t> argvlen;
-  transform(c->cmd_.begin(), c->cmd_.end(), back_inserter(argvlen),
-            [](const string &s) { return s.size(); });
+  int result;
+  size_t bytes;
+  const FormattedCommand &f = c->formatted_;
+  if (!f.data_.empty()) {
+
+    // Up to the first large Buffer goes through hiredis, to expect the reply,
+    // and the rest is added to its output buffer after it
+    const string &frame = f.data_;
+    size_t end = f.splices_.empty() ? frame.size() : f.splices_[0].offset;
+    bytes = frame.size();
+    argv.push_back(frame.c_str());
+    result = redisAsyncFormattedCommand(rdx->ctx_, commandCallback<ReplyT>, (void *)c->id_,
+                                        frame.data(), end);
+
+    for (size_t i = 0; (result == REDIS_OK) && (i < f.splices_.size()); i++) {
+      const Buffer &buffer = f.splices_[i].buffer;
+      size_t next = (i + 1 < f.splices_.size()) ? f.splices_[i + 1].offset : frame.size();
+      rdx->backend_->splice(buffer.pieces(), buffer.owner_);
+      rdx->backend_->append(frame.data() + f.splices_[i].offset, next - f.splices_[i].offset);
+      bytes += buffer.size();
+    }
+  } else {
 
-  if (redisAsyncCommandArgv(rdx->ctx_, commandCallback<ReplyT>, (void *)c->id_, argv.size(),
-                            &argv[0], &argvlen[0]) != REDIS_OK) {
-    rdx->logger_.error() << "Could not send \"" << c->cmd() << "\": " << rdx->ctx_->errstr;
+    // Construct a char** from the vector
+    transform(c->cmd_.begin(), c->cmd_.end(), back_inserter(argv),
+              [](const string &s) { return s.c_str(); });
+
+    // Construct a size_t* of string lengths from the vector
+    transform(c->cmd_.begin(), c->cmd_.end(), back_inserter(argvlen),
+              [](const string &s) { return s.size(); });
+
+    result = redisAsyncCommandArgv(rdx->ctx_, commandCallback<ReplyT>, (void *)c->id_,
+                                   argv.size(), &argv[0], &argvlen[0]);
+
+    bytes = resp::headerSize(argv.size());
+    for (size_t len : argvlen)
+      bytes += resp::argSize(len);
+  }
+
+  if (result != REDIS_OK) {
+    REDOX_LOG(rdx->logger_, Error) << "Could not send \"" << c->cmd()
+                                   << "\": " << rdx->ctx_->errstr;
     c->reply_status_ = Command<ReplyT>::SEND_ERROR;
+    rdx->metrics_.statuses[c->reply_status_ + 1]++;
     c->invoke();
     return false;
   }
 
+  rdx->metrics_.bytes_out.fetch_add(bytes, memory_order_relaxed);
+  rdx->metrics_.in_flight.fetch_add(1, memory_order_relaxed);
+  c->unanswered_++;
+  REDOX_PROBE3(command__submit, c->id_, argv[0], bytes);
+
+  // Someone is blocked on a command without a callback, see commandSync
+  if (!c->callback_ && !c->free_memory_)
+    rdx->backend_->flush();
+
+  // Stamped as flushed once hiredis has written it out
+  if (timed)
+    rdx->unflushed_.push_back(&c->timeline_);
+
   return true;
 }
 
 template <class ReplyT>
 void Redox::submitCommandCallback(struct ev_loop *loop, ev_timer *timer, int revents) {
 
-  Redox *rdx = (Redox *)ev_userdata(loop);
-  long id = (long)timer->data;
-
-  Command<ReplyT> *c = rdx->findCommand<ReplyT>(id);
-  if (c == nullptr) {
-    rdx->logger_.error() << "Couldn't find Command " << id
-                         << " in command_map (submitCommandCallback).";
-    return;
-  }
+  // The timer is stopped before its command is freed
+  Command<ReplyT> *c = (Command<ReplyT> *)timer->data;
 
   submitToServer<ReplyT>(c);
 }
@@ -426,12 +927,16 @@ template <class ReplyT> bool Redox::processQueuedCommand(long id) {
   if (c == nullptr)
     return false;
 
+  metrics_.queued.fetch_sub(1, memory_order_relaxed);
+  if (timed())
+    c->timeline_.dequeued = chrono::steady_clock::now();
+
   if ((c->repeat_ == 0) && (c->after_ == 0)) {
     submitToServer<ReplyT>(c);
 
   } else {
 
-    c->timer_.data = (void *)c->id_;
+    c->timer_.data = (void *)c;
     redox_ev_timer_init(&c->timer_, submitCommandCallback<ReplyT>, c->after_, c->repeat_);
     ev_timer_start(evloop_, &c->timer_);
 
@@ -443,15 +948,23 @@ template <class ReplyT> bool Redox::processQueuedCommand(long id) {
 
 void Redox::processQueuedCommands(struct ev_loop *loop, ev_async *async, int revents) {
 
-  Redox *rdx = (Redox *)ev_userdata(loop);
+  Redox *rdx = (Redox *)async->data;
 
   lock_guard<mutex> lg(rdx->queue_guard_);
 
+  size_t fired = 0;
   while (!rdx->command_queue_.empty()) {
 
-    long id = rdx->command_queue_.front();
+    long id = rdx->command_queue_.front().first;
+    size_t fired_before = rdx->command_queue_.front().second;
     rdx->command_queue_.pop();
 
+    // Send the fire-and-forget commands queued before this one first
+    if (fired_before > fired) {
+      rdx->sendFired(fired, fired_before);
+      fired = fired_before;
+    }
+
     if (rdx->processQueuedCommand<redisReply *>(id)) {
     } else if (rdx->processQueuedCommand<string>(id)) {
     } else if (rdx->processQueuedCommand<char *>(id)) {
@@ -464,11 +977,132 @@ void Redox::processQueuedCommands(struct ev_loop *loop, ev_async *async, int rev
     } else
       throw runtime_error("Command pointer not found in any queue!");
   }
+
+  if (rdx->fire_ends_.size() > fired)
+    rdx->sendFired(fired, rdx->fire_ends_.size());
+
+  rdx->metrics_.bytes_out.fetch_add(rdx->fire_buf_.size(), memory_order_relaxed);
+
+  // Keep the capacity for the next batch
+  rdx->fire_buf_.clear();
+  rdx->fire_ends_.clear();
+  rdx->fire_batches_.clear();
+  rdx->next_batch_ = 0;
+}
+
+void Redox::sendFired(size_t begin, size_t end) {
+
+  size_t i = begin;
+  while (i < end) {
+
+    // Plain fire-and-forget commands up to the next batch
+    size_t stop = end;
+    if (next_batch_ < fire_batches_.size())
+      stop = min(end, fire_batches_[next_batch_].first);
+
+    if (stop > i) {
+      sendFiredFrames(i, stop);
+      i = stop;
+      continue;
+    }
+
+    // Every command of a batch gets its reply, even when discarding replies
+    FormattedBatch *b = fire_batches_[next_batch_++].second;
+    size_t offset = (i == 0) ? 0 : fire_ends_[i - 1];
+    for (size_t k = 0; k < b->count; k++, i++) {
+      if (redisAsyncFormattedCommand(ctx_, formattedCallback, (void *)b, fire_buf_.data() + offset,
+                                     fire_ends_[i] - offset) != REDIS_OK) {
+        REDOX_LOG(logger_, Error) << "Could not send formatted command: " << ctx_->errstr;
+
+        // Fail the rest of the batch, and free it once the commands
+        // already sent have their replies
+        size_t count = b->count;
+        if (b->callback) {
+          for (size_t rest = k; rest < count; rest++)
+            b->callback(rest, nullptr);
+        }
+        if (k == 0)
+          delete b;
+        else
+          b->count = k;
+        i += count - k;
+        break;
+      }
+      offset = fire_ends_[i];
+    }
+  }
+}
+
+void Redox::sendFiredFrames(size_t begin, size_t end) {
+
+  size_t offset = (begin == 0) ? 0 : fire_ends_[begin - 1];
+
+  if (discard_replies_) {
+
+    // The server sends no replies between OFF and ON, so the only callback
+    // registered is for the reply to ON, which acknowledges the whole batch
+    redisAppendFormattedCommand(&ctx_->c, REPLY_OFF, sizeof(REPLY_OFF) - 1);
+    redisAppendFormattedCommand(&ctx_->c, fire_buf_.data() + offset, fire_ends_[end - 1] - offset);
+    if (redisAsyncFormattedCommand(ctx_, firedCallback, (void *)(end - begin), REPLY_ON,
+                                   sizeof(REPLY_ON) - 1) != REDIS_OK) {
+      REDOX_LOG(logger_, Error) << "Could not send " << end - begin
+                                << " fired commands: " << ctx_->errstr;
+    }
+    return;
+  }
+
+  for (size_t i = begin; i < end; i++) {
+    if (redisAsyncFormattedCommand(ctx_, firedCallback, (void *)1, fire_buf_.data() + offset,
+                                   fire_ends_[i] - offset) != REDIS_OK) {
+      REDOX_LOG(logger_, Error) << "Could not send " << end - i
+                                << " fired commands: " << ctx_->errstr;
+      return;
+    }
+    offset = fire_ends_[i];
+  }
+}
+
+void Redox::firedCallback(redisAsyncContext *ctx, void *r, void *privdata) {
+
+  Redox *rdx = (Redox *)ctx->data;
+  redisReply *reply = (redisReply *)r;
+
+  // Null when hiredis drops pending callbacks on disconnect
+  if (reply == nullptr)
+    return;
+
+  rdx->metrics_.bytes_in.fetch_add(Metrics::replySize(reply), memory_order_relaxed);
+
+  if (reply->type == REDIS_REPLY_ERROR) {
+    rdx->fired_errors_++;
+    REDOX_LOG(rdx->logger_, Error) << "Fired command failed: " << string(reply->str, reply->len);
+  }
+
+  rdx->fired_acked_ += (long)privdata;
+  freeReplyObject(reply);
+}
+
+void Redox::formattedCallback(redisAsyncContext *ctx, void *r, void *privdata) {
+
+  Redox *rdx = (Redox *)ctx->data;
+  FormattedBatch *b = (FormattedBatch *)privdata;
+  redisReply *reply = (redisReply *)r;
+
+  rdx->metrics_.bytes_in.fetch_add(Metrics::replySize(reply), memory_order_relaxed);
+
+  if (b->callback)
+    b->callback(b->next, reply);
+
+  if (reply != nullptr)
+    freeReplyObject(reply);
+
+  if (++b->next == b->count)
+    delete b;
 }
 
 void Redox::freeQueuedCommands(struct ev_loop *loop, ev_async *async, int revents) {
 
-  Redox *rdx = (Redox *)ev_userdata(loop);
+  Redox *rdx = (Redox *)async->data;
 
   lock_guard<mutex> lg(rdx->free_queue_guard_);
 
@@ -495,7 +1129,15 @@ template <class ReplyT> bool Redox::freeQueuedCommand(long id) {
   if (c == nullptr)
     return false;
 
+  REDOX_PROBE2(command__free, c->id_, c->repeat_ > 0);
+
   c->freeReply();
+  metrics_.in_flight.fetch_sub(c->unanswered_, memory_order_relaxed);
+
+  // Forget it if it was never seen flushed
+  if (!unflushed_.empty())
+    unflushed_.erase(remove(unflushed_.begin(), unflushed_.end(), &c->timeline_),
+                     unflushed_.end());
 
   // Stop the libev timer if this is a repeating command
   if ((c->repeat_ != 0) || (c->after_ != 0)) {
@@ -531,6 +1173,7 @@ template <class ReplyT> long Redox::freeAllCommandsOfType() {
     Command<ReplyT> *c = pair.second;
 
     c->freeReply();
+    metrics_.in_flight.fetch_sub(c->unanswered_, memory_order_relaxed);
 
     // Stop the libev timer if this is a repeating command
     if ((c->repeat_ != 0) || (c->after_ != 0)) {
@@ -615,6 +1258,54 @@ vector<string> Redox::strToVec(const string &s, const char delimiter) {
 
 void Redox::command(const vector<string> &cmd) { command<redisReply *>(cmd, nullptr); }
 
+void Redox::command(FormattedCommand cmd) { command<redisReply *>(move(cmd), nullptr); }
+
+void Redox::fire(const FormattedCommand &cmd) {
+  fireFormatted([&cmd](string &buf) {
+
+    // Large Buffers are copied into the send buffer
+    size_t at = 0;
+    for (const FormattedCommand::Splice &splice : cmd.splices_) {
+      buf.append(cmd.data_, at, splice.offset - at);
+      for (const struct iovec &piece : splice.buffer.pieces())
+        buf.append((const char *)piece.iov_base, piece.iov_len);
+      at = splice.offset;
+    }
+    buf.append(cmd.data_, at, string::npos);
+  });
+}
+
+void Redox::fire(const vector<string> &cmd) {
+  fireFormatted([&cmd](string &buf) { resp::appendCommand(buf, cmd); });
+}
+
+void Redox::commandFormatted(const string &frames, const vector<size_t> &ends,
+                             const function<void(size_t, redisReply *)> &callback) {
+
+  if (ends.empty())
+    return;
+
+  {
+    unique_lock<mutex> ul(running_lock_);
+    if (!running_) {
+      throw runtime_error("[ERROR] Need to connect Redox before running commands!");
+    }
+  }
+
+  FormattedBatch *b = new FormattedBatch{callback, ends.size(), 0};
+
+  lock_guard<mutex> lg(queue_guard_);
+
+  size_t base = fire_buf_.size();
+  fire_batches_.emplace_back(fire_ends_.size(), b);
+  fire_buf_.append(frames, 0, ends.back());
+  for (size_t end : ends)
+    fire_ends_.push_back(base + end);
+
+  // Signal the event loop to send it
+  ev_async_send(evloop_, &watcher_command_);
+}
+
 bool Redox::commandSync(const vector<string> &cmd) {
   auto &c = commandSync<redisReply *>(cmd);
   bool succeeded = c.ok();
@@ -622,6 +1313,13 @@ bool Redox::commandSync(const vector<string> &cmd) {
   return succeeded;
 }
 
+bool Redox::commandSync(FormattedCommand cmd) {
+  auto &c = commandSync<redisReply *>(move(cmd));
+  bool succeeded = c.ok();
+  c.free();
+  return succeeded;
+}
+
 string Redox::get(const string &key) {
 
   Command<char *> &c = commandSync<char *>({"GET", key});
@@ -639,7 +1337,21 @@ bool Redox::set(const string &key, const string &value) { return commandSync({"S
 bool Redox::del(const string &key) { return commandSync({"DEL", key}); }
 
 void Redox::publish(const string &topic, const string &msg) {
-  command<redisReply *>({"PUBLISH", topic, msg});
+  fireFormatted([&topic, &msg](string &buf) {
+    resp::appendHeader(buf, 3);
+    resp::appendArg(buf, "PUBLISH", 7);
+    resp::appendArg(buf, topic);
+    resp::appendArg(buf, msg);
+  });
+}
+
+void Redox::spublish(const string &topic, const string &msg) {
+  fireFormatted([&topic, &msg](string &buf) {
+    resp::appendHeader(buf, 3);
+    resp::appendArg(buf, "SPUBLISH", 8);
+    resp::appendArg(buf, topic);
+    resp::appendArg(buf, msg);
+  });
 }
 
 } // End namespace redis
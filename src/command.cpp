@@ -31,10 +31,11 @@ namespace redox {
 
 template <class ReplyT>
 Command<ReplyT>::Command(Redox *rdx, long id, const vector<string> &cmd,
+                         FormattedCommand &&formatted,
                          const function<void(Command<ReplyT> &)> &callback, double repeat,
                          double after, bool free_memory, log::Logger &logger)
-    : rdx_(rdx), id_(id), cmd_(cmd), repeat_(repeat), after_(after), free_memory_(free_memory),
-      callback_(callback), last_error_(), logger_(logger) {
+    : rdx_(rdx), id_(id), cmd_(cmd), formatted_(move(formatted)), repeat_(repeat), after_(after),
+      free_memory_(free_memory), callback_(callback), last_error_(), logger_(logger) {
   timer_guard_.lock();
 }
 
@@ -49,10 +50,21 @@ template <class ReplyT> void Command<ReplyT>::processReply(redisReply *r) {
   last_error_.clear();
   reply_obj_ = r;
 
+  // Only the first reply, as a subscription gets one for every message
+  Metrics &metrics = rdx_->metrics_;
+  if (unanswered_ > 0) {
+    unanswered_--;
+    metrics.in_flight.fetch_sub(1, memory_order_relaxed);
+  }
+  const size_t reply_bytes = Metrics::replySize(r);
+  metrics.bytes_in.fetch_add(reply_bytes, memory_order_relaxed);
+
+  const bool timed = rdx_->timed();
+
   if (reply_obj_ == nullptr) {
     reply_status_ = ERROR_REPLY;
     last_error_ = "Received null redisReply* from hiredis.";
-    logger_.error() << last_error_;
+    REDOX_LOG(logger_, Error) << last_error_;
     Redox::disconnectedCallback(rdx_->ctx_, REDIS_ERR);
 
   } else {
@@ -60,7 +72,65 @@ template <class ReplyT> void Command<ReplyT>::processReply(redisReply *r) {
     parseReplyObject();
   }
 
-  invoke();
+  if (timed) {
+    timeline_.parsed = chrono::steady_clock::now();
+
+    // A reply means the command was written, even if not noticed yet
+    if (timeline_.flushed == CommandTimeline::time_point())
+      timeline_.flushed = timeline_.parsed;
+  }
+
+  const long long stall_threshold = rdx_->stall_threshold_ns_;
+  if (stall_threshold == 0) {
+    invoke();
+
+  } else {
+    auto start = chrono::steady_clock::now();
+    invoke();
+    long long ns =
+        chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+    if (ns > stall_threshold) {
+      rdx_->stalled_callback_ = true;
+      rdx_->recordStall(cmd(), ns);
+    }
+  }
+
+  metrics.statuses[reply_status_ + 1].fetch_add(1, memory_order_relaxed);
+  REDOX_PROBE3(command__reply__done, id_, reply_status_, reply_bytes);
+  if (timed) {
+    timeline_.returned = chrono::steady_clock::now();
+
+    if ((metrics_ != nullptr) && (timeline_.submitted != CommandTimeline::time_point())) {
+      metrics_->server.record(chrono::duration_cast<chrono::nanoseconds>(
+                                  timeline_.parsed - timeline_.submitted).count());
+      metrics_->callback.record(chrono::duration_cast<chrono::nanoseconds>(
+                                    timeline_.returned - timeline_.parsed).count());
+    }
+
+    if (rdx_->tracing_)
+      rdx_->traceCommand(id_, reply_status_, name(), timeline_);
+
+    const long long slow_threshold = rdx_->slow_threshold_ns_;
+    if ((slow_threshold > 0) && (timeline_.submitted != CommandTimeline::time_point())) {
+      auto ns = [](CommandTimeline::time_point from, CommandTimeline::time_point to) {
+        return (int64_t)chrono::duration_cast<chrono::nanoseconds>(to - from).count();
+      };
+
+      // Looping commands start over at each run
+      bool looping = (repeat_ != 0) || (after_ != 0);
+      bool from_created = !looping && (timeline_.created != CommandTimeline::time_point());
+      int64_t total =
+          ns(from_created ? timeline_.created : timeline_.submitted, timeline_.returned);
+
+      if (total > slow_threshold) {
+        rdx_->slow_log_->record(args(), reply_status_, reply_bytes, total,
+                                from_created ? ns(timeline_.created, timeline_.submitted) : 0,
+                                ns(timeline_.submitted, timeline_.flushed),
+                                ns(timeline_.flushed, timeline_.parsed),
+                                ns(timeline_.parsed, timeline_.returned));
+      }
+    }
+  }
 
   pending_--;
 
@@ -113,12 +183,12 @@ template <class ReplyT> void Command<ReplyT>::freeReply() {
 template <class ReplyT> ReplyT Command<ReplyT>::reply() {
   lock_guard<mutex> lg(reply_guard_);
   if (!ok()) {
-    logger_.warning() << cmd() << ": Accessing reply value while status != OK.";
+    REDOX_LOG(logger_, Warning) << cmd() << ": Accessing reply value while status != OK.";
   }
   return reply_val_;
 }
 
-template <class ReplyT> string Command<ReplyT>::cmd() const { return rdx_->vecToStr(cmd_); }
+template <class ReplyT> string Command<ReplyT>::cmd() const { return rdx_->vecToStr(args()); }
 
 template <class ReplyT> bool Command<ReplyT>::isExpectedReply(int type) {
 
@@ -134,7 +204,7 @@ template <class ReplyT> bool Command<ReplyT>::isExpectedReply(int type) {
   errorMessage << "Received reply of type " << reply_obj_->type << ", expected type " << type
                << ".";
   last_error_ = errorMessage.str();
-  logger_.error() << cmd() << ": " << last_error_;
+  REDOX_LOG(logger_, Error) << cmd() << ": " << last_error_;
   reply_status_ = WRONG_TYPE;
   return false;
 }
@@ -153,7 +223,7 @@ template <class ReplyT> bool Command<ReplyT>::isExpectedReply(int typeA, int typ
   errorMessage << "Received reply of type " << reply_obj_->type << ", expected type " << typeA
                << " or " << typeB << ".";
   last_error_ = errorMessage.str();
-  logger_.error() << cmd() << ": " << last_error_;
+  REDOX_LOG(logger_, Error) << cmd() << ": " << last_error_;
   reply_status_ = WRONG_TYPE;
   return false;
 }
@@ -165,7 +235,7 @@ template <class ReplyT> bool Command<ReplyT>::checkErrorReply() {
       last_error_ = reply_obj_->str;
     }
 
-    logger_.error() << cmd() << ": " << last_error_;
+    REDOX_LOG(logger_, Error) << cmd() << ": " << last_error_;
     reply_status_ = ERROR_REPLY;
     return true;
   }
@@ -175,7 +245,7 @@ template <class ReplyT> bool Command<ReplyT>::checkErrorReply() {
 template <class ReplyT> bool Command<ReplyT>::checkNilReply() {
 
   if (reply_obj_->type == REDIS_REPLY_NIL) {
-    logger_.warning() << cmd() << ": Nil reply.";
+    REDOX_LOG(logger_, Warning) << cmd() << ": Nil reply.";
     reply_status_ = NIL_REPLY;
     return true;
   }
@@ -0,0 +1,155 @@
+/*
+* Redox - A modern, asynchronous, and wicked fast C++11 client for Redis
+*
+*    https://github.com/hmartiro/redox
+*
+* Copyright 2015 - Hayk Martirosyan <hayk.mart at gmail dot com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#include <signal.h>
+#include <stdexcept>
+#include <future>
+#include "event_loop.hpp"
+#include "utils/ev_wrappers.hpp"
+
+using namespace std;
+
+namespace redox {
+
+EventLoopGroup::EventLoopGroup(size_t threads) : EventLoopGroup(ThreadOptions(), threads) {}
+
+EventLoopGroup::EventLoopGroup(const ThreadOptions &options, size_t threads) {
+
+  signal(SIGPIPE, SIG_IGN);
+
+  if (threads == 0)
+    threads = options.cpus.empty() ? max(1u, thread::hardware_concurrency()) : options.cpus.size();
+
+  for (size_t i = 0; i < threads; i++) {
+    Loop *l = new Loop();
+    loops_.emplace_back(l);
+    l->ev = ev_loop_new(EVFLAG_AUTO);
+    if (l->ev == nullptr) {
+      loops_.pop_back();
+      stop();
+      throw runtime_error("[ERROR] Could not create a libev event loop.");
+    }
+
+    ThreadOptions placement = options;
+    if (!options.cpus.empty())
+      placement.cpus = {options.cpus[i % options.cpus.size()]};
+    start(l, placement);
+  }
+}
+
+EventLoopGroup::EventLoopGroup(struct ev_loop *loop, const ThreadOptions &options) {
+
+  signal(SIGPIPE, SIG_IGN);
+
+  Loop *l = new Loop();
+  loops_.emplace_back(l);
+  l->ev = loop;
+  l->owned = false;
+  start(l, options);
+}
+
+EventLoopGroup::~EventLoopGroup() { stop(); }
+
+void EventLoopGroup::start(Loop *l, const ThreadOptions &options) {
+
+  // The loop thread holds the lock except while it waits for events
+  ev_set_userdata(l->ev, (void *)l);
+  ev_set_loop_release_cb(l->ev, releaseLock, acquireLock);
+
+  redox_ev_async_init(&l->wake, onWake);
+  l->wake.data = (void *)l;
+  ev_async_start(l->ev, &l->wake);
+
+  if (options.numa_local)
+    l->numa_node = numaNode(options.cpus);
+
+  // Placed before running anything, so the loop's memory is allocated there
+  promise<string> placed;
+  l->thread = thread([l, &options, &placed] {
+    string error;
+    placeThread(options, error);
+    placed.set_value(error);
+
+    lock_guard<mutex> lg(l->lock);
+    ev_run(l->ev, 0);
+  });
+
+  string error = placed.get_future().get();
+  if (!error.empty()) {
+    stop();
+    throw runtime_error("[ERROR] Could not place an event loop thread: " + error);
+  }
+}
+
+void EventLoopGroup::stop() {
+
+  for (auto &l : loops_) {
+    l->exit = true;
+    ev_async_send(l->ev, &l->wake);
+  }
+
+  for (auto &l : loops_) {
+    l->thread.join();
+    ev_async_stop(l->ev, &l->wake);
+    ev_set_loop_release_cb(l->ev, nullptr, nullptr);
+    if (l->owned)
+      ev_loop_destroy(l->ev);
+  }
+  loops_.clear();
+}
+
+void EventLoopGroup::run(size_t index, const function<void(struct ev_loop *)> &fn) {
+  Loop *l = loops_[index].get();
+  lock_guard<mutex> lg(l->lock);
+  fn(l->ev);
+  ev_async_send(l->ev, &l->wake);
+}
+
+EventLoopGroup::Loop *EventLoopGroup::acquire() {
+
+  lock_guard<mutex> lg(clients_guard_);
+
+  Loop *best = loops_[0].get();
+  for (auto &l : loops_) {
+    if (l->clients < best->clients)
+      best = l.get();
+  }
+  best->clients++;
+  return best;
+}
+
+void EventLoopGroup::release(Loop *l) {
+  lock_guard<mutex> lg(clients_guard_);
+  l->clients--;
+}
+
+void EventLoopGroup::onWake(struct ev_loop *loop, ev_async *async, int revents) {
+  Loop *l = (Loop *)async->data;
+  if (l->exit)
+    ev_break(loop, EVBREAK_ALL);
+}
+
+void EventLoopGroup::releaseLock(struct ev_loop *loop) {
+  ((Loop *)ev_userdata(loop))->lock.unlock();
+}
+
+void EventLoopGroup::acquireLock(struct ev_loop *loop) { ((Loop *)ev_userdata(loop))->lock.lock(); }
+
+} // End namespace
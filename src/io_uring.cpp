@@ -0,0 +1,445 @@
+/*
+* Redox - A modern, asynchronous, and wicked fast C++11 client for Redis
+*
+*    https://github.com/hmartiro/redox
+*
+* Copyright 2015 - Hayk Martirosyan <hayk.mart at gmail dot com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#include "backend.hpp"
+#include "utils/placement.hpp"
+#include "utils/ev_wrappers.hpp"
+
+#ifdef REDOX_IO_URING
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include <algorithm>
+
+using namespace std;
+
+namespace redox {
+
+namespace {
+
+// There is no glibc wrapper for the io_uring system calls
+int ringSetup(unsigned entries, struct io_uring_params *p) {
+  return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+int ringEnter(int fd, unsigned to_submit, unsigned flags) {
+  return (int)syscall(__NR_io_uring_enter, fd, to_submit, 0, flags, nullptr, 0);
+}
+
+int ringRegister(int fd, unsigned opcode, const void *arg, unsigned nr_args) {
+  return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+} // anonymous
+
+IoUringBackend::IoUringBackend(const IoUringOptions &options) : options_(options) {}
+
+IoUringBackend::~IoUringBackend() {
+  // The event loop may be gone by now
+  loop_ = nullptr;
+  teardown();
+}
+
+bool IoUringBackend::supported(const IoUringOptions &options) {
+  IoUringBackend b(options);
+  return b.setup();
+}
+
+bool IoUringBackend::setup() {
+
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  if (options_.sqpoll) {
+    p.flags |= IORING_SETUP_SQPOLL;
+    p.sq_thread_idle = options_.sqpoll_idle_ms;
+  }
+
+  ring_fd_ = ringSetup(max(options_.entries, 4u), &p);
+  if (ring_fd_ < 0)
+    return false;
+
+  sq_entries_ = p.sq_entries;
+  sq_map_size_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cq_map_size_ = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    sq_map_size_ = cq_map_size_ = max(sq_map_size_, cq_map_size_);
+
+  sq_map_ = mmap(nullptr, sq_map_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                 ring_fd_, IORING_OFF_SQ_RING);
+  if (sq_map_ == MAP_FAILED) {
+    sq_map_ = nullptr;
+    teardown();
+    return false;
+  }
+
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    cq_map_ = sq_map_;
+  } else {
+    cq_map_ = mmap(nullptr, cq_map_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   ring_fd_, IORING_OFF_CQ_RING);
+    if (cq_map_ == MAP_FAILED) {
+      cq_map_ = nullptr;
+      teardown();
+      return false;
+    }
+  }
+
+  sqes_size_ = p.sq_entries * sizeof(struct io_uring_sqe);
+  void *sqes = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    ring_fd_, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) {
+    teardown();
+    return false;
+  }
+  sqes_ = (struct io_uring_sqe *)sqes;
+
+  char *sq = (char *)sq_map_;
+  sq_head_ = (unsigned *)(sq + p.sq_off.head);
+  sq_tail_ = (unsigned *)(sq + p.sq_off.tail);
+  sq_mask_ = (unsigned *)(sq + p.sq_off.ring_mask);
+  sq_flags_ = (unsigned *)(sq + p.sq_off.flags);
+  sq_array_ = (unsigned *)(sq + p.sq_off.array);
+
+  char *cq = (char *)cq_map_;
+  cq_head_ = (unsigned *)(cq + p.cq_off.head);
+  cq_tail_ = (unsigned *)(cq + p.cq_off.tail);
+  cq_mask_ = (unsigned *)(cq + p.cq_off.ring_mask);
+  cqes_ = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+  // Page-aligned read and write buffers, pinned by the kernel once registered
+  void *buffers = mmap(nullptr, 2 * options_.buffer_size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buffers == MAP_FAILED) {
+    teardown();
+    return false;
+  }
+  buffers_ = (char *)buffers;
+
+  // Not touched yet, so the kernel allocates them there when pinning
+  if (numa_node_ >= 0)
+    bindMemory(buffers_, 2 * options_.buffer_size, numa_node_);
+
+  struct iovec iov[2];
+  iov[0].iov_base = buffers_;
+  iov[0].iov_len = options_.buffer_size;
+  iov[1].iov_base = buffers_ + options_.buffer_size;
+  iov[1].iov_len = options_.buffer_size;
+  if (ringRegister(ring_fd_, IORING_REGISTER_BUFFERS, iov, 2) < 0) {
+    teardown();
+    return false;
+  }
+
+  return true;
+}
+
+void IoUringBackend::teardown() {
+
+  release();
+  if (loop_ != nullptr) {
+    ev_io_stop(loop_, &watcher_ring_);
+    ev_prepare_stop(loop_, &watcher_prepare_);
+    loop_ = nullptr;
+  }
+
+  // Closing the ring cancels anything still in flight
+  if (ring_fd_ >= 0) {
+    close(ring_fd_);
+    ring_fd_ = -1;
+  }
+
+  if (sqes_ != nullptr)
+    munmap(sqes_, sqes_size_);
+  if ((cq_map_ != nullptr) && (cq_map_ != sq_map_))
+    munmap(cq_map_, cq_map_size_);
+  if (sq_map_ != nullptr)
+    munmap(sq_map_, sq_map_size_);
+  if (buffers_ != nullptr)
+    munmap(buffers_, 2 * options_.buffer_size);
+
+  sqes_ = nullptr;
+  cq_map_ = sq_map_ = nullptr;
+  buffers_ = nullptr;
+}
+
+bool IoUringBackend::attach(struct ev_loop *loop, redisAsyncContext *ctx) {
+
+  // Nothing should already be attached to the context
+  if (ctx->ev.data != nullptr)
+    return false;
+
+  if (!setup())
+    return false;
+
+  loop_ = loop;
+  ctx_ = ctx;
+
+  ctx->ev.addRead = addRead;
+  ctx->ev.delRead = delRead;
+  ctx->ev.addWrite = addWrite;
+  ctx->ev.delWrite = delWrite;
+  ctx->ev.cleanup = cleanup;
+  ctx->ev.data = (void *)this;
+
+  redox_ev_io_init(&watcher_ring_, onRing, ring_fd_, EV_READ);
+  watcher_ring_.data = (void *)this;
+  ev_io_start(loop, &watcher_ring_);
+
+  redox_ev_prepare_init(&watcher_prepare_, onPrepare);
+  watcher_prepare_.data = (void *)this;
+  ev_prepare_start(loop, &watcher_prepare_);
+
+  initHolding();
+
+  return true;
+}
+
+bool IoUringBackend::flushed() {
+  return closed_ || ((sdslen(ctx_->c.obuf) == 0) && (write_off_ == write_len_));
+}
+
+struct io_uring_sqe *IoUringBackend::nextSqe() {
+
+  unsigned tail = *sq_tail_;
+  if (tail - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_) {
+    submit();
+    if (tail - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_)
+      return nullptr;
+  }
+
+  unsigned index = tail & *sq_mask_;
+  struct io_uring_sqe *sqe = &sqes_[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sq_array_[index] = index;
+  return sqe;
+}
+
+void IoUringBackend::queueRead() {
+
+  struct io_uring_sqe *sqe = nextSqe();
+  if (sqe == nullptr)
+    return;
+
+  sqe->opcode = IORING_OP_READ_FIXED;
+  sqe->fd = ctx_->c.fd;
+  sqe->addr = (unsigned long)buffers_;
+  sqe->len = options_.buffer_size;
+  sqe->buf_index = 0;
+  sqe->user_data = READ;
+
+  // Published only once filled in, for the SQPOLL thread
+  __atomic_store_n(sq_tail_, *sq_tail_ + 1, __ATOMIC_RELEASE);
+  to_submit_++;
+  read_in_flight_ = true;
+}
+
+void IoUringBackend::queueWrite() {
+
+  struct io_uring_sqe *sqe = nextSqe();
+  if (sqe == nullptr)
+    return;
+
+  // Take as much of the output buffer as fits, unless some is left to write
+  char *buf = buffers_ + options_.buffer_size;
+  if (write_off_ == write_len_) {
+    sds obuf = ctx_->c.obuf;
+    size_t n = min(sdslen(obuf), options_.buffer_size);
+    memcpy(buf, obuf, n);
+    sdsrange(obuf, n, -1);
+    write_len_ = n;
+    write_off_ = 0;
+  }
+
+  sqe->opcode = IORING_OP_WRITE_FIXED;
+  sqe->fd = ctx_->c.fd;
+  sqe->addr = (unsigned long)(buf + write_off_);
+  sqe->len = write_len_ - write_off_;
+  sqe->buf_index = 1;
+  sqe->user_data = WRITE;
+
+  __atomic_store_n(sq_tail_, *sq_tail_ + 1, __ATOMIC_RELEASE);
+  to_submit_++;
+  write_in_flight_ = true;
+}
+
+void IoUringBackend::queuePoll() {
+
+  struct io_uring_sqe *sqe = nextSqe();
+  if (sqe == nullptr)
+    return;
+
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = ctx_->c.fd;
+  sqe->poll_events = (writing_ ? POLLOUT : 0) | (reading_ ? POLLIN : 0);
+  sqe->user_data = POLL;
+
+  __atomic_store_n(sq_tail_, *sq_tail_ + 1, __ATOMIC_RELEASE);
+  to_submit_++;
+  poll_in_flight_ = true;
+}
+
+void IoUringBackend::submit() {
+
+  if (to_submit_ == 0)
+    return;
+
+  // The SQPOLL thread picks submissions up by itself, unless it went to sleep
+  unsigned flags = 0;
+  if (options_.sqpoll) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!(__atomic_load_n(sq_flags_, __ATOMIC_RELAXED) & IORING_SQ_NEED_WAKEUP)) {
+      to_submit_ = 0;
+      return;
+    }
+    flags |= IORING_ENTER_SQ_WAKEUP;
+  }
+
+  int n = ringEnter(ring_fd_, to_submit_, flags);
+  if (options_.sqpoll)
+    to_submit_ = 0;
+  else if (n > 0)
+    to_submit_ -= min((unsigned)n, to_submit_);
+}
+
+void IoUringBackend::complete() {
+
+  completing_ = true;
+
+  while (!closed_) {
+
+    unsigned head = *cq_head_;
+    if (head == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE))
+      break;
+
+    struct io_uring_cqe *cqe = &cqes_[head & *cq_mask_];
+    Op op = (Op)cqe->user_data;
+    int res = cqe->res;
+    __atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+
+    completed(op, res);
+  }
+
+  completing_ = false;
+
+  // Freed by hiredis from one of the completions
+  if (closed_)
+    teardown();
+}
+
+void IoUringBackend::completed(Op op, int res) {
+
+  bool retry = (res == -EAGAIN) || (res == -EINTR);
+
+  if (op == READ) {
+    read_in_flight_ = false;
+
+    if (res > 0) {
+      redisReaderFeed(ctx_->c.reader, buffers_, res);
+      redisProcessCallbacks(ctx_);
+
+    } else if (!retry && (res != -ECANCELED)) {
+      // Closed or failed: hiredis reads again itself, to find out and disconnect
+      redisAsyncHandleRead(ctx_);
+    }
+
+  } else if (op == WRITE) {
+    write_in_flight_ = false;
+
+    if (res > 0) {
+      write_off_ += res;
+
+    } else if (!retry && (res != -ECANCELED)) {
+      // Make hiredis see the connection as closed
+      shutdown(ctx_->c.fd, SHUT_RDWR);
+      redisAsyncHandleRead(ctx_);
+    }
+
+  } else if (op == POLL) {
+    poll_in_flight_ = false;
+
+    // Until connected, hiredis does the I/O and handles connecting
+    if (res < 0)
+      return;
+    if (writing_ && (res & (POLLOUT | POLLERR | POLLHUP)))
+      redisAsyncHandleWrite(ctx_);
+    else if (reading_ && (res & (POLLIN | POLLERR | POLLHUP)))
+      redisAsyncHandleRead(ctx_);
+  }
+}
+
+void IoUringBackend::addRead(void *privdata) { ((IoUringBackend *)privdata)->reading_ = true; }
+
+void IoUringBackend::delRead(void *privdata) { ((IoUringBackend *)privdata)->reading_ = false; }
+
+void IoUringBackend::addWrite(void *privdata) {
+  IoUringBackend *b = (IoUringBackend *)privdata;
+  b->writing_ = true;
+  b->holdBack();
+}
+
+void IoUringBackend::delWrite(void *privdata) { ((IoUringBackend *)privdata)->writing_ = false; }
+
+void IoUringBackend::cleanup(void *privdata) {
+
+  IoUringBackend *b = (IoUringBackend *)privdata;
+  b->closed_ = true;
+  b->ctx_ = nullptr;
+
+  // Or once done with the completions
+  if (!b->completing_)
+    b->teardown();
+}
+
+void IoUringBackend::onRing(struct ev_loop *loop, ev_io *w, int revents) {
+  ((IoUringBackend *)w->data)->complete();
+}
+
+void IoUringBackend::onPrepare(struct ev_loop *loop, ev_prepare *w, int revents) {
+
+  IoUringBackend *b = (IoUringBackend *)w->data;
+  if (b->closed_)
+    return;
+
+  if (!(b->ctx_->c.flags & REDIS_CONNECTED)) {
+    if ((b->reading_ || b->writing_) && !b->poll_in_flight_)
+      b->queuePoll();
+
+  } else {
+    // Everything queued during this iteration goes out in one write, unless
+    // held back for longer
+    if (!b->write_in_flight_ && ((b->write_off_ < b->write_len_) ||
+                                 (!b->holding() && (sdslen(b->ctx_->c.obuf) > 0))))
+      b->queueWrite();
+    if (b->reading_ && !b->read_in_flight_)
+      b->queueRead();
+  }
+
+  b->submit();
+}
+
+} // End namespace
+
+#endif
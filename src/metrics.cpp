@@ -0,0 +1,206 @@
+/*
+* Redox - A modern, asynchronous, and wicked fast C++11 client for Redis
+*
+*    https://github.com/hmartiro/redox
+*
+* Copyright 2015 - Hayk Martirosyan <hayk.mart at gmail dot com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#include <ctype.h>
+#include <string.h>
+#include <algorithm>
+#include "metrics.hpp"
+#include "utils/resp.hpp"
+
+using namespace std;
+
+namespace redox {
+
+size_t Metrics::NoCaseHash::operator()(const string &s) const {
+  size_t h = 14695981039346656037ull;
+  for (char c : s)
+    h = (h ^ (size_t)toupper((unsigned char)c)) * 1099511628211ull;
+  return h;
+}
+
+bool Metrics::NoCaseEqual::operator()(const string &a, const string &b) const {
+  if (a.size() != b.size())
+    return false;
+  for (size_t i = 0; i < a.size(); i++) {
+    if (toupper((unsigned char)a[i]) != toupper((unsigned char)b[i]))
+      return false;
+  }
+  return true;
+}
+
+CommandMetrics *Metrics::command(const string &name) {
+
+  // Only this thread inserts, so finding needs no lock
+  auto it = commands_.find(name);
+  if (it != commands_.end())
+    return it->second.get();
+
+  lock_guard<mutex> lg(commands_guard_);
+
+  string key = name;
+  if (commands_.size() >= MAX_COMMANDS) {
+    key = "OTHER";
+    it = commands_.find(key);
+    if (it != commands_.end())
+      return it->second.get();
+  }
+
+  for (char &c : key)
+    c = toupper((unsigned char)c);
+
+  CommandMetrics *m = new CommandMetrics();
+  commands_[key].reset(m);
+  return m;
+}
+
+MetricsSnapshot Metrics::snapshot() {
+
+  MetricsSnapshot s;
+  {
+    lock_guard<mutex> lg(commands_guard_);
+    s.commands.reserve(commands_.size());
+    for (auto &pair : commands_) {
+      MetricsSnapshot::Command c;
+      c.name = pair.first;
+      c.queued = pair.second->queued.snapshot();
+      c.server = pair.second->server.snapshot();
+      c.callback = pair.second->callback.snapshot();
+      s.commands.push_back(std::move(c));
+    }
+  }
+
+  s.queued = queued;
+  s.in_flight = in_flight;
+  s.bytes_out = bytes_out;
+  s.bytes_in = bytes_in;
+  for (int i = 0; i < NUM_STATUSES; i++)
+    s.statuses.push_back(statuses[i]);
+  s.connects = connects;
+  s.connect_errors = connect_errors;
+  s.disconnects = disconnects;
+  s.disconnect_errors = disconnect_errors;
+  s.loop_busy_ns = loop_busy_ns;
+  s.loop_idle_ns = loop_idle_ns;
+  s.stalls = stalls;
+  return s;
+}
+
+SlowLog::SlowLog(size_t capacity)
+    : capacity_((capacity == 0) ? 1 : capacity), slots_(new Slot[capacity_]) {}
+
+void SlowLog::record(const vector<string> &cmd, int status, size_t reply_bytes, int64_t total,
+                     int64_t queued, int64_t write, int64_t server, int64_t callback) {
+
+  Entry e;
+  e.time = chrono::duration_cast<chrono::nanoseconds>(
+               chrono::system_clock::now().time_since_epoch()).count();
+  e.status = status;
+  e.reply_bytes = reply_bytes;
+  e.total = total;
+  e.queued = queued;
+  e.write = write;
+  e.server = server;
+  e.callback = callback;
+
+  // Join the arguments with spaces, as far as they fit
+  size_t len = 0;
+  for (const string &arg : cmd) {
+    if ((len > 0) && (len < MAX_CMD))
+      e.cmd[len++] = ' ';
+    size_t n = min(arg.size(), MAX_CMD - len);
+    memcpy(e.cmd + len, arg.data(), n);
+    len += n;
+    if (len == MAX_CMD)
+      break;
+  }
+  e.cmd_len = len;
+
+  uint64_t n = next_.load(memory_order_relaxed);
+  Slot &slot = slots_[n % capacity_];
+  slot.seq.store(2 * n + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  slot.entry = e;
+  slot.seq.store(2 * n + 2, memory_order_release);
+  next_.store(n + 1, memory_order_release);
+}
+
+vector<SlowCommand> SlowLog::dump() const {
+
+  uint64_t end = next_.load(memory_order_acquire);
+  uint64_t begin = (end > capacity_) ? end - capacity_ : 0;
+
+  vector<SlowCommand> commands;
+  commands.reserve(end - begin);
+  for (uint64_t n = begin; n < end; n++) {
+
+    // Skip it if it is overwritten while we copy it
+    const Slot &slot = slots_[n % capacity_];
+    uint64_t seq = slot.seq.load(memory_order_acquire);
+    if (seq != 2 * n + 2)
+      continue;
+    Entry e = slot.entry;
+    atomic_thread_fence(memory_order_acquire);
+    if (slot.seq.load(memory_order_relaxed) != seq)
+      continue;
+
+    SlowCommand c;
+    c.time = chrono::system_clock::time_point(
+        chrono::duration_cast<chrono::system_clock::duration>(chrono::nanoseconds(e.time)));
+    c.cmd.assign(e.cmd, e.cmd_len);
+    c.status = e.status;
+    c.reply_bytes = e.reply_bytes;
+    c.total = e.total / 1e9;
+    c.queued = e.queued / 1e9;
+    c.write = e.write / 1e9;
+    c.server = e.server / 1e9;
+    c.callback = e.callback / 1e9;
+    commands.push_back(std::move(c));
+  }
+  return commands;
+}
+
+size_t Metrics::replySize(const redisReply *r) {
+
+  if (r == nullptr)
+    return 0;
+
+  switch (r->type) {
+  case REDIS_REPLY_STRING:
+    return resp::argSize(r->len);
+  case REDIS_REPLY_STATUS:
+  case REDIS_REPLY_ERROR:
+    return 1 + r->len + 2;
+  case REDIS_REPLY_INTEGER:
+    return 1 + resp::numDigits(r->integer < 0 ? -r->integer : r->integer) +
+           (r->integer < 0 ? 1 : 0) + 2;
+  case REDIS_REPLY_NIL:
+    return 5; // $-1\r\n
+  case REDIS_REPLY_ARRAY: {
+    size_t size = resp::headerSize(r->elements);
+    for (size_t i = 0; i < r->elements; i++)
+      size += replySize(r->element[i]);
+    return size;
+  }
+  default:
+    return 0;
+  }
+}
+
+} // End namespace
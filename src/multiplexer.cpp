@@ -0,0 +1,180 @@
+/*
+* Redox - A modern, asynchronous, and wicked fast C++11 client for Redis
+*
+*    https://github.com/hmartiro/redox
+*
+* Copyright 2015 - Hayk Martirosyan <hayk.mart at gmail dot com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#include "multiplexer.hpp"
+
+using namespace std;
+
+namespace redox {
+
+Multiplexer::Multiplexer(ostream &log_stream, log::Level log_level)
+    : logger_(log_stream, log_level), sub_(log_stream, log_level) {}
+
+void Multiplexer::stop() {
+  {
+    lock_guard<mutex> lg(guard_);
+    stopping_ = true;
+  }
+  sub_.stop();
+}
+
+void Multiplexer::disconnect() {
+  stop();
+  wait();
+}
+
+long Multiplexer::listen(const string &topic, Listener listener) {
+  return listenBase(topic, false, listener);
+}
+
+long Multiplexer::plisten(const string &pattern, Listener listener) {
+  return listenBase(pattern, true, listener);
+}
+
+long Multiplexer::listenBase(const string &topic, bool pattern, Listener listener) {
+
+  shared_ptr<Topic> t;
+  bool first = false;
+  long id;
+  {
+    lock_guard<mutex> lg(guard_);
+
+    auto &topics = pattern ? patterns_ : topics_;
+    auto it = topics.find(topic);
+    if (it == topics.end()) {
+      t = make_shared<Topic>();
+      t->name = topic;
+      t->pattern = pattern;
+      t->listeners = make_shared<const ListenerList>();
+      topics[topic] = t;
+    } else {
+      t = it->second;
+    }
+
+    id = next_id_++;
+    auto listeners = make_shared<ListenerList>(*t->listeners);
+    listeners->emplace_back(id, listener);
+    t->listeners = listeners;
+    listener_topics_[id] = t;
+
+    // If the topic is still being unsubscribed from, it gets subscribed
+    // again once the server acknowledges that
+    first = (t->listeners->size() == 1) && !t->unsubscribing && !stopping_;
+  }
+
+  if (first)
+    subscribeTopic(t);
+
+  return id;
+}
+
+void Multiplexer::unlisten(long id) {
+
+  shared_ptr<Topic> t;
+  bool last = false;
+  {
+    lock_guard<mutex> lg(guard_);
+
+    auto it = listener_topics_.find(id);
+    if (it == listener_topics_.end()) {
+      logger_.warning() << "Cannot unlisten " << id << ", no such listener!";
+      return;
+    }
+    t = it->second;
+    listener_topics_.erase(it);
+
+    auto listeners = make_shared<ListenerList>();
+    for (const auto &l : *t->listeners)
+      if (l.first != id)
+        listeners->push_back(l);
+    t->listeners = listeners;
+
+    last = listeners->empty() && !t->unsubscribing;
+    if (last)
+      t->unsubscribing = true;
+  }
+
+  if (!last)
+    return;
+
+  if (t->pattern)
+    sub_.punsubscribe(t->name);
+  else
+    sub_.unsubscribe(t->name);
+}
+
+size_t Multiplexer::listeners(const string &topic) {
+  lock_guard<mutex> lg(guard_);
+  auto it = topics_.find(topic);
+  if (it != topics_.end())
+    return it->second->listeners->size();
+  it = patterns_.find(topic);
+  if (it != patterns_.end())
+    return it->second->listeners->size();
+  return 0;
+}
+
+void Multiplexer::subscribeTopic(const shared_ptr<Topic> &t) {
+
+  auto msg_callback = [this, t](const string &topic, const shared_ptr<const string> &msg) {
+    fanOut(t, topic, msg);
+  };
+  auto unsub_callback = [this, t](const string &) { unsubscribed(t); };
+
+  sub_.subscribeShared(t->pattern ? "PSUBSCRIBE" : "SUBSCRIBE", t->name, msg_callback,
+                       unsub_callback);
+}
+
+void Multiplexer::fanOut(const shared_ptr<Topic> &t, const string &topic,
+                         const shared_ptr<const string> &msg) {
+
+  shared_ptr<const ListenerList> listeners;
+  {
+    lock_guard<mutex> lg(guard_);
+    listeners = t->listeners;
+  }
+
+  if (listeners->empty())
+    return;
+
+  // The Subscriber built the message into one buffer, shared by every listener
+  for (const auto &l : *listeners)
+    l.second(topic, msg);
+}
+
+void Multiplexer::unsubscribed(const shared_ptr<Topic> &t) {
+
+  bool resubscribe;
+  {
+    lock_guard<mutex> lg(guard_);
+    t->unsubscribing = false;
+    if (stopping_)
+      return;
+    resubscribe = !t->listeners->empty();
+    if (!resubscribe)
+      (t->pattern ? patterns_ : topics_).erase(t->name);
+  }
+
+  // Listeners came back while we were unsubscribing
+  if (resubscribe)
+    subscribeTopic(t);
+}
+
+} // End namespace
@@ -0,0 +1,578 @@
+/*
+* Redox - A modern, asynchronous, and wicked fast C++11 client for Redis
+*
+*    https://github.com/hmartiro/redox
+*
+* Copyright 2015 - Hayk Martirosyan <hayk.mart at gmail dot com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#include <string.h>
+#include <array>
+#include "sharded.hpp"
+
+using namespace std;
+
+namespace {
+
+// CRC16-CCITT (XMODEM), the hash function of Redis Cluster
+const array<uint16_t, 256> &crc16Table() {
+  static const array<uint16_t, 256> table = [] {
+    array<uint16_t, 256> t;
+    for (int i = 0; i < 256; i++) {
+      uint16_t crc = i << 8;
+      for (int j = 0; j < 8; j++)
+        crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : (crc << 1);
+      t[i] = crc;
+    }
+    return t;
+  }();
+  return table;
+}
+
+uint16_t crc16(const char *buf, size_t len) {
+  const array<uint16_t, 256> &table = crc16Table();
+  uint16_t crc = 0;
+  for (size_t i = 0; i < len; i++)
+    crc = (crc << 8) ^ table[((crc >> 8) ^ (uint8_t)buf[i]) & 0xff];
+  return crc;
+}
+
+} // anonymous
+
+namespace redox {
+
+// ------------------------------------------------
+// SlotMap
+// ------------------------------------------------
+
+int SlotMap::keySlot(const string &key) {
+
+  // Only the part between the first { and the next } is hashed, if non-empty
+  size_t start = key.find('{');
+  if (start != string::npos) {
+    size_t end = key.find('}', start + 1);
+    if ((end != string::npos) && (end != start + 1))
+      return crc16(key.data() + start + 1, end - start - 1) & (NUM_SLOTS - 1);
+  }
+
+  return crc16(key.data(), key.size()) & (NUM_SLOTS - 1);
+}
+
+bool SlotMap::load(Redox &rdx) {
+
+  Command<redisReply *> &c = rdx.commandSync<redisReply *>({"CLUSTER", "SLOTS"});
+  if (!c.ok() || (c.reply()->type != REDIS_REPLY_ARRAY)) {
+    c.free();
+    return false;
+  }
+
+  vector<int> owners(NUM_SLOTS, -1);
+  vector<string> nodes;
+  map<string, int> node_index;
+
+  // Each entry is [start, end, [ip, port, id], replicas...]
+  redisReply *reply = c.reply();
+  for (size_t i = 0; i < reply->elements; i++) {
+    redisReply *range = reply->element[i];
+    if ((range->type != REDIS_REPLY_ARRAY) || (range->elements < 3))
+      continue;
+
+    if ((range->element[0]->type != REDIS_REPLY_INTEGER) ||
+        (range->element[1]->type != REDIS_REPLY_INTEGER))
+      continue;
+
+    redisReply *master = range->element[2];
+    if ((master->type != REDIS_REPLY_ARRAY) || (master->elements < 2) ||
+        (master->element[0]->type != REDIS_REPLY_STRING) ||
+        (master->element[1]->type != REDIS_REPLY_INTEGER))
+      continue;
+
+    string addr = string(master->element[0]->str, master->element[0]->len) + ":" +
+                  to_string(master->element[1]->integer);
+
+    auto it = node_index.find(addr);
+    if (it == node_index.end()) {
+      it = node_index.emplace(addr, nodes.size()).first;
+      nodes.push_back(addr);
+    }
+
+    long long start = range->element[0]->integer;
+    long long end = range->element[1]->integer;
+    for (long long slot = start; (slot <= end) && (slot < NUM_SLOTS); slot++)
+      owners[slot] = it->second;
+  }
+
+  c.free();
+
+  owners_.swap(owners);
+  nodes_.swap(nodes);
+  return true;
+}
+
+string SlotMap::owner(int slot) const {
+  if ((slot < 0) || (slot >= (int)owners_.size()) || (owners_[slot] < 0))
+    return "";
+  return nodes_[owners_[slot]];
+}
+
+void SlotMap::assign(int slot, const string &addr) {
+
+  if ((slot < 0) || (slot >= NUM_SLOTS))
+    return;
+
+  if (owners_.empty())
+    owners_.assign(NUM_SLOTS, -1);
+
+  for (size_t i = 0; i < nodes_.size(); i++) {
+    if (nodes_[i] == addr) {
+      owners_[slot] = i;
+      return;
+    }
+  }
+
+  owners_[slot] = nodes_.size();
+  nodes_.push_back(addr);
+}
+
+bool SlotMap::splitAddr(const string &addr, string &host, int &port) {
+  size_t colon = addr.rfind(':');
+  if ((colon == string::npos) || (colon == 0) || (colon == addr.size() - 1))
+    return false;
+  host = addr.substr(0, colon);
+  port = atoi(addr.c_str() + colon + 1);
+  return port > 0;
+}
+
+// ------------------------------------------------
+// ShardedSubscriber
+// ------------------------------------------------
+
+ShardedSubscriber::ShardedSubscriber(ostream &log_stream, log::Level log_level)
+    : log_stream_(log_stream), log_level_(log_level), logger_(log_stream, log_level),
+      ctl_(log_stream, log_level) {}
+
+ShardedSubscriber::~ShardedSubscriber() { disconnect(); }
+
+bool ShardedSubscriber::connect(const string &host, const int port) {
+
+  if (!ctl_.connect(host, port))
+    return false;
+  ctl_connected_ = true;
+
+  {
+    lock_guard<mutex> lg(guard_);
+    if (!slots_.load(ctl_)) {
+      logger_.error() << "Could not load the cluster slot map.";
+      return false;
+    }
+  }
+
+  refresh_thread_ = thread([this] { runRefreshThread(); });
+  return true;
+}
+
+void ShardedSubscriber::disconnect() {
+
+  if (refresh_thread_.joinable()) {
+    {
+      lock_guard<mutex> lg(refresh_guard_);
+      refresh_exit_ = true;
+    }
+    refresh_cv_.notify_all();
+    refresh_thread_.join();
+  }
+
+  {
+    lock_guard<mutex> lg(guard_);
+    channels_.clear();
+  }
+
+  {
+    lock_guard<mutex> lg(nodes_guard_);
+    for (auto &node : nodes_)
+      node.second->disconnect();
+    nodes_.clear();
+  }
+
+  if (ctl_connected_) {
+    ctl_.disconnect();
+    ctl_connected_ = false;
+  }
+}
+
+Subscriber *ShardedSubscriber::nodeSubscriber(const string &addr) {
+
+  lock_guard<mutex> lg(nodes_guard_);
+
+  auto it = nodes_.find(addr);
+  if (it != nodes_.end())
+    return it->second.get();
+
+  string host;
+  int port;
+  if (!SlotMap::splitAddr(addr, host, port)) {
+    logger_.error() << "Bad cluster node address: " << addr;
+    return nullptr;
+  }
+
+  unique_ptr<Subscriber> sub(new Subscriber(log_stream_, log_level_));
+  if (!sub->connect(host, port)) {
+    logger_.error() << "Could not connect to cluster node " << addr;
+    return nullptr;
+  }
+
+  Subscriber *s = sub.get();
+  nodes_[addr] = std::move(sub);
+  return s;
+}
+
+void ShardedSubscriber::ssubscribe(const string &topic,
+                                   function<void(const string &, const string &)> msg_callback,
+                                   function<void(const string &)> sub_callback,
+                                   function<void(const string &, int)> err_callback) {
+
+  Channel ch;
+  {
+    lock_guard<mutex> lg(guard_);
+
+    if (channels_.find(topic) != channels_.end()) {
+      logger_.warning() << "Already ssubscribed to " << topic << "!";
+      return;
+    }
+
+    ch.node = slots_.owner(SlotMap::keySlot(topic));
+    ch.msg_callback = msg_callback;
+    ch.sub_callback = sub_callback;
+    ch.err_callback = err_callback;
+
+    if (!ch.node.empty())
+      channels_[topic] = ch;
+  }
+
+  if (ch.node.empty()) {
+    logger_.error() << "No cluster node owns the slot of " << topic;
+    if (err_callback)
+      err_callback(topic, Command<redisReply *>::SEND_ERROR);
+    return;
+  }
+
+  subscribeOnNode(topic, ch.node, ch);
+}
+
+void ShardedSubscriber::subscribeOnNode(const string &topic, const string &addr,
+                                        const Channel &ch) {
+
+  Subscriber *sub = nodeSubscriber(addr);
+  if (sub == nullptr) {
+    if (ch.err_callback)
+      ch.err_callback(topic, Command<redisReply *>::SEND_ERROR);
+    return;
+  }
+
+  auto sub_callback = [this, addr](const string &t) {
+    function<void(const string &)> user_callback;
+    {
+      lock_guard<mutex> lg(guard_);
+      auto it = channels_.find(t);
+      if ((it == channels_.end()) || (it->second.node != addr))
+        return;
+      it->second.active = true;
+      user_callback = it->second.sub_callback;
+    }
+    if (user_callback)
+      user_callback(t);
+  };
+
+  auto unsub_callback = [this, addr](const string &t) { dropped(t, addr); };
+
+  sub->ssubscribe(topic, ch.msg_callback, sub_callback, unsub_callback, ch.err_callback);
+}
+
+void ShardedSubscriber::sunsubscribe(const string &topic) {
+
+  string addr;
+  {
+    lock_guard<mutex> lg(guard_);
+    auto it = channels_.find(topic);
+    if (it == channels_.end()) {
+      logger_.warning() << "Cannot sunsubscribe from " << topic << ", not ssubscribed!";
+      return;
+    }
+    addr = it->second.node;
+    channels_.erase(it);
+  }
+
+  Subscriber *sub = nodeSubscriber(addr);
+  if (sub != nullptr)
+    sub->sunsubscribe(topic);
+}
+
+void ShardedSubscriber::dropped(const string &topic, const string &addr) {
+
+  {
+    lock_guard<mutex> lg(guard_);
+
+    // Either unsubscribed by the user, or already moved to another node
+    auto it = channels_.find(topic);
+    if ((it == channels_.end()) || (it->second.node != addr))
+      return;
+
+    it->second.active = false;
+  }
+
+  // The server dropped a subscription we still want, which means its slot
+  // moved. Look up the new owner off of the event loop thread.
+  logger_.info() << "Subscription to " << topic << " dropped by " << addr << ", refreshing slots.";
+  {
+    lock_guard<mutex> lg(refresh_guard_);
+    refresh_requested_ = true;
+  }
+  refresh_cv_.notify_one();
+}
+
+bool ShardedSubscriber::refresh() {
+
+  SlotMap fresh;
+  if (!fresh.load(ctl_))
+    return false;
+
+  // Find every topic that is not subscribed on the owner of its slot
+  vector<pair<string, string>> moves; // topic, old node
+  vector<Channel> targets;
+  {
+    lock_guard<mutex> lg(guard_);
+    slots_ = fresh;
+
+    for (auto &pair : channels_) {
+      Channel &ch = pair.second;
+      string owner = slots_.owner(SlotMap::keySlot(pair.first));
+      if (owner.empty() || ((owner == ch.node) && ch.active))
+        continue;
+
+      moves.emplace_back(pair.first, ch.active ? ch.node : "");
+      ch.node = owner;
+      ch.active = false;
+      targets.push_back(ch);
+    }
+  }
+
+  for (size_t i = 0; i < moves.size(); i++) {
+    const string &topic = moves[i].first;
+    const string &old_node = moves[i].second;
+
+    if (!old_node.empty() && (old_node != targets[i].node)) {
+      Subscriber *old_sub = nodeSubscriber(old_node);
+      if (old_sub != nullptr)
+        old_sub->sunsubscribe(topic);
+    }
+
+    subscribeOnNode(topic, targets[i].node, targets[i]);
+  }
+
+  return true;
+}
+
+void ShardedSubscriber::runRefreshThread() {
+
+  while (true) {
+    {
+      unique_lock<mutex> ul(refresh_guard_);
+      refresh_cv_.wait(ul, [this] { return refresh_requested_ || refresh_exit_; });
+      if (refresh_exit_)
+        return;
+      refresh_requested_ = false;
+    }
+
+    if (!refresh()) {
+      logger_.error() << "Could not refresh the cluster slot map.";
+    }
+  }
+}
+
+set<string> ShardedSubscriber::ssubscribedTopics() {
+  lock_guard<mutex> lg(guard_);
+  set<string> topics;
+  for (auto &pair : channels_)
+    topics.insert(pair.first);
+  return topics;
+}
+
+// ------------------------------------------------
+// ShardedPublisher
+// ------------------------------------------------
+
+ShardedPublisher::ShardedPublisher(ostream &log_stream, log::Level log_level)
+    : log_stream_(log_stream), log_level_(log_level), logger_(log_stream, log_level) {}
+
+ShardedPublisher::~ShardedPublisher() { disconnect(); }
+
+bool ShardedPublisher::connect(const string &host, const int port) {
+
+  Redox *rdx = nodeClient(host + ":" + to_string(port));
+  if (rdx == nullptr)
+    return false;
+
+  {
+    lock_guard<mutex> lg(slots_guard_);
+    if (!slots_.load(*rdx)) {
+      logger_.error() << "Could not load the cluster slot map.";
+      return false;
+    }
+  }
+
+  if (!redirect_thread_.joinable())
+    redirect_thread_ = thread([this] { runRedirectThread(); });
+  return true;
+}
+
+void ShardedPublisher::disconnect() {
+
+  if (redirect_thread_.joinable()) {
+    {
+      lock_guard<mutex> lg(redirect_guard_);
+      redirect_exit_ = true;
+    }
+    redirect_cv_.notify_all();
+    redirect_thread_.join();
+
+    lock_guard<mutex> lg(redirect_guard_);
+    redirects_.clear();
+    redirect_exit_ = false;
+  }
+
+  lock_guard<mutex> lg(nodes_guard_);
+  for (auto &node : nodes_)
+    node.second->disconnect();
+  nodes_.clear();
+}
+
+bool ShardedPublisher::refresh() {
+
+  Redox *rdx;
+  {
+    lock_guard<mutex> lg(nodes_guard_);
+    if (nodes_.empty())
+      return false;
+    rdx = nodes_.begin()->second.get();
+  }
+
+  SlotMap fresh;
+  if (!fresh.load(*rdx))
+    return false;
+
+  lock_guard<mutex> lg(slots_guard_);
+  slots_ = fresh;
+  return true;
+}
+
+Redox *ShardedPublisher::nodeClient(const string &addr) {
+
+  lock_guard<mutex> lg(nodes_guard_);
+
+  auto it = nodes_.find(addr);
+  if (it != nodes_.end())
+    return it->second.get();
+
+  string host;
+  int port;
+  if (!SlotMap::splitAddr(addr, host, port)) {
+    logger_.error() << "Bad cluster node address: " << addr;
+    return nullptr;
+  }
+
+  unique_ptr<Redox> rdx(new Redox(log_stream_, log_level_));
+  if (!rdx->connect(host, port)) {
+    logger_.error() << "Could not connect to cluster node " << addr;
+    return nullptr;
+  }
+
+  Redox *r = rdx.get();
+  nodes_[addr] = std::move(rdx);
+  return r;
+}
+
+void ShardedPublisher::spublish(const string &topic, const string &msg) {
+
+  string addr;
+  {
+    lock_guard<mutex> lg(slots_guard_);
+    addr = slots_.owner(SlotMap::keySlot(topic));
+  }
+
+  if (addr.empty()) {
+    logger_.error() << "No cluster node owns the slot of " << topic;
+    return;
+  }
+
+  publishOnNode(addr, topic, msg, false);
+}
+
+void ShardedPublisher::publishOnNode(const string &addr, const string &topic, const string &msg,
+                                     bool redirected) {
+
+  Redox *rdx = nodeClient(addr);
+  if (rdx == nullptr)
+    return;
+
+  rdx->command<redisReply *>(
+      {"SPUBLISH", topic, msg}, [this, topic, msg, redirected](Command<redisReply *> &c) {
+        if (c.ok())
+          return;
+
+        // MOVED <slot> <host>:<port>
+        const string &err = c.lastError();
+        if (redirected || (err.compare(0, 6, "MOVED ") != 0)) {
+          logger_.error() << "Could not publish to " << topic << ": " << err;
+          return;
+        }
+
+        size_t space = err.find(' ', 6);
+        if (space == string::npos)
+          return;
+        int slot = atoi(err.c_str() + 6);
+        string addr = err.substr(space + 1);
+
+        {
+          lock_guard<mutex> lg(slots_guard_);
+          slots_.assign(slot, addr);
+        }
+
+        // Resending may connect to a new node, which blocks, so not from here
+        {
+          lock_guard<mutex> lg(redirect_guard_);
+          redirects_.push_back({addr, topic, msg});
+        }
+        redirect_cv_.notify_one();
+      });
+}
+
+void ShardedPublisher::runRedirectThread() {
+
+  while (true) {
+    Redirect r;
+    {
+      unique_lock<mutex> ul(redirect_guard_);
+      redirect_cv_.wait(ul, [this] { return !redirects_.empty() || redirect_exit_; });
+      if (redirect_exit_)
+        return;
+      r = std::move(redirects_.front());
+      redirects_.pop_front();
+    }
+
+    publishOnNode(r.addr, r.topic, r.msg, true);
+  }
+}
+
+} // End namespace
@@ -0,0 +1,563 @@
+/*
+* Redox - A modern, asynchronous, and wicked fast C++11 client for Redis
+*
+*    https://github.com/hmartiro/redox
+*
+* Copyright 2015 - Hayk Martirosyan <hayk.mart at gmail dot com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#include "streams.hpp"
+
+using namespace std;
+
+namespace redox {
+
+// ------------------------------------------------
+// StreamConsumer
+// ------------------------------------------------
+
+StreamConsumer::StreamConsumer(ostream &log_stream, log::Level log_level)
+    : logger_(log_stream, log_level), rdx_(log_stream, log_level), ctl_(log_stream, log_level) {}
+
+StreamConsumer::~StreamConsumer() { disconnect(); }
+
+bool StreamConsumer::connect(const string &host, const int port) {
+
+  // A dropped connection can never complete the outstanding read
+  if (!rdx_.connect(host, port, [this](int state) {
+        if (state != Redox::CONNECTED)
+          readStopped();
+      }))
+    return false;
+
+  if (!ctl_.connect(host, port)) {
+    rdx_.disconnect();
+    return false;
+  }
+
+  connected_ = true;
+  return true;
+}
+
+bool StreamConsumer::connectUnix(const string &path) {
+
+  if (!rdx_.connectUnix(path, [this](int state) {
+        if (state != Redox::CONNECTED)
+          readStopped();
+      }))
+    return false;
+
+  if (!ctl_.connectUnix(path)) {
+    rdx_.disconnect();
+    return false;
+  }
+
+  connected_ = true;
+  return true;
+}
+
+void StreamConsumer::disconnect() {
+
+  if (!connected_)
+    return;
+
+  // The outstanding read returns within the block time
+  stopping_ = true;
+  {
+    unique_lock<mutex> ul(reading_guard_);
+    reading_cv_.wait(ul, [this] { return !reading_; });
+  }
+
+  // Commands on a connection are processed in order, so once PING returns
+  // all acknowledgements have reached the server
+  flushAcks();
+  ctl_.commandSync({"PING"});
+
+  rdx_.disconnect();
+  ctl_.disconnect();
+  connected_ = false;
+}
+
+void StreamConsumer::readSize(size_t count, int block_ms) {
+  read_count_ = count;
+
+  // BLOCK 0 waits forever, and disconnect() waits for the read to return
+  if (block_ms <= 0) {
+    logger_.warning() << "Read block time of " << block_ms << " ms, using 1 ms.";
+    block_ms = 1;
+  }
+  block_ms_ = block_ms;
+}
+
+void StreamConsumer::ackBatch(size_t count, double interval) {
+  ack_count_ = count;
+  ack_interval_ = interval;
+}
+
+void StreamConsumer::autoClaim(double min_idle, double interval, size_t count) {
+  claim_min_idle_ = min_idle;
+  claim_interval_ = interval;
+  claim_count_ = count;
+}
+
+bool StreamConsumer::createGroup(const string &stream, const string &group,
+                                 const string &start_id) {
+
+  Command<string> &c =
+      ctl_.commandSync<string>({"XGROUP", "CREATE", stream, group, start_id, "MKSTREAM"});
+  bool succeeded = c.ok() || (c.lastError().compare(0, 9, "BUSYGROUP") == 0);
+  c.free();
+  return succeeded;
+}
+
+void StreamConsumer::start(const string &group, const string &consumer,
+                           const vector<string> &streams,
+                           function<void(const StreamBatch &)> handler, bool auto_ack) {
+
+  group_ = group;
+  consumer_ = consumer;
+  streams_ = streams;
+  handler_ = handler;
+  auto_ack_ = auto_ack;
+
+  read_cmd_ = {"XREADGROUP", "GROUP", group_, consumer_, "COUNT", to_string(read_count_),
+               "BLOCK", to_string(block_ms_), "STREAMS"};
+  read_cmd_.insert(read_cmd_.end(), streams_.begin(), streams_.end());
+  read_cmd_.insert(read_cmd_.end(), streams_.size(), ">");
+
+  claim_cursors_.assign(streams_.size(), "0-0");
+  last_claim_ = chrono::steady_clock::now();
+
+  {
+    lock_guard<mutex> lg(reading_guard_);
+    reading_ = true;
+  }
+
+  read();
+}
+
+void StreamConsumer::read() {
+
+  if (claim_interval_ > 0) {
+    auto now = chrono::steady_clock::now();
+    if (chrono::duration<double>(now - last_claim_).count() >= claim_interval_) {
+      last_claim_ = now;
+
+      // Pipelined ahead of the read, so claimed entries are delivered on
+      // the same thread as new ones
+      string min_idle = to_string((long long)(claim_min_idle_ * 1000));
+      for (size_t i = 0; i < streams_.size(); i++) {
+        rdx_.command<redisReply *>({"XAUTOCLAIM", streams_[i], group_, consumer_, min_idle,
+                                    claim_cursors_[i], "COUNT", to_string(claim_count_)},
+                                   [this, i](Command<redisReply *> &c) { onClaim(c, i); });
+      }
+    }
+  }
+
+  rdx_.command<redisReply *>(read_cmd_, [this](Command<redisReply *> &c) { onRead(c); });
+}
+
+void StreamConsumer::onRead(Command<redisReply *> &c) {
+
+  if (stopping_) {
+    readStopped();
+    return;
+  }
+
+  if (!c.ok()) {
+    logger_.error() << "Could not read streams: " << c.lastError();
+
+    // Try again later, for example once the group is created
+    rdx_.commandDelayed<redisReply *>(read_cmd_,
+                                      [this](Command<redisReply *> &c) { onRead(c); },
+                                      block_ms_ / 1000.0);
+    return;
+  }
+
+  // Nil if the read timed out, otherwise [[stream, entries], ...]
+  redisReply *reply = c.reply();
+  batch_.clear();
+  if (reply->type == REDIS_REPLY_ARRAY) {
+    for (size_t i = 0; i < reply->elements; i++) {
+      redisReply *stream = reply->element[i];
+      if ((stream->type != REDIS_REPLY_ARRAY) || (stream->elements < 2))
+        continue;
+      decodeEntries(stream->element[0]->str, stream->element[0]->len, stream->element[1]);
+    }
+  }
+
+  read_entries_ += batch_.size();
+  deliver();
+  maybeFlushAcks();
+
+  read();
+}
+
+void StreamConsumer::onClaim(Command<redisReply *> &c, size_t stream_index) {
+
+  if (stopping_)
+    return;
+
+  if (!c.ok()) {
+    logger_.error() << "Could not claim entries of " << streams_[stream_index] << ": "
+                    << c.lastError();
+    return;
+  }
+
+  // [next cursor, entries], plus the deleted IDs since Redis 7
+  redisReply *reply = c.reply();
+  if ((reply->type != REDIS_REPLY_ARRAY) || (reply->elements < 2))
+    return;
+
+  claim_cursors_[stream_index].assign(reply->element[0]->str, reply->element[0]->len);
+
+  const string &stream = streams_[stream_index];
+  batch_.clear();
+  decodeEntries(stream.data(), stream.size(), reply->element[1]);
+
+  claimed_entries_ += batch_.size();
+  deliver();
+}
+
+void StreamConsumer::decodeEntries(const char *stream, size_t len, redisReply *entries) {
+
+  if (entries->type != REDIS_REPLY_ARRAY)
+    return;
+
+  StreamBatch::Span name = batch_.append(stream, len);
+
+  for (size_t i = 0; i < entries->elements; i++) {
+    redisReply *e = entries->element[i];
+    if ((e->type != REDIS_REPLY_ARRAY) || (e->elements < 2))
+      continue;
+
+    StreamBatch::Entry entry;
+    entry.stream = name;
+    entry.id = batch_.append(e->element[0]->str, e->element[0]->len);
+    entry.first_field = batch_.fields_.size();
+    entry.num_fields = 0;
+
+    // Nil if the entry was deleted while pending
+    redisReply *kv = e->element[1];
+    if (kv->type == REDIS_REPLY_ARRAY) {
+      for (size_t j = 0; j + 1 < kv->elements; j += 2) {
+        batch_.fields_.push_back(batch_.append(kv->element[j]->str, kv->element[j]->len));
+        batch_.fields_.push_back(
+            batch_.append(kv->element[j + 1]->str, kv->element[j + 1]->len));
+        entry.num_fields++;
+      }
+    }
+
+    batch_.entries_.push_back(entry);
+  }
+}
+
+void StreamConsumer::deliver() {
+
+  if (batch_.size() == 0)
+    return;
+
+  handler_(batch_);
+
+  if (!auto_ack_)
+    return;
+
+  lock_guard<mutex> lg(acks_guard_);
+  if (num_acks_ == 0)
+    oldest_ack_ = chrono::steady_clock::now();
+
+  for (size_t i = 0; i < batch_.size(); i++) {
+    StreamBatch::Slice stream = batch_.stream(i);
+    StreamBatch::Slice id = batch_.id(i);
+    acks_[stream.str()].emplace_back(id.data, id.len);
+  }
+  num_acks_ += batch_.size();
+}
+
+void StreamConsumer::ack(const string &stream, const string &id) {
+
+  bool full;
+  {
+    lock_guard<mutex> lg(acks_guard_);
+    if (num_acks_ == 0)
+      oldest_ack_ = chrono::steady_clock::now();
+    acks_[stream].push_back(id);
+    num_acks_++;
+    full = (num_acks_ >= ack_count_);
+  }
+
+  if (full)
+    flushAcks();
+}
+
+void StreamConsumer::maybeFlushAcks() {
+
+  bool due;
+  {
+    lock_guard<mutex> lg(acks_guard_);
+    due = (num_acks_ >= ack_count_) ||
+          ((num_acks_ > 0) &&
+           (chrono::duration<double>(chrono::steady_clock::now() - oldest_ack_).count() >=
+            ack_interval_));
+  }
+
+  if (due)
+    flushAcks();
+}
+
+void StreamConsumer::flushAcks() {
+
+  unordered_map<string, vector<string>> acks;
+  {
+    lock_guard<mutex> lg(acks_guard_);
+    if (num_acks_ == 0)
+      return;
+    acks.swap(acks_);
+    num_acks_ = 0;
+  }
+
+  // One XACK per stream, pipelined without waiting for replies
+  for (auto &pair : acks) {
+    vector<string> cmd;
+    cmd.reserve(pair.second.size() + 3);
+    cmd.push_back("XACK");
+    cmd.push_back(pair.first);
+    cmd.push_back(group_);
+    cmd.insert(cmd.end(), pair.second.begin(), pair.second.end());
+    ctl_.fire(cmd);
+    acked_entries_ += pair.second.size();
+  }
+}
+
+void StreamConsumer::readStopped() {
+  {
+    lock_guard<mutex> lg(reading_guard_);
+    reading_ = false;
+  }
+  reading_cv_.notify_all();
+}
+
+// ------------------------------------------------
+// StreamProducer
+// ------------------------------------------------
+
+StreamProducer::StreamProducer(ostream &log_stream, log::Level log_level)
+    : logger_(log_stream, log_level), rdx_(log_stream, log_level) {}
+
+StreamProducer::~StreamProducer() { disconnect(); }
+
+bool StreamProducer::connect(const string &host, const int port) {
+  if (!rdx_.connect(host, port, [this](int state) { connectionChanged(state); }))
+    return false;
+  connected_ = true;
+  flush_thread_ = thread([this] { runFlushThread(); });
+  return true;
+}
+
+bool StreamProducer::connectUnix(const string &path) {
+  if (!rdx_.connectUnix(path, [this](int state) { connectionChanged(state); }))
+    return false;
+  connected_ = true;
+  flush_thread_ = thread([this] { runFlushThread(); });
+  return true;
+}
+
+void StreamProducer::disconnect() {
+
+  if (!connected_)
+    return;
+
+  {
+    lock_guard<mutex> lg(guard_);
+    flush_exit_ = true;
+  }
+  flush_cv_.notify_all();
+  flush_thread_.join();
+
+  if (!lost_)
+    flush();
+  {
+    unique_lock<mutex> ul(space_guard_);
+    space_cv_.wait(ul, [this] { return (pending_ == 0) || lost_; });
+  }
+
+  rdx_.disconnect();
+  connected_ = false;
+}
+
+void StreamProducer::connectionChanged(int state) {
+  if (state != Redox::CONNECTED)
+    connectionLost();
+}
+
+void StreamProducer::connectionLost() {
+  {
+    lock_guard<mutex> lg(space_guard_);
+    lost_ = true;
+  }
+  space_cv_.notify_all();
+}
+
+void StreamProducer::batchSize(size_t count, double interval) {
+  {
+    lock_guard<mutex> lg(guard_);
+    batch_count_ = count;
+    batch_interval_ = interval;
+  }
+  flush_cv_.notify_all();
+}
+
+void StreamProducer::maxLen(size_t len) {
+  lock_guard<mutex> lg(guard_);
+  max_len_ = (len == 0) ? "" : to_string(len);
+}
+
+void StreamProducer::maxPending(size_t entries) { max_pending_ = entries; }
+
+void StreamProducer::onReply(ReplyCallback callback) {
+  lock_guard<mutex> lg(guard_);
+  reply_callback_ = callback;
+}
+
+long StreamProducer::add(const string &stream, const vector<string> &fields, bool block) {
+  return addBase(stream, fields.size(), [&fields](string &buf) {
+    for (const string &arg : fields)
+      resp::appendArg(buf, arg);
+  }, block);
+}
+
+long StreamProducer::add(const string &stream, const string &field, const string &value,
+                         bool block) {
+  return addBase(stream, 2, [&field, &value](string &buf) {
+    resp::appendArg(buf, field);
+    resp::appendArg(buf, value);
+  }, block);
+}
+
+void StreamProducer::flush() {
+  {
+    lock_guard<mutex> lg(guard_);
+    for (auto &pair : buffers_) {
+      if (!pair.second.ends.empty())
+        send(pair.first, pair.second);
+    }
+  }
+  failUnsent();
+}
+
+bool StreamProducer::send(const string &stream, Buffer &buf) {
+
+  // The callback maps the index of each reply back to its sequence number
+  auto seqs = make_shared<vector<long>>();
+  seqs->swap(buf.seqs);
+
+  bool sent = true;
+  try {
+    rdx_.commandFormatted(buf.frames, buf.ends,
+                          [this, stream, seqs](size_t index, redisReply *r) {
+                            reply(stream, (*seqs)[index], index, seqs->size(), r);
+                          });
+  } catch (const runtime_error &e) {
+
+    // Redox stopped, as when the connection dropped
+    unsent_.emplace_back(stream, move(*seqs));
+    sent = false;
+  }
+
+  // Keep the capacity for the next batch
+  buf.frames.clear();
+  buf.ends.clear();
+  buf.seqs.reserve(seqs->size());
+  return sent;
+}
+
+void StreamProducer::failUnsent() {
+
+  vector<pair<string, vector<long>>> unsent;
+  {
+    lock_guard<mutex> lg(guard_);
+    unsent.swap(unsent_);
+  }
+  if (unsent.empty())
+    return;
+
+  connectionLost();
+  for (auto &batch : unsent) {
+    for (size_t i = 0; i < batch.second.size(); i++)
+      reply(batch.first, batch.second[i], i, batch.second.size(), nullptr);
+  }
+}
+
+void StreamProducer::reply(const string &stream, long seq, size_t index, size_t count,
+                           redisReply *r) {
+
+  if ((r != nullptr) && (r->type == REDIS_REPLY_STRING)) {
+    acked_++;
+    if (reply_callback_)
+      reply_callback_(stream, seq, string(r->str, r->len));
+
+  } else {
+    failed_++;
+    if (r == nullptr)
+      logger_.error() << "Could not add to " << stream << ": no reply.";
+    else if (r->type == REDIS_REPLY_ERROR)
+      logger_.error() << "Could not add to " << stream << ": " << string(r->str, r->len);
+    else
+      logger_.error() << "Could not add to " << stream << ": reply of type " << r->type << ".";
+    if (reply_callback_)
+      reply_callback_(stream, seq, "");
+  }
+
+  // Free up room for the whole batch at once
+  if (index == count - 1) {
+    pending_ -= count;
+    {
+      lock_guard<mutex> lg(space_guard_);
+    }
+    space_cv_.notify_all();
+  }
+}
+
+void StreamProducer::runFlushThread() {
+
+  unique_lock<mutex> ul(guard_);
+  while (!flush_exit_) {
+
+    // Without an interval, only woken up to exit
+    if (batch_interval_ == 0) {
+      flush_cv_.wait(ul);
+      continue;
+    }
+
+    auto interval = chrono::duration_cast<chrono::steady_clock::duration>(
+        chrono::duration<double>(batch_interval_));
+    flush_cv_.wait_for(ul, interval);
+
+    auto now = chrono::steady_clock::now();
+    for (auto &pair : buffers_) {
+      Buffer &buf = pair.second;
+      if (!buf.ends.empty() && (now - buf.oldest >= interval))
+        send(pair.first, buf);
+    }
+
+    if (!unsent_.empty()) {
+      ul.unlock();
+      failUnsent();
+      ul.lock();
+    }
+  }
+}
+
+} // End namespace
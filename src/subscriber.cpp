@@ -20,6 +20,7 @@
 
 #include <string.h>
 #include "subscriber.hpp"
+#include "utils/tracing.hpp"
 
 using namespace std;
 
@@ -28,31 +29,154 @@ namespace redox {
 Subscriber::Subscriber(ostream &log_stream, log::Level log_level)
     : rdx_(log_stream, log_level), logger_(rdx_.logger_) {}
 
-Subscriber::~Subscriber() {}
+Subscriber::~Subscriber() { stopDelivery(); }
 
 void Subscriber::disconnect() {
   stop();
   wait();
 }
 
-void Subscriber::wait() { rdx_.wait(); }
+void Subscriber::wait() {
+  rdx_.wait();
+  stopDelivery();
+}
+
+void Subscriber::deliverAsync(size_t capacity, int num_threads, int overflow_policy,
+                              function<void(const vector<Message> &)> batch_callback,
+                              size_t max_batch) {
+
+  if (delivery_queue_) {
+    logger_.warning() << "Delivery queue is already enabled!";
+    return;
+  }
+
+  delivery_policy_ = overflow_policy;
+  delivery_batch_callback_ = batch_callback;
+  delivery_max_batch_ = (max_batch > 0) ? max_batch : 1;
+  delivery_queue_.reset(new BoundedQueue<Message>(capacity));
+
+  for (int i = 0; i < num_threads; i++)
+    delivery_threads_.emplace_back([this] { runDeliveryThread(); });
+}
+
+void Subscriber::stopDelivery() {
+
+  if (delivery_threads_.empty())
+    return;
+
+  {
+    lock_guard<mutex> lg(delivery_idle_guard_);
+    delivery_exit_ = true;
+  }
+  delivery_idle_cv_.notify_all();
+
+  for (thread &t : delivery_threads_)
+    t.join();
+  delivery_threads_.clear();
+}
+
+void Subscriber::deliver(const shared_ptr<Handlers> &h, const char *topic, size_t topic_len,
+                         const char *msg, size_t msg_len) {
+
+  REDOX_PROBE3(subscriber__message, topic, topic_len, msg_len);
+
+  if (!delivery_queue_) {
+    if (h->shared_callback)
+      h->shared_callback(string(topic, topic_len), make_shared<const string>(msg, msg_len));
+    else if (h->msg_callback)
+      h->msg_callback(string(topic, topic_len), string(msg, msg_len));
+    return;
+  }
+
+  Message m;
+  m.topic.assign(topic, topic_len);
+  m.msg.assign(msg, msg_len);
+  m.handlers_ = h;
 
-// This is a fairly awkward way of shutting down, where
-// we pause to wait for subscriptions to happen, and then
-// unsubscribe from everything and wait for that to finish.
-// The reason is because hiredis goes into
-// a segfault in freeReplyObject() under redisAsyncDisconnect()
-// if we don't do this first.
-// TODO(hayk): look at hiredis, ask them what causes the error
+  // The message is only moved from if the push succeeds
+  while (!delivery_queue_->push(std::move(m))) {
+    if ((delivery_policy_ == DROP_NEWEST) || delivery_exit_) {
+      delivery_dropped_++;
+      return;
+    } else if (delivery_policy_ == DROP_OLDEST) {
+      Message oldest;
+      if (delivery_queue_->pop(oldest))
+        delivery_dropped_++;
+    } else {
+      this_thread::yield();
+    }
+  }
+
+  // Pairs with the fence in runDeliveryThread, so that either we see an
+  // idle consumer or it sees the message we just pushed
+  atomic_thread_fence(memory_order_seq_cst);
+  if (delivery_idle_ > 0) {
+    lock_guard<mutex> lg(delivery_idle_guard_);
+    delivery_idle_cv_.notify_one();
+  }
+}
+
+void Subscriber::runDeliveryThread() {
+
+  vector<Message> batch;
+  batch.reserve(delivery_max_batch_);
+  Message m;
+
+  while (true) {
+
+    batch.clear();
+    while ((batch.size() < delivery_max_batch_) && delivery_queue_->pop(m))
+      batch.push_back(std::move(m));
+
+    // Drain everything before exiting
+    if (batch.empty()) {
+      if (delivery_exit_)
+        return;
+
+      unique_lock<mutex> ul(delivery_idle_guard_);
+      delivery_idle_++;
+      atomic_thread_fence(memory_order_seq_cst);
+      delivery_idle_cv_.wait(ul, [this] {
+        return (delivery_queue_->size() > 0) || delivery_exit_;
+      });
+      delivery_idle_--;
+      continue;
+    }
+
+    if (delivery_batch_callback_) {
+      delivery_batch_callback_(batch);
+    } else {
+      for (Message &msg : batch) {
+        if (msg.handlers_->shared_callback)
+          msg.handlers_->shared_callback(msg.topic, make_shared<const string>(std::move(msg.msg)));
+        else if (msg.handlers_->msg_callback)
+          msg.handlers_->msg_callback(msg.topic, msg.msg);
+      }
+    }
+  }
+}
+
+// hiredis goes into a segfault in freeReplyObject() under
+// redisAsyncDisconnect() if we disconnect with live subscriptions, so
+// we first unsubscribe from everything. Waiting on the pending count
+// makes sure the bulk unsubscribe covers every subscription in flight.
 void Subscriber::stop() {
 
-  this_thread::sleep_for(chrono::milliseconds(1000));
+  {
+    unique_lock<mutex> ul(pending_subs_guard_);
+    cv_pending_subs_.wait(ul, [this] { return num_pending_subs_ <= 0; });
+  }
+
+  // With no arguments, the server unsubscribes from every topic and
+  // acknowledges each one, which removes it from the topic sets
+  if (!subscribedTopics().empty())
+    rdx_.command({"UNSUBSCRIBE"});
 
-  for (const string &topic : subscribedTopics())
-    unsubscribe(topic);
+  if (!psubscribedTopics().empty())
+    rdx_.command({"PUNSUBSCRIBE"});
 
-  for (const string &topic : psubscribedTopics())
-    punsubscribe(topic);
+  if (!ssubscribedTopics().empty())
+    rdx_.command({"SUNSUBSCRIBE"});
 
   {
     unique_lock<mutex> ul(subscribed_topics_guard_);
@@ -68,8 +192,19 @@ void Subscriber::stop() {
     });
   }
 
-  for (Command<redisReply *> *c : commands_)
-    c->free();
+  {
+    unique_lock<mutex> ul(ssubscribed_topics_guard_);
+    cv_sunsub_.wait(ul, [this] {
+      return (ssubscribed_topics_.size() == 0);
+    });
+  }
+
+  {
+    lock_guard<mutex> lg(commands_guard_);
+    for (Command<redisReply *> *c : commands_)
+      c->free();
+    commands_.clear();
+  }
 
   rdx_.stop();
 }
@@ -94,86 +229,242 @@ void debugReply(Command<redisReply *> c) {
   cout << "------" << endl;
 }
 
-void Subscriber::subscribeBase(const string cmd_name, const string topic,
-                               function<void(const string &, const string &)> msg_callback,
-                               function<void(const string &)> sub_callback,
-                               function<void(const string &)> unsub_callback,
-                               function<void(const string &, int)> err_callback) {
+void Subscriber::subsResolved(int n) {
+  {
+    lock_guard<mutex> lg(pending_subs_guard_);
+    num_pending_subs_ -= n;
+  }
+  cv_pending_subs_.notify_all();
+}
 
-  Command<redisReply *> &sub_cmd = rdx_.commandLoop<redisReply *>(
-      {cmd_name, topic},
-      [this, topic, msg_callback, err_callback, sub_callback, unsub_callback](
-          Command<redisReply *> &c) {
-
-        if (!c.ok()) {
-          num_pending_subs_--;
-          if (err_callback)
-            err_callback(topic, c.status());
-          return;
-        }
+Subscriber::HandlerMap &Subscriber::handlersFor(const string &cmd_name) {
+  if (cmd_name == "PSUBSCRIBE")
+    return pattern_handlers_;
+  if (cmd_name == "SSUBSCRIBE")
+    return shard_handlers_;
+  return channel_handlers_;
+}
 
-        redisReply *reply = c.reply();
-
-        // If the last entry is an integer, then it is a [p]sub/[p]unsub command
-        if ((reply->type == REDIS_REPLY_ARRAY) &&
-            (reply->element[reply->elements - 1]->type == REDIS_REPLY_INTEGER)) {
-
-
-          if (!strncmp(reply->element[0]->str, "sub", 3)) {
-            lock_guard<mutex> lg(subscribed_topics_guard_);
-            subscribed_topics_.insert(topic);
-            num_pending_subs_--;
-            if (sub_callback)
-              sub_callback(topic);
-          } else if (!strncmp(reply->element[0]->str, "psub", 4)) {
-            lock_guard<mutex> lg(psubscribed_topics_guard_);
-            psubscribed_topics_.insert(topic);
-            num_pending_subs_--;
-            if (sub_callback)
-              sub_callback(topic);
-          } else if (!strncmp(reply->element[0]->str, "uns", 3)) {
-            lock_guard<mutex> lg(subscribed_topics_guard_);
-            subscribed_topics_.erase(topic);
-            if (unsub_callback)
-              unsub_callback(topic);
-            cv_unsub_.notify_all();
-          } else if (!strncmp(reply->element[0]->str, "puns", 4)) {
-            lock_guard<mutex> lg(psubscribed_topics_guard_);
-            psubscribed_topics_.erase(topic);
-            if (unsub_callback)
-              unsub_callback(topic);
-            cv_punsub_.notify_all();
-          }
-
-          else
-            logger_.error() << "Unknown pubsub message: " << reply->element[0]->str;
-        }
+shared_ptr<Subscriber::Handlers> Subscriber::findHandlers(HandlerMap &handlers, const char *topic,
+                                                          size_t len) {
+  lock_guard<mutex> lg(handlers_guard_);
+  auto it = handlers.find(string(topic, len));
+  if (it == handlers.end())
+    return nullptr;
+  return it->second;
+}
 
-        // Message for subscribe
-        else if ((reply->type == REDIS_REPLY_ARRAY) && (reply->elements == 3)) {
-          char *msg = reply->element[2]->str;
-          int len = reply->element[2]->len;
-          if (msg && msg_callback)
-            msg_callback(topic, string(msg, len));
+void Subscriber::dispatch(Command<redisReply *> &c) {
+
+  // Failed to send or got an error reply, so none of the topics
+  // in this command are going to be subscribed to
+  if (!c.ok()) {
+    HandlerMap &handlers = handlersFor(c.cmd_[0]);
+    for (size_t i = 1; i < c.cmd_.size(); i++) {
+      const string &topic = c.cmd_[i];
+      shared_ptr<Handlers> h;
+      {
+        lock_guard<mutex> lg(handlers_guard_);
+        auto it = handlers.find(topic);
+        if (it != handlers.end()) {
+          h = it->second;
+          handlers.erase(it);
         }
+      }
+      if (h && h->err_callback)
+        h->err_callback(topic, c.status());
+    }
+    subsResolved(c.cmd_.size() - 1);
+    return;
+  }
 
-        // Message for psubscribe
-        else if ((reply->type == REDIS_REPLY_ARRAY) && (reply->elements == 4)) {
-          char *msg = reply->element[3]->str;
-          int len = reply->element[3]->len;
-          if (msg && msg_callback)
-            msg_callback(reply->element[2]->str, string(msg, len));
-        }
+  redisReply *reply = c.reply();
+  if ((reply->type != REDIS_REPLY_ARRAY) || (reply->elements < 3)) {
+    logger_.error() << "Unknown pubsub message of type " << reply->type;
+    return;
+  }
 
-        else
-          logger_.error() << "Unknown pubsub message of type " << reply->type;
-      },
+  const char *type = reply->element[0]->str;
+
+  // Message for subscribe: [message, channel, payload]
+  if (!strcmp(type, "message")) {
+    redisReply *channel = reply->element[1];
+    redisReply *msg = reply->element[2];
+    shared_ptr<Handlers> h = findHandlers(channel_handlers_, channel->str, channel->len);
+    if (h && msg->str) {
+      if (h->conflate)
+        conflate(channel->str, channel->len, msg->str, msg->len);
+      else
+        deliver(h, channel->str, channel->len, msg->str, msg->len);
+    }
+    return;
+  }
+
+  // Message for psubscribe: [pmessage, pattern, channel, payload]. The server
+  // tells us which pattern matched, so this is an exact lookup too.
+  if (!strcmp(type, "pmessage") && (reply->elements == 4)) {
+    redisReply *pattern = reply->element[1];
+    redisReply *channel = reply->element[2];
+    redisReply *msg = reply->element[3];
+    shared_ptr<Handlers> h = findHandlers(pattern_handlers_, pattern->str, pattern->len);
+    if (h && msg->str)
+      deliver(h, channel->str, channel->len, msg->str, msg->len);
+    return;
+  }
+
+  // Message for ssubscribe: [smessage, channel, payload]
+  if (!strcmp(type, "smessage")) {
+    redisReply *channel = reply->element[1];
+    redisReply *msg = reply->element[2];
+    shared_ptr<Handlers> h = findHandlers(shard_handlers_, channel->str, channel->len);
+    if (h && msg->str)
+      deliver(h, channel->str, channel->len, msg->str, msg->len);
+    return;
+  }
+
+  // Otherwise it is a [p|s]sub/[p|s]unsub acknowledgement: [type, topic, count]
+  if (reply->element[2]->type != REDIS_REPLY_INTEGER) {
+    logger_.error() << "Unknown pubsub message: " << type;
+    return;
+  }
+
+  string topic(reply->element[1]->str, reply->element[1]->len);
+
+  if (!strcmp(type, "subscribe")) {
+    {
+      lock_guard<mutex> lg(subscribed_topics_guard_);
+      subscribed_topics_.insert(topic);
+    }
+    subsResolved(1);
+    shared_ptr<Handlers> h = findHandlers(channel_handlers_, topic.data(), topic.size());
+    if (h && h->sub_callback)
+      h->sub_callback(topic);
+
+  } else if (!strcmp(type, "psubscribe")) {
+    {
+      lock_guard<mutex> lg(psubscribed_topics_guard_);
+      psubscribed_topics_.insert(topic);
+    }
+    subsResolved(1);
+    shared_ptr<Handlers> h = findHandlers(pattern_handlers_, topic.data(), topic.size());
+    if (h && h->sub_callback)
+      h->sub_callback(topic);
+
+  } else if (!strcmp(type, "unsubscribe")) {
+    shared_ptr<Handlers> h;
+    {
+      lock_guard<mutex> lg(handlers_guard_);
+      auto it = channel_handlers_.find(topic);
+      if (it != channel_handlers_.end()) {
+        h = it->second;
+        channel_handlers_.erase(it);
+      }
+    }
+    {
+      lock_guard<mutex> lg(subscribed_topics_guard_);
+      subscribed_topics_.erase(topic);
+    }
+    if (h && h->unsub_callback)
+      h->unsub_callback(topic);
+    cv_unsub_.notify_all();
+
+  } else if (!strcmp(type, "punsubscribe")) {
+    shared_ptr<Handlers> h;
+    {
+      lock_guard<mutex> lg(handlers_guard_);
+      auto it = pattern_handlers_.find(topic);
+      if (it != pattern_handlers_.end()) {
+        h = it->second;
+        pattern_handlers_.erase(it);
+      }
+    }
+    {
+      lock_guard<mutex> lg(psubscribed_topics_guard_);
+      psubscribed_topics_.erase(topic);
+    }
+    if (h && h->unsub_callback)
+      h->unsub_callback(topic);
+    cv_punsub_.notify_all();
+
+  } else if (!strcmp(type, "ssubscribe")) {
+    {
+      lock_guard<mutex> lg(ssubscribed_topics_guard_);
+      ssubscribed_topics_.insert(topic);
+    }
+    subsResolved(1);
+    shared_ptr<Handlers> h = findHandlers(shard_handlers_, topic.data(), topic.size());
+    if (h && h->sub_callback)
+      h->sub_callback(topic);
+
+  } else if (!strcmp(type, "sunsubscribe")) {
+    shared_ptr<Handlers> h;
+    {
+      lock_guard<mutex> lg(handlers_guard_);
+      auto it = shard_handlers_.find(topic);
+      if (it != shard_handlers_.end()) {
+        h = it->second;
+        shard_handlers_.erase(it);
+      }
+    }
+    {
+      lock_guard<mutex> lg(ssubscribed_topics_guard_);
+      ssubscribed_topics_.erase(topic);
+    }
+    if (h && h->unsub_callback)
+      h->unsub_callback(topic);
+    cv_sunsub_.notify_all();
+
+  } else {
+    logger_.error() << "Unknown pubsub message: " << type;
+  }
+}
+
+void Subscriber::subscribeBase(const string cmd_name, const vector<string> &topics,
+                               function<void(const string &, const string &)> msg_callback,
+                               function<void(const string &)> sub_callback,
+                               function<void(const string &)> unsub_callback,
+                               function<void(const string &, int)> err_callback,
+                               bool conflate,
+                               function<void(const string &, const shared_ptr<const string> &)>
+                                   shared_callback) {
+
+  auto h = make_shared<Handlers>();
+  h->msg_callback = msg_callback;
+  h->sub_callback = sub_callback;
+  h->unsub_callback = unsub_callback;
+  h->err_callback = err_callback;
+  h->conflate = conflate;
+  h->shared_callback = shared_callback;
+
+  // Register the handlers for every new topic, and build up one
+  // command to subscribe to all of them
+  vector<string> cmd = {cmd_name};
+  cmd.reserve(topics.size() + 1);
+  {
+    lock_guard<mutex> lg(handlers_guard_);
+    HandlerMap &handlers = handlersFor(cmd_name);
+    for (const string &topic : topics) {
+      if (!handlers.emplace(topic, h).second) {
+        logger_.warning() << cmd_name << ": already subscribed to " << topic << "!";
+        continue;
+      }
+      cmd.push_back(topic);
+    }
+  }
+
+  if (cmd.size() == 1)
+    return;
+
+  num_pending_subs_ += cmd.size() - 1;
+
+  Command<redisReply *> &sub_cmd = rdx_.commandLoop<redisReply *>(
+      cmd, [this](Command<redisReply *> &c) { dispatch(c); },
       1e10 // To keep the command around for a few hundred years
       );
 
   // Add it to the command list
+  lock_guard<mutex> lg(commands_guard_);
   commands_.insert(&sub_cmd);
-  num_pending_subs_++;
 }
 
 void Subscriber::subscribe(const string topic,
@@ -181,12 +472,15 @@ void Subscriber::subscribe(const string topic,
                            function<void(const string &)> sub_callback,
                            function<void(const string &)> unsub_callback,
                            function<void(const string &, int)> err_callback) {
-  lock_guard<mutex> lg(subscribed_topics_guard_);
-  if (subscribed_topics_.find(topic) != subscribed_topics_.end()) {
-    logger_.warning() << "Already subscribed to " << topic << "!";
-    return;
-  }
-  subscribeBase("SUBSCRIBE", topic, msg_callback, sub_callback, unsub_callback, err_callback);
+  subscribeBase("SUBSCRIBE", {topic}, msg_callback, sub_callback, unsub_callback, err_callback);
+}
+
+void Subscriber::subscribe(const vector<string> &topics,
+                           function<void(const string &, const string &)> msg_callback,
+                           function<void(const string &)> sub_callback,
+                           function<void(const string &)> unsub_callback,
+                           function<void(const string &, int)> err_callback) {
+  subscribeBase("SUBSCRIBE", topics, msg_callback, sub_callback, unsub_callback, err_callback);
 }
 
 void Subscriber::psubscribe(const string topic,
@@ -194,12 +488,125 @@ void Subscriber::psubscribe(const string topic,
                             function<void(const string &)> sub_callback,
                             function<void(const string &)> unsub_callback,
                             function<void(const string &, int)> err_callback) {
-  lock_guard<mutex> lg(psubscribed_topics_guard_);
-  if (psubscribed_topics_.find(topic) != psubscribed_topics_.end()) {
-    logger_.warning() << "Already psubscribed to " << topic << "!";
+  subscribeBase("PSUBSCRIBE", {topic}, msg_callback, sub_callback, unsub_callback, err_callback);
+}
+
+void Subscriber::psubscribe(const vector<string> &topics,
+                            function<void(const string &, const string &)> msg_callback,
+                            function<void(const string &)> sub_callback,
+                            function<void(const string &)> unsub_callback,
+                            function<void(const string &, int)> err_callback) {
+  subscribeBase("PSUBSCRIBE", topics, msg_callback, sub_callback, unsub_callback, err_callback);
+}
+
+void Subscriber::ssubscribe(const string topic,
+                            function<void(const string &, const string &)> msg_callback,
+                            function<void(const string &)> sub_callback,
+                            function<void(const string &)> unsub_callback,
+                            function<void(const string &, int)> err_callback) {
+  subscribeBase("SSUBSCRIBE", {topic}, msg_callback, sub_callback, unsub_callback, err_callback);
+}
+
+void Subscriber::ssubscribe(const vector<string> &topics,
+                            function<void(const string &, const string &)> msg_callback,
+                            function<void(const string &)> sub_callback,
+                            function<void(const string &)> unsub_callback,
+                            function<void(const string &, int)> err_callback) {
+  subscribeBase("SSUBSCRIBE", topics, msg_callback, sub_callback, unsub_callback, err_callback);
+}
+
+void Subscriber::subscribeConflated(const vector<string> &topics,
+                                    function<void(const string &)> sub_callback,
+                                    function<void(const string &)> unsub_callback,
+                                    function<void(const string &, int)> err_callback) {
+
+  // Create the slots up front, so that the event loop never allocates them
+  {
+    lock_guard<mutex> lg(slots_guard_);
+    for (const string &topic : topics) {
+      if (slot_index_.find(topic) != slot_index_.end())
+        continue;
+      slot_index_[topic] = slots_.size();
+      slots_.emplace_back();
+      slots_.back().topic = topic;
+      for (auto &r : readers_)
+        r->slots.emplace_back();
+    }
+  }
+
+  subscribeBase("SUBSCRIBE", topics, nullptr, sub_callback, unsub_callback, err_callback, true);
+}
+
+int Subscriber::conflatedReader() {
+
+  lock_guard<mutex> lg(slots_guard_);
+
+  unique_ptr<Reader> r(new Reader);
+  r->slots.resize(slots_.size());
+
+  // Start out with whatever has already been received
+  for (size_t id = 0; id < slots_.size(); id++) {
+    if (slots_[id].received) {
+      r->slots[id].dirty = true;
+      r->changed.push_back(id);
+    }
+  }
+
+  readers_.push_back(std::move(r));
+  return readers_.size() - 1;
+}
+
+void Subscriber::conflate(const char *topic, size_t topic_len, const char *msg,
+                          size_t msg_len) {
+
+  lock_guard<mutex> lg(slots_guard_);
+
+  auto it = slot_index_.find(string(topic, topic_len));
+  if (it == slot_index_.end())
     return;
+
+  size_t id = it->second;
+  Slot &slot = slots_[id];
+  slot.msg.assign(msg, msg_len);
+  slot.received = true;
+
+  for (auto &r : readers_) {
+    if (!r->slots[id].dirty) {
+      r->slots[id].dirty = true;
+      r->changed.push_back(id);
+    }
   }
-  subscribeBase("PSUBSCRIBE", topic, msg_callback, sub_callback, unsub_callback, err_callback);
+}
+
+size_t Subscriber::drainConflated(int reader,
+                                  function<void(const string &, const string &)> callback) {
+
+  Reader *r;
+  {
+    lock_guard<mutex> lg(slots_guard_);
+
+    if ((reader < 0) || (reader >= (int)readers_.size())) {
+      logger_.error() << "No conflated reader with ID " << reader << "!";
+      return 0;
+    }
+
+    // Copy out the changed values, so that the callbacks run unlocked
+    r = readers_[reader].get();
+    r->draining.clear();
+    for (size_t id : r->changed) {
+      ReaderSlot &rs = r->slots[id];
+      rs.dirty = false;
+      rs.value.assign(slots_[id].msg);
+      r->draining.emplace_back(&slots_[id].topic, &rs.value);
+    }
+    r->changed.clear();
+  }
+
+  if (callback)
+    for (auto &p : r->draining)
+      callback(*p.first, *p.second);
+
+  return r->draining.size();
 }
 
 void Subscriber::unsubscribeBase(const string cmd_name, const string topic,
@@ -214,8 +621,8 @@ void Subscriber::unsubscribeBase(const string cmd_name, const string topic,
 }
 
 void Subscriber::unsubscribe(const string topic, function<void(const string &, int)> err_callback) {
-  lock_guard<mutex> lg(subscribed_topics_guard_);
-  if (subscribed_topics_.find(topic) == subscribed_topics_.end()) {
+  lock_guard<mutex> lg(handlers_guard_);
+  if (channel_handlers_.find(topic) == channel_handlers_.end()) {
     logger_.warning() << "Cannot unsubscribe from " << topic << ", not subscribed!";
     return;
   }
@@ -224,12 +631,22 @@ void Subscriber::unsubscribe(const string topic, function<void(const string &, i
 
 void Subscriber::punsubscribe(const string topic,
                               function<void(const string &, int)> err_callback) {
-  lock_guard<mutex> lg(psubscribed_topics_guard_);
-  if (psubscribed_topics_.find(topic) == psubscribed_topics_.end()) {
+  lock_guard<mutex> lg(handlers_guard_);
+  if (pattern_handlers_.find(topic) == pattern_handlers_.end()) {
     logger_.warning() << "Cannot punsubscribe from " << topic << ", not psubscribed!";
     return;
   }
   unsubscribeBase("PUNSUBSCRIBE", topic, err_callback);
 }
 
+void Subscriber::sunsubscribe(const string topic,
+                              function<void(const string &, int)> err_callback) {
+  lock_guard<mutex> lg(handlers_guard_);
+  if (shard_handlers_.find(topic) == shard_handlers_.end()) {
+    logger_.warning() << "Cannot sunsubscribe from " << topic << ", not ssubscribed!";
+    return;
+  }
+  unsubscribeBase("SUNSUBSCRIBE", topic, err_callback);
+}
+
 } // End namespace
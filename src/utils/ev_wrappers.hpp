@@ -0,0 +1,87 @@
+/*
+* Redox - A modern, asynchronous, and wicked fast C++11 client for Redis
+*
+*    https://github.com/hmartiro/redox
+*
+* Copyright 2015 - Hayk Martirosyan <hayk.mart at gmail dot com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#pragma once
+
+#include <ev.h>
+
+// Wrappers for the libev watcher macros, whose casts trip -Wstrict-aliasing.
+// Internal to the library, shared by every file that sets up watchers.
+
+namespace redox {
+
+template <typename tev, typename tcb> void redox_ev_init(tev ev, tcb cb) {
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wstrict-aliasing"
+  ev_init(ev, cb);
+#pragma GCC diagnostic pop
+}
+
+template <typename tev, typename tcb> void redox_ev_async_init(tev ev, tcb cb) {
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wstrict-aliasing"
+  ev_async_init(ev, cb);
+#pragma GCC diagnostic pop
+}
+
+template <typename tev, typename tcb> void redox_ev_check_init(tev ev, tcb cb) {
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wstrict-aliasing"
+  ev_check_init(ev, cb);
+#pragma GCC diagnostic pop
+}
+
+template <typename tev, typename tcb> void redox_ev_prepare_init(tev ev, tcb cb) {
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wstrict-aliasing"
+  ev_prepare_init(ev, cb);
+#pragma GCC diagnostic pop
+}
+
+template <typename tio, typename tcb> void redox_ev_io_init(tio io, tcb cb, int fd, int events) {
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wstrict-aliasing"
+  ev_io_init(io, cb, fd, events);
+#pragma GCC diagnostic pop
+}
+
+template <typename ttimer, typename tcb>
+void redox_ev_timer_init(ttimer timer, tcb cb, double after, double repeat) {
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wstrict-aliasing"
+  ev_timer_init(timer, cb, after, repeat);
+#pragma GCC diagnostic pop
+}
+
+template <typename ttimer> void redox_ev_timer_set(ttimer timer, double after, double repeat) {
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wstrict-aliasing"
+  ev_timer_set(timer, after, repeat);
+#pragma GCC diagnostic pop
+}
+
+template <typename tev> void redox_ev_set_priority(tev ev, int priority) {
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wstrict-aliasing"
+  ev_set_priority(ev, priority);
+#pragma GCC diagnostic pop
+}
+
+} // End namespace
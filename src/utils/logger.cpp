@@ -8,6 +8,9 @@
 #include "utils/logger.hpp"
 #include <iostream>
 #include <iomanip>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
 
 // needed for MSVC
 #ifdef WIN32
@@ -64,6 +67,14 @@ Logger::Logger(std::ostream &outfile, Level loglevel) :
   m_stream(outfile), m_loglevel(loglevel) {}
 
 Logger::~Logger() {
+  if (m_writer.joinable()) {
+    {
+      std::lock_guard<std::mutex> lg(m_exit_lock);
+      m_exit = true;
+    }
+    m_exit_cv.notify_all();
+    m_writer.join();
+  }
   m_stream.flush();
 }
 
@@ -73,10 +84,26 @@ const tm *Logger::getLocalTime() {
   return &m_time;
 }
 
+namespace {
+const char *LevelStr[] = {
+  "[Trace]  ", "[Debug]  ", "[Info]   ", "[Warning]", "[Error]  ", "[Fatal]  "
+};
+} // anonymous
+
 void Logger::log(Level l, std::string oMessage) {
-  const static char *LevelStr[] = {
-    "[Trace]  ", "[Debug]  ", "[Info]   ", "[Warning]", "[Error]  ", "[Fatal]  "
-  };
+
+  if (m_queue) {
+    Record r;
+    r.time = std::chrono::system_clock::now();
+    r.level = l;
+    r.len = std::min(oMessage.size(), sizeof(r.text));
+    memcpy(r.text, oMessage.data(), r.len);
+    if (oMessage.size() > sizeof(r.text))
+      memcpy(r.text + sizeof(r.text) - 3, "...", 3);
+    if (!m_queue->push(std::move(r)))
+      m_dropped++;
+    return;
+  }
 
   m_lock.lock();
   m_stream << '(' << getLocalTime() << ") "
@@ -85,5 +112,72 @@ void Logger::log(Level l, std::string oMessage) {
   m_lock.unlock();
 }
 
+void Logger::async(size_t capacity) {
+  if (m_queue)
+    return;
+  m_queue.reset(new BoundedQueue<Record>(capacity));
+  m_writer = std::thread([this] { runWriter(); });
+}
+
+void Logger::runWriter() {
+
+  std::string buf;
+  Record r;
+  long reported = 0;
+
+  // The timestamp only changes once per second
+  time_t stamp_sec = 0;
+  char stamp[80] = "";
+
+  while (true) {
+
+    size_t count = 0;
+    while ((count < 1024) && m_queue->pop(r)) {
+      time_t sec = std::chrono::system_clock::to_time_t(r.time);
+      if (sec != stamp_sec) {
+        tm t;
+        localtime_r(&sec, &t);
+        snprintf(stamp, sizeof(stamp), "%d-%02d.%02d %02d:%02d:%02d", 1900 + t.tm_year,
+                 t.tm_mon + 1, t.tm_mday, t.tm_hour, t.tm_min, t.tm_sec);
+        stamp_sec = sec;
+      }
+
+      buf += '(';
+      buf += stamp;
+      buf += ") ";
+      buf += LevelStr[r.level];
+      buf += '\t';
+      buf.append(r.text, r.len);
+      buf += '\n';
+      count++;
+    }
+
+    long dropped = m_dropped;
+    if (dropped != reported) {
+      buf += "(";
+      buf += stamp;
+      buf += ") ";
+      buf += LevelStr[Level::Warning];
+      buf += "\tDropped " + std::to_string(dropped - reported) + " log messages.\n";
+      reported = dropped;
+    }
+
+    // One write and one flush per batch
+    if (!buf.empty()) {
+      std::lock_guard<std::mutex> lg(m_lock);
+      m_stream.write(buf.data(), buf.size());
+      m_stream.flush();
+      buf.clear();
+      continue;
+    }
+
+    // Drained, exit or poll again shortly
+    if (m_exit)
+      return;
+    std::unique_lock<std::mutex> ul(m_exit_lock);
+    m_exit_cv.wait_for(ul, std::chrono::milliseconds(5), [this] { return m_exit.load(); });
+  }
+}
+
 } // End namespace
 } // End namespace
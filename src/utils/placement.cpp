@@ -0,0 +1,133 @@
+/*
+* Redox - A modern, asynchronous, and wicked fast C++11 client for Redis
+*
+*    https://github.com/hmartiro/redox
+*
+* Copyright 2015 - Hayk Martirosyan <hayk.mart at gmail dot com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dirent.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#endif
+
+#include "utils/placement.hpp"
+
+using namespace std;
+
+namespace redox {
+
+bool placeThread(const ThreadOptions &options, string &error) {
+
+  error.clear();
+  auto fail = [&error](const string &what, int err) {
+    if (!error.empty())
+      error += ", ";
+    error += what + ": " + strerror(err);
+  };
+
+  if (!options.cpus.empty()) {
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : options.cpus) {
+      if ((cpu < 0) || (cpu >= CPU_SETSIZE)) {
+        fail("CPU " + to_string(cpu), EINVAL);
+        return false;
+      }
+      CPU_SET(cpu, &set);
+    }
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (err != 0)
+      fail("setting CPU affinity", err);
+#else
+    fail("setting CPU affinity", ENOSYS);
+#endif
+  }
+
+  if (options.policy >= 0) {
+    sched_param param;
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = options.priority;
+    int err = pthread_setschedparam(pthread_self(), options.policy, &param);
+    if (err != 0)
+      fail("setting the scheduling policy", err);
+  }
+
+  // Local to where the thread runs at the time of the allocation, which once
+  // pinned does not change
+  if (options.numa_local) {
+#ifdef __linux__
+    if (syscall(SYS_set_mempolicy, MPOL_LOCAL, nullptr, 0) != 0)
+      fail("setting the memory policy", errno);
+#else
+    fail("setting the memory policy", ENOSYS);
+#endif
+  }
+
+  return error.empty();
+}
+
+int numaNode(const vector<int> &cpus) {
+
+  int node = -1;
+  for (int cpu : cpus) {
+
+    // The node is a link in the directory of the CPU
+    int found = -1;
+    string path = "/sys/devices/system/cpu/cpu" + to_string(cpu);
+    DIR *dir = opendir(path.c_str());
+    if (dir == nullptr)
+      return -1;
+    while (dirent *entry = readdir(dir)) {
+      if (!strncmp(entry->d_name, "node", 4) && isdigit(entry->d_name[4])) {
+        found = atoi(entry->d_name + 4);
+        break;
+      }
+    }
+    closedir(dir);
+
+    if ((found < 0) || ((node >= 0) && (found != node)))
+      return -1;
+    node = found;
+  }
+  return node;
+}
+
+bool bindMemory(void *addr, size_t length, int node) {
+#ifdef __linux__
+  const size_t bits = 8 * sizeof(unsigned long);
+  if ((node < 0) || (size_t(node) >= 64 * bits))
+    return false;
+
+  vector<unsigned long> mask(node / bits + 1, 0);
+  mask[node / bits] = 1UL << (node % bits);
+  return syscall(SYS_mbind, addr, length, MPOL_PREFERRED, mask.data(), mask.size() * bits + 1,
+                 MPOL_MF_MOVE) == 0;
+#else
+  return false;
+#endif
+}
+
+} // End namespace
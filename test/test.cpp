@@ -19,16 +19,41 @@
 */
 
 #include <iostream>
+#include <fstream>
+#include <sched.h>
+#include <limits>
+#include <algorithm>
 
 #include <gtest/gtest.h>
 
 #include "redox.hpp"
+#include "mock_server.hpp"
 
 namespace {
 
 using namespace std;
 using redox::Redox;
 using redox::Command;
+using redox::Subscriber;
+using redox::StreamBatch;
+using redox::StreamConsumer;
+using redox::StreamProducer;
+using redox::BoundedQueue;
+using redox::Histogram;
+using redox::MockServer;
+using redox::MetricsSnapshot;
+using redox::EventLoopGroup;
+using redox::Multiplexer;
+using redox::SlotMap;
+using redox::ShardedPublisher;
+using redox::ShardedSubscriber;
+
+// Waits up to a second for a condition to hold
+template <class Predicate> bool waitFor(Predicate done) {
+  for (int i = 0; (i < 1000) && !done(); i++)
+    this_thread::sleep_for(chrono::milliseconds(1));
+  return done();
+}
 
 // ------------------------------------------
 // The fixture for testing class Redox.
@@ -241,6 +266,142 @@ TEST_F(RedoxTest, GetSetSyncError) {
   rdx.disconnect();
 }
 
+TEST_F(RedoxTest, FireSync) {
+  connect();
+  int count = 100;
+  for (int i = 0; i < count; i++) {
+    rdx.fire({"INCR", "redox_test:a"});
+  }
+  // Fired commands keep their order with regular ones
+  print_and_check_sync(rdx.commandSync<string>({"GET", "redox_test:a"}), to_string(count));
+
+  rdx.discardReplies(true);
+  for (int i = 0; i < count; i++) {
+    rdx.fire({"INCR", "redox_test:a"});
+  }
+  print_and_check_sync(rdx.commandSync<string>({"GET", "redox_test:a"}), to_string(2 * count));
+
+  EXPECT_EQ(rdx.firedCommands(), 2 * count);
+  EXPECT_EQ(rdx.firedAcked(), 2 * count);
+  EXPECT_EQ(rdx.firedErrors(), 0);
+  rdx.disconnect();
+}
+
+TEST_F(RedoxTest, Metrics) {
+  connect();
+  rdx.collectMetrics(true);
+  int count = 100;
+  for (int i = 0; i < count; i++) {
+    rdx.commandSync({"set", "redox_test:a", to_string(i)});
+  }
+  rdx.commandSync<string>({"GET", "redox_test:nonexistent"}).free();
+
+  MetricsSnapshot m = rdx.metrics();
+  EXPECT_EQ(m.connects, 1);
+  EXPECT_EQ(m.queued, 0);
+  EXPECT_EQ(m.in_flight, 0);
+  EXPECT_GT(m.bytes_out, 0u);
+  EXPECT_GT(m.bytes_in, 0u);
+  EXPECT_EQ(m.statuses[Command<string>::OK_REPLY + 1], count + 1); // And the DEL in connect()
+  EXPECT_EQ(m.statuses[Command<string>::NIL_REPLY + 1], 1);
+
+  // Names are case-insensitive
+  bool found = false;
+  for (auto &c : m.commands) {
+    if (c.name != "SET")
+      continue;
+    found = true;
+    EXPECT_EQ(c.server.count, (uint64_t)count);
+    EXPECT_EQ(c.queued.count, (uint64_t)count);
+    EXPECT_GT(c.server.percentile(0.99), 0u);
+    EXPECT_LE(c.server.percentile(0.5), c.server.max);
+  }
+  EXPECT_TRUE(found);
+  rdx.disconnect();
+}
+
+TEST_F(RedoxTest, Timeline) {
+  string path = "/tmp/redox_test_trace.bin";
+  ASSERT_TRUE(rdx.traceFile(path));
+  connect();
+  rdx.recordTimeline(true);
+
+  int count = 10;
+  for (int i = 0; i < count; i++) {
+    rdx.command<string>({"SET", "redox_test:a", to_string(i)}, [&](Command<string> &c) {
+      const redox::CommandTimeline &t = c.timeline();
+      EXPECT_LE(t.created, t.dequeued);
+      EXPECT_LE(t.dequeued, t.submitted);
+      EXPECT_LE(t.submitted, t.flushed);
+      EXPECT_LE(t.flushed, t.parsed);
+    });
+  }
+  rdx.commandSync({"GET", "redox_test:a"});
+  rdx.disconnect();
+
+  // Tracing also covers the DEL in connect() and the GET
+  ifstream in(path, ios::binary);
+  redox::TraceRecord r;
+  int records = 0;
+  while (in.read((char *)&r, sizeof(r))) {
+    EXPECT_EQ((int)Command<string>::OK_REPLY, r.status);
+    EXPECT_LE(r.submitted, r.flushed);
+    EXPECT_LE(r.parsed, r.returned);
+    records++;
+  }
+  EXPECT_EQ(count + 2, records);
+  remove(path.c_str());
+}
+
+TEST_F(RedoxTest, StallWatchdog) {
+  connect();
+  rdx.stallThreshold(0.02);
+
+  rdx.command<string>({"GET", "redox_test:a"}, [](Command<string> &c) {
+    this_thread::sleep_for(chrono::milliseconds(50));
+  });
+  rdx.commandSync({"GET", "redox_test:a"});
+
+  // Only the callback, not also the loop iteration it was in
+  vector<redox::Stall> stalls = rdx.stalls();
+  ASSERT_EQ(1u, stalls.size());
+  EXPECT_EQ("GET redox_test:a", stalls[0].cmd);
+  EXPECT_GE(stalls[0].duration, 0.05);
+
+  redox::MetricsSnapshot m = rdx.metrics();
+  EXPECT_EQ(1, m.stalls);
+  EXPECT_GT(m.loopBusyRatio(), 0.0);
+  EXPECT_LE(m.loopBusyRatio(), 1.0);
+  rdx.disconnect();
+}
+
+TEST_F(RedoxTest, SlowLog) {
+  rdx.slowLog(0.02, 4);
+  connect();
+
+  // One at a time, so that none waits behind a slow callback. The last one
+  // is fast, and by its reply the slow one before it is logged.
+  for (int i = 0; i < 10; i++) {
+    atomic_bool done(false);
+    rdx.command<string>({"GET", "redox_test:a"}, [i, &done](Command<string> &c) {
+      if (i % 2 == 0)
+        this_thread::sleep_for(chrono::milliseconds(25));
+      done = true;
+    });
+    ASSERT_TRUE(waitFor([&done] { return done.load(); }));
+  }
+
+  // The latest slow ones only
+  vector<redox::SlowCommand> slow = rdx.slowCommands();
+  ASSERT_EQ(4u, slow.size());
+  for (auto &c : slow) {
+    EXPECT_EQ("GET redox_test:a", c.cmd);
+    EXPECT_GE(c.callback, 0.025);
+    EXPECT_GE(c.total, c.queued + c.write + c.server + c.callback - 1e-6);
+  }
+  rdx.disconnect();
+}
+
 TEST_F(RedoxTest, MultithreadedCRUD) {
   connect();
   int create_count(0);
@@ -299,6 +460,938 @@ TEST_F(RedoxTest, MultithreadedCRUD) {
   EXPECT_EQ(count, delete_count);
 }
 
+// -------------------------------------------
+// Subscriber tests
+// -------------------------------------------
+
+TEST(SubscriberTest, FastShutdown) {
+  Subscriber sub;
+  ASSERT_TRUE(sub.connect("localhost", 6379));
+
+  const int count = 10000;
+  vector<string> topics;
+  for (int i = 0; i < count; i++)
+    topics.push_back("redox_test:sub:" + to_string(i));
+
+  atomic_int subscribed = {0};
+  sub.subscribe(topics, [](const string &, const string &) {},
+                [&subscribed](const string &) { subscribed++; });
+
+  // Shutdown also waits for pending subscriptions, but we only want to time
+  // the unsubscribe and disconnect
+  for (int i = 0; (i < 5000) && (subscribed < count); i++)
+    this_thread::sleep_for(chrono::milliseconds(1));
+  ASSERT_EQ(count, subscribed);
+
+  auto t0 = chrono::steady_clock::now();
+  sub.disconnect();
+  auto dt = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - t0);
+
+  EXPECT_TRUE(sub.subscribedTopics().empty());
+  EXPECT_LT(dt.count(), 500);
+}
+
+// -------------------------------------------
+// Streams
+// -------------------------------------------
+
+TEST(StreamConsumerTest, ReadAndAck) {
+  Redox rdx;
+  ASSERT_TRUE(rdx.connect("localhost", 6379));
+  rdx.del("redox_test:stream");
+
+  StreamConsumer consumer;
+  ASSERT_TRUE(consumer.connect("localhost", 6379));
+  ASSERT_TRUE(consumer.createGroup("redox_test:stream", "redox_test", "0"));
+
+  int count = 100;
+  for (int i = 0; i < count; i++) {
+    EXPECT_TRUE(rdx.commandSync({"XADD", "redox_test:stream", "*", "n", to_string(i)}));
+  }
+
+  int received = 0;
+  mutex received_lock;
+  condition_variable received_cv;
+  consumer.start("redox_test", "c1", {"redox_test:stream"}, [&](const StreamBatch &batch) {
+    lock_guard<mutex> lg(received_lock);
+    for (size_t i = 0; i < batch.size(); i++) {
+      EXPECT_EQ(batch.fields(i), 1u);
+      EXPECT_EQ(batch.value(i, 0).str(), to_string(received++));
+    }
+    received_cv.notify_one();
+  });
+
+  {
+    unique_lock<mutex> ul(received_lock);
+    received_cv.wait_for(ul, chrono::seconds(5), [&] { return received == count; });
+  }
+  consumer.disconnect();
+
+  EXPECT_EQ(received, count);
+  EXPECT_EQ(consumer.ackedEntries(), count);
+
+  // Nothing is left pending in the group
+  Command<redisReply *> &c =
+      rdx.commandSync<redisReply *>({"XPENDING", "redox_test:stream", "redox_test"});
+  ASSERT_TRUE(c.ok());
+  EXPECT_EQ(c.reply()->element[0]->integer, 0);
+  c.free();
+
+  rdx.del("redox_test:stream");
+  rdx.disconnect();
+}
+
+TEST(StreamProducerTest, AddAndReply) {
+  Redox rdx;
+  ASSERT_TRUE(rdx.connect("localhost", 6379));
+  rdx.del("redox_test:stream");
+
+  StreamProducer producer;
+  ASSERT_TRUE(producer.connect("localhost", 6379));
+  producer.batchSize(100, 0.001);
+  producer.maxPending(250);
+
+  long count = 1000;
+  atomic_long ids = {0};
+  producer.onReply([&](const string &stream, long seq, const string &id) {
+    EXPECT_EQ(stream, "redox_test:stream");
+    EXPECT_FALSE(id.empty());
+    ids++;
+  });
+
+  for (long i = 0; i < count; i++) {
+    EXPECT_EQ(producer.add("redox_test:stream", "n", to_string(i)), i);
+  }
+  producer.disconnect();
+
+  EXPECT_EQ(producer.acked(), count);
+  EXPECT_EQ(producer.failed(), 0);
+  EXPECT_EQ(ids, count);
+  EXPECT_EQ(producer.pending(), 0);
+
+  Command<long long int> &c = rdx.commandSync<long long int>({"XLEN", "redox_test:stream"});
+  ASSERT_TRUE(c.ok());
+  EXPECT_EQ(c.reply(), count);
+  c.free();
+
+  rdx.del("redox_test:stream");
+  rdx.disconnect();
+}
+
+// -------------------------------------------
+// Against the mock server
+// -------------------------------------------
+
+TEST(MockServerTest, CannedReply) {
+  MockServer server;
+  ASSERT_TRUE(server.start());
+  server.reply("GET", MockServer::bulk("canned"));
+
+  Redox rdx;
+  ASSERT_TRUE(rdx.connect("127.0.0.1", server.port()));
+  auto &c = rdx.commandSync<string>({"get", "anything"});
+  EXPECT_TRUE(c.ok());
+  EXPECT_EQ("canned", c.reply());
+  c.free();
+  rdx.disconnect();
+}
+
+TEST(MockServerTest, SplitAndDelayedReplies) {
+  MockServer server;
+  ASSERT_TRUE(server.start());
+  server.latency(0.001, 0.002);
+  server.partialWrites(1);
+
+  Redox rdx;
+  ASSERT_TRUE(rdx.connect("127.0.0.1", server.port()));
+
+  // Replies come back in order, one byte at a time
+  int count = 100;
+  atomic_int replies(0);
+  for (int i = 0; i < count; i++) {
+    rdx.command<int>({"INCR", "counter"}, [&replies](Command<int> &c) {
+      EXPECT_TRUE(c.ok());
+      EXPECT_EQ(++replies, c.reply());
+    });
+  }
+  auto &c = rdx.commandSync<string>({"GET", "counter"});
+  EXPECT_EQ(to_string(count), c.reply());
+  c.free();
+  EXPECT_EQ(count, replies);
+  rdx.disconnect();
+}
+
+TEST(MockServerTest, Disconnect) {
+  MockServer server;
+  ASSERT_TRUE(server.start());
+  server.disconnectAfter(3);
+
+  Redox rdx;
+  atomic_int state(Redox::NOT_YET_CONNECTED);
+  ASSERT_TRUE(rdx.connect("127.0.0.1", server.port(), [&state](int s) { state = s; }));
+  EXPECT_TRUE(rdx.commandSync({"PING"}));
+  EXPECT_TRUE(rdx.commandSync({"PING"}));
+
+  // Not sync, as the event loop frees all commands as it stops
+  atomic_bool failed(false);
+  rdx.command<redisReply *>({"PING"}, [&failed](Command<redisReply *> &c) { failed = !c.ok(); });
+  rdx.wait();
+  EXPECT_TRUE(failed);
+  EXPECT_EQ((int)Redox::DISCONNECT_ERROR, state);
+}
+
+TEST(MockServerTest, StreamProducerLost) {
+  MockServer server;
+  ASSERT_TRUE(server.start());
+  server.reply("XADD", MockServer::bulk("1-0"));
+
+  StreamProducer producer(cout, redox::log::Off);
+  ASSERT_TRUE(producer.connect("127.0.0.1", server.port()));
+  producer.batchSize(1000, 0.05);
+  atomic_long ids = {0};
+  producer.onReply([&ids](const string &stream, long seq, const string &id) {
+    if (id.empty())
+      ids++;
+  });
+
+  // Buffered when the connection drops, and sent by the flush thread after
+  for (int i = 0; i < 5; i++)
+    EXPECT_EQ(i, producer.add("stream", "n", to_string(i)));
+  server.disconnectAll();
+  EXPECT_TRUE(waitFor([&] { return producer.failed() == 5; }));
+  EXPECT_EQ(5, ids);
+  EXPECT_EQ(0, producer.pending());
+
+  EXPECT_EQ(-1, producer.add("stream", "n", "lost"));
+  producer.disconnect();
+}
+
+TEST(MockServerTest, StreamConsumerBlockTime) {
+  MockServer server;
+  ASSERT_TRUE(server.start());
+
+  // Like Redis, never answers a read that blocks forever
+  mutex guard;
+  string block;
+  atomic_int reads(0);
+  server.handle("XREADGROUP", [&](const vector<string> &args) {
+    auto it = find(args.begin(), args.end(), "BLOCK");
+    string ms = (it + 1 < args.end()) ? *(it + 1) : "";
+    {
+      lock_guard<mutex> lg(guard);
+      block = ms;
+    }
+    reads++;
+    return (ms == "0") ? string() : MockServer::nil();
+  });
+
+  StreamConsumer consumer;
+  ASSERT_TRUE(consumer.connect("127.0.0.1", server.port()));
+  consumer.readSize(10, 0);
+  consumer.start("group", "c1", {"stream"}, [](const StreamBatch &) {});
+  EXPECT_TRUE(waitFor([&] { return reads > 0; }));
+
+  // Raised to 1 ms, so that the read returns and disconnect() finishes
+  consumer.disconnect();
+  lock_guard<mutex> lg(guard);
+  EXPECT_EQ("1", block);
+}
+
+TEST(MockServerTest, PubSub) {
+  MockServer server;
+  ASSERT_TRUE(server.start());
+
+  Redox rdx;
+  Subscriber sub;
+  ASSERT_TRUE(rdx.connect("127.0.0.1", server.port()));
+  ASSERT_TRUE(sub.connect("127.0.0.1", server.port()));
+
+  atomic_int received(0);
+  atomic_bool subscribed(false);
+  sub.subscribe("channel", [&received](const string &topic, const string &msg) {
+    EXPECT_EQ("message", msg);
+    received++;
+  }, [&subscribed](const string &topic) { subscribed = true; });
+  ASSERT_TRUE(waitFor([&] { return subscribed.load(); }));
+
+  for (int i = 0; i < 10; i++)
+    rdx.publish("channel", "message");
+  EXPECT_TRUE(waitFor([&] { return received == 10; }));
+
+  sub.disconnect();
+  rdx.disconnect();
+}
+
+TEST(MockServerTest, DeliveryOverflow) {
+  MockServer server;
+  ASSERT_TRUE(server.start());
+
+  Redox rdx;
+  ASSERT_TRUE(rdx.connect("127.0.0.1", server.port()));
+
+  const int count = 20;
+  for (int policy : {Subscriber::DROP_NEWEST, Subscriber::DROP_OLDEST, Subscriber::BLOCK}) {
+
+    // The consumer holds on to the first message until released
+    mutex guard;
+    vector<string> delivered;
+    atomic_bool holding(false);
+    atomic_bool release(false);
+
+    Subscriber sub;
+    sub.deliverAsync(4, 1, policy, [&](const vector<Subscriber::Message> &batch) {
+      {
+        lock_guard<mutex> lg(guard);
+        for (const Subscriber::Message &m : batch)
+          delivered.push_back(m.msg);
+      }
+      holding = true;
+      while (!release)
+        this_thread::sleep_for(chrono::milliseconds(1));
+    });
+    ASSERT_TRUE(sub.connect("127.0.0.1", server.port()));
+
+    atomic_bool subscribed(false);
+    sub.subscribe("channel", nullptr, [&subscribed](const string &) { subscribed = true; });
+    ASSERT_TRUE(waitFor([&] { return subscribed.load(); }));
+
+    rdx.publish("channel", "first");
+    ASSERT_TRUE(waitFor([&] { return holding.load(); }));
+
+    // Four fit in the queue, the rest overflow it
+    for (int i = 0; i < count; i++)
+      rdx.publish("channel", to_string(i));
+    if (policy == Subscriber::BLOCK)
+      EXPECT_TRUE(waitFor([&] { return sub.deliveryDepth() == 4; }));
+    else
+      EXPECT_TRUE(waitFor([&] { return sub.deliveryDropped() == count - 4; }));
+
+    release = true;
+    int expected = (policy == Subscriber::BLOCK) ? count + 1 : 5;
+    EXPECT_TRUE(waitFor([&] {
+      lock_guard<mutex> lg(guard);
+      return (int)delivered.size() == expected;
+    }));
+
+    lock_guard<mutex> lg(guard);
+    ASSERT_EQ(expected, (int)delivered.size());
+    EXPECT_EQ("first", delivered[0]);
+    int first = (policy == Subscriber::DROP_OLDEST) ? count - 4 : 0;
+    for (int i = 1; i < expected; i++)
+      EXPECT_EQ(to_string(first + i - 1), delivered[i]);
+    EXPECT_EQ((policy == Subscriber::BLOCK) ? 0 : count - 4, sub.deliveryDropped());
+    EXPECT_EQ(0u, sub.deliveryDepth());
+  }
+
+  rdx.disconnect();
+}
+
+TEST(MockServerTest, BulkSubscribe) {
+  MockServer server;
+  ASSERT_TRUE(server.start());
+
+  Redox rdx;
+  Subscriber sub;
+  ASSERT_TRUE(rdx.connect("127.0.0.1", server.port()));
+  ASSERT_TRUE(sub.connect("127.0.0.1", server.port()));
+
+  // Messages received by each of three handlers
+  mutex guard;
+  vector<pair<string, string>> received[3];
+  auto handler = [&guard, &received](int i) {
+    return [&guard, &received, i](const string &topic, const string &msg) {
+      lock_guard<mutex> lg(guard);
+      received[i].emplace_back(topic, msg);
+    };
+  };
+  atomic_int subscribed(0);
+  auto sub_callback = [&subscribed](const string &) { subscribed++; };
+
+  // One command per call, with c already subscribed to by the first one
+  long commands = server.commandsReceived();
+  sub.subscribe({"a", "b", "c"}, handler(0), sub_callback);
+  sub.subscribe({"c", "d"}, handler(1), sub_callback);
+  sub.psubscribe({"p.*", "q.*"}, handler(2), sub_callback);
+  ASSERT_TRUE(waitFor([&] { return subscribed == 6; }));
+  EXPECT_EQ(commands + 3, server.commandsReceived());
+  EXPECT_EQ(4u, sub.subscribedTopics().size());
+  EXPECT_EQ(2u, sub.psubscribedTopics().size());
+
+  for (const char *channel : {"a", "b", "c", "d", "p.1", "q.2", "r.3"})
+    rdx.publish(channel, string("msg:") + channel);
+  EXPECT_TRUE(waitFor([&] {
+    lock_guard<mutex> lg(guard);
+    return received[0].size() + received[1].size() + received[2].size() == 6;
+  }));
+
+  // Pattern messages come with the channel they were published to
+  {
+    lock_guard<mutex> lg(guard);
+    typedef vector<pair<string, string>> Messages;
+    EXPECT_EQ((Messages{{"a", "msg:a"}, {"b", "msg:b"}, {"c", "msg:c"}}), received[0]);
+    EXPECT_EQ((Messages{{"d", "msg:d"}}), received[1]);
+    EXPECT_EQ((Messages{{"p.1", "msg:p.1"}, {"q.2", "msg:q.2"}}), received[2]);
+  }
+
+  sub.disconnect();
+  rdx.disconnect();
+}
+
+TEST(MockServerTest, Conflated) {
+  MockServer server;
+  ASSERT_TRUE(server.start());
+
+  Redox rdx;
+  Subscriber sub;
+  ASSERT_TRUE(rdx.connect("127.0.0.1", server.port()));
+  ASSERT_TRUE(sub.connect("127.0.0.1", server.port()));
+
+  vector<string> topics = {"a", "b", "c"};
+  atomic_int subscribed(0);
+  sub.subscribeConflated(topics, [&subscribed](const string &topic) { subscribed++; });
+  ASSERT_TRUE(waitFor([&] { return subscribed == 3; }));
+
+  // One reader keeps up, the other does not drain during the burst
+  int fast = sub.conflatedReader();
+  int slow = sub.conflatedReader();
+
+  int count = 1000;
+  for (int i = 0; i < count; i++)
+    for (const string &topic : topics)
+      rdx.publish(topic, to_string(i));
+
+  // Values only move forward, up to the last one of every topic
+  map<string, int> latest;
+  EXPECT_TRUE(waitFor([&] {
+    sub.drainConflated(fast, [&latest](const string &topic, const string &msg) {
+      int value = stoi(msg);
+      EXPECT_TRUE((latest.find(topic) == latest.end()) || (value > latest[topic]));
+      latest[topic] = value;
+    });
+    for (const string &topic : topics)
+      if ((latest.find(topic) == latest.end()) || (latest[topic] != count - 1))
+        return false;
+    return true;
+  }));
+
+  // The slow reader gets each topic once, with only its latest value
+  map<string, string> drained;
+  EXPECT_EQ(3u, sub.drainConflated(slow, [&drained](const string &topic, const string &msg) {
+    EXPECT_TRUE(drained.find(topic) == drained.end());
+    drained[topic] = msg;
+  }));
+  EXPECT_EQ(3u, drained.size());
+  for (const string &topic : topics)
+    EXPECT_EQ(to_string(count - 1), drained[topic]);
+  EXPECT_EQ(0u, sub.drainConflated(slow, nullptr));
+
+  // A new reader starts out with what has been received
+  EXPECT_EQ(3u, sub.drainConflated(sub.conflatedReader(), nullptr));
+
+  sub.disconnect();
+  rdx.disconnect();
+}
+
+TEST(MockServerTest, Multiplexer) {
+  MockServer server;
+  ASSERT_TRUE(server.start());
+
+  Redox rdx;
+  Multiplexer mux;
+  ASSERT_TRUE(rdx.connect("127.0.0.1", server.port()));
+  ASSERT_TRUE(mux.connect("127.0.0.1", server.port()));
+
+  // Three listeners on one server-side subscription
+  const int n = 3;
+  atomic_int received[n];
+  const string *buffers[n];
+  long ids[n];
+  for (int i = 0; i < n; i++) {
+    received[i] = 0;
+    ids[i] = mux.listen("topic", [&received, &buffers, i](const string &topic,
+                                                          const shared_ptr<const string> &msg) {
+      EXPECT_EQ("topic", topic);
+      EXPECT_EQ("message", *msg);
+      buffers[i] = msg.get();
+      received[i]++;
+    });
+  }
+  EXPECT_EQ((size_t)n, mux.listeners("topic"));
+  ASSERT_TRUE(waitFor([&] { return mux.subscriber().subscribedTopics().count("topic") == 1; }));
+
+  auto publish = [&rdx]() {
+    Command<int> &c = rdx.commandSync<int>({"PUBLISH", "topic", "message"});
+    int receivers = c.ok() ? c.reply() : -1;
+    c.free();
+    return receivers;
+  };
+
+  // Every listener gets the same buffer
+  EXPECT_EQ(1, publish());
+  EXPECT_TRUE(waitFor([&] { return received[0] + received[1] + received[2] == 3; }));
+  EXPECT_EQ(buffers[0], buffers[1]);
+  EXPECT_EQ(buffers[0], buffers[2]);
+
+  // Listeners leave one at a time, the others keep receiving
+  mux.unlisten(ids[1]);
+  EXPECT_EQ(2u, mux.listeners("topic"));
+  EXPECT_EQ(1, publish());
+  EXPECT_TRUE(waitFor([&] { return (received[0] == 2) && (received[2] == 2); }));
+
+  mux.unlisten(ids[0]);
+  EXPECT_EQ(1u, mux.listeners("topic"));
+  EXPECT_EQ(1, publish());
+  EXPECT_TRUE(waitFor([&] { return received[2] == 3; }));
+  EXPECT_EQ(2, received[0]);
+  EXPECT_EQ(1, received[1]);
+
+  // The last one unsubscribes on the server
+  mux.unlisten(ids[2]);
+  EXPECT_EQ(0u, mux.listeners("topic"));
+  EXPECT_TRUE(waitFor([&] { return mux.subscriber().subscribedTopics().empty(); }));
+  EXPECT_EQ(0, publish());
+  EXPECT_EQ(3, received[2]);
+
+  mux.disconnect();
+  rdx.disconnect();
+}
+
+TEST(MockServerTest, MultiplexerDisconnect) {
+  MockServer server;
+  ASSERT_TRUE(server.start());
+
+  Multiplexer mux;
+  ASSERT_TRUE(mux.connect("127.0.0.1", server.port()));
+
+  auto listener = [](const string &, const shared_ptr<const string> &) {};
+  mux.listen("a", listener);
+  mux.listen("b", listener);
+  mux.plisten("c*", listener);
+  ASSERT_TRUE(waitFor([&] {
+    return (mux.subscriber().subscribedTopics().size() == 2) &&
+           (mux.subscriber().psubscribedTopics().size() == 1);
+  }));
+
+  // Only UNSUBSCRIBE and PUNSUBSCRIBE, and nothing subscribed to again
+  // for the listeners that are still attached
+  long commands = server.commandsReceived();
+  mux.disconnect();
+  this_thread::sleep_for(chrono::milliseconds(50));
+  EXPECT_EQ(commands + 2, server.commandsReceived());
+  EXPECT_EQ(2u, mux.listeners("a") + mux.listeners("b"));
+}
+
+TEST(MockServerTest, InFlight) {
+  MockServer server;
+  ASSERT_TRUE(server.start());
+
+  Redox rdx;
+  Redox publisher;
+  ASSERT_TRUE(rdx.connect("127.0.0.1", server.port()));
+  ASSERT_TRUE(publisher.connect("127.0.0.1", server.port()));
+
+  // One reply per message, but sent once. Kept around like Subscriber does.
+  atomic_int replies(0);
+  rdx.commandLoop<redisReply *>({"SUBSCRIBE", "channel"},
+                                [&replies](Command<redisReply *> &c) { replies++; }, 1e10);
+  ASSERT_TRUE(waitFor([&] { return replies == 1; }));
+  for (int i = 0; i < 5; i++)
+    publisher.publish("channel", "message");
+  EXPECT_TRUE(waitFor([&] { return replies == 6; }));
+  EXPECT_EQ(0, rdx.metrics().in_flight);
+  rdx.disconnect();
+
+  // Freed without a reply when disconnecting
+  Redox slow;
+  ASSERT_TRUE(slow.connect("127.0.0.1", server.port()));
+  server.latency(0.5);
+  for (int i = 0; i < 5; i++)
+    slow.command<redisReply *>({"PING"});
+  EXPECT_TRUE(waitFor([&] { return slow.metrics().in_flight == 5; }));
+  slow.disconnect();
+  EXPECT_EQ(0, slow.metrics().in_flight);
+
+  publisher.disconnect();
+}
+
+TEST(MockServerTest, SharedEventLoops) {
+  MockServer server;
+  ASSERT_TRUE(server.start());
+
+  EventLoopGroup group(2);
+
+  // More clients than loops, each counting on its own key
+  int n = 8;
+  vector<unique_ptr<Redox>> clients;
+  for (int i = 0; i < n; i++) {
+    clients.emplace_back(new Redox(cout, redox::log::Error));
+    clients.back()->attach(group);
+    ASSERT_TRUE(clients.back()->connect("127.0.0.1", server.port()));
+  }
+
+  Subscriber sub;
+  sub.attach(group);
+  ASSERT_TRUE(sub.connect("127.0.0.1", server.port()));
+  atomic_int received(0);
+  atomic_bool subscribed(false);
+  sub.subscribe("channel", [&received](const string &topic, const string &msg) { received++; },
+                [&subscribed](const string &topic) { subscribed = true; });
+  ASSERT_TRUE(waitFor([&] { return subscribed.load(); }));
+
+  int count = 100;
+  atomic_int replies(0);
+  for (int k = 0; k < count; k++) {
+    for (int i = 0; i < n; i++)
+      clients[i]->command<int>({"INCR", "counter:" + to_string(i)},
+                               [&replies](Command<int> &c) { replies += c.ok(); });
+  }
+  EXPECT_TRUE(waitFor([&] { return replies == n * count; }));
+  clients[0]->publish("channel", "message");
+  EXPECT_TRUE(waitFor([&] { return received == 1; }));
+
+  // A dropped connection detaches alone, the first client having sent one more
+  server.disconnectAfter(count + 2);
+  atomic_bool failed(false);
+  clients[0]->command<redisReply *>({"PING"},
+                                    [&failed](Command<redisReply *> &c) { failed = !c.ok(); });
+  clients[0]->wait();
+  EXPECT_TRUE(failed);
+  server.disconnectAfter(0);
+  EXPECT_TRUE(clients[1]->commandSync({"PING"}));
+
+  sub.disconnect();
+  for (auto &rdx : clients)
+    rdx->disconnect();
+}
+
+TEST(MockServerTest, ThreadPlacement) {
+  MockServer server;
+  ASSERT_TRUE(server.start());
+
+  // Pinned to a CPU this process may run on
+  redox::ThreadOptions options;
+  options.cpus = {sched_getcpu()};
+  options.numa_local = true;
+
+  Redox rdx;
+  rdx.threadOptions(options);
+  ASSERT_TRUE(rdx.connect("127.0.0.1", server.port()));
+
+  atomic_int cpu(-1);
+  rdx.command<string>({"PING"}, [&cpu](Command<string> &c) { cpu = sched_getcpu(); });
+  EXPECT_TRUE(waitFor([&] { return cpu >= 0; }));
+  EXPECT_EQ(options.cpus[0], cpu);
+  rdx.disconnect();
+
+  // One loop per CPU given, and none placed on a CPU that does not exist
+  EventLoopGroup group(options);
+  EXPECT_EQ(1u, group.size());
+  options.cpus = {CPU_SETSIZE};
+  EXPECT_THROW(EventLoopGroup(options, 2), runtime_error);
+}
+
+TEST(MockServerTest, FlushPolicy) {
+  MockServer server;
+  ASSERT_TRUE(server.start());
+
+  redox::FlushPolicy policy;
+  policy.max_delay_us = 300000;
+  policy.max_commands = 10;
+
+  redox::SocketOptions options;
+  options.send_buffer = 1 << 16;
+  options.keepalive_s = 60;
+
+  Redox rdx;
+  rdx.flushPolicy(policy);
+  ASSERT_TRUE(rdx.connect("127.0.0.1", server.port(), nullptr, options));
+
+  // Held back commands go out with a synchronous one, without waiting
+  int count = 100;
+  atomic_int replies(0);
+  for (int i = 0; i < count; i++)
+    rdx.command<int>({"INCR", "counter"}, [&replies](Command<int> &c) { replies += c.ok(); });
+  auto start = chrono::steady_clock::now();
+  EXPECT_TRUE(rdx.commandSync({"PING"}));
+  EXPECT_LT(chrono::steady_clock::now() - start, chrono::milliseconds(200));
+  EXPECT_EQ(count, replies);
+
+  // Alone, one is held back until the delay is up
+  start = chrono::steady_clock::now();
+  rdx.command<int>({"INCR", "counter"}, [&replies](Command<int> &c) { replies += c.ok(); });
+  EXPECT_TRUE(waitFor([&] { return replies == count + 1; }));
+  EXPECT_GE(chrono::steady_clock::now() - start, chrono::milliseconds(250));
+
+  rdx.disconnect();
+}
+
+TEST(MockServerTest, FormattedCommands) {
+  MockServer server;
+  ASSERT_TRUE(server.start());
+
+  Redox rdx;
+  ASSERT_TRUE(rdx.connect("127.0.0.1", server.port()));
+
+  string key = "counter";
+  atomic_int reply(0);
+  rdx.command<int>(redox::cmd("INCRBY", key, 42), [&reply](Command<int> &c) {
+    EXPECT_EQ("INCRBY counter 42", c.cmd());
+    reply = c.reply();
+  });
+  EXPECT_TRUE(waitFor([&] { return reply == 42; }));
+
+  Command<int> &c = rdx.commandSync<int>(redox::cmd("INCRBY", key, -50));
+  EXPECT_TRUE(c.ok());
+  EXPECT_EQ(-8, c.reply());
+  c.free();
+
+  // Borrowed bytes, with a zero in them
+  const char value[] = {'a', '\0', 'b'};
+  EXPECT_TRUE(rdx.commandSync(redox::cmd("SET", "key", redox::View(value, sizeof(value)))));
+  Command<string> &bytes = rdx.commandSync<string>(redox::cmd("GET", "key"));
+  EXPECT_EQ(string(value, sizeof(value)), bytes.reply());
+  bytes.free();
+
+  rdx.fire(redox::cmd("INCR", key));
+  Command<string> &get = rdx.commandSync<string>(redox::cmd("GET", key));
+  EXPECT_EQ("-7", get.reply());
+  get.free();
+
+  rdx.disconnect();
+}
+
+TEST(MockServerTest, ScatterGather) {
+  MockServer server;
+  ASSERT_TRUE(server.start());
+
+  // A small send buffer, so that the values take many writes
+  redox::SocketOptions options;
+  options.send_buffer = 4096;
+
+  Redox rdx;
+  ASSERT_TRUE(rdx.connect("127.0.0.1", server.port(), nullptr, options));
+
+  // In pieces, with counters in between
+  string head(100000, 'h');
+  string tail(50000, 't');
+  struct iovec pieces[] = {{(void *)head.data(), head.size()}, {(void *)tail.data(), tail.size()}};
+  atomic_int released(0);
+  atomic_int replies(0);
+  rdx.command<string>(redox::cmd("SET", "big", redox::Buffer(pieces, 2, [&] { released++; })),
+                      [&replies](Command<string> &c) {
+                        EXPECT_EQ("SET big <150000 bytes>", c.cmd());
+                        EXPECT_TRUE(c.ok());
+                        replies++;
+                      });
+  for (int i = 0; i < 100; i++)
+    rdx.command<int>(redox::cmd("INCR", "counter"), [&replies](Command<int> &c) { replies++; });
+  EXPECT_TRUE(waitFor([&] { return replies == 101; }));
+  EXPECT_TRUE(waitFor([&] { return released == 1; }));
+  EXPECT_EQ(head + tail, rdx.get("big"));
+  EXPECT_EQ("100", rdx.get("counter"));
+
+  // Small ones are copied, and released right away
+  string small(100, 's');
+  EXPECT_TRUE(rdx.commandSync(
+      redox::cmd("SET", "small", redox::Buffer(small.data(), small.size(), [&] { released++; }))));
+  EXPECT_EQ(2, released);
+  EXPECT_EQ(small, rdx.get("small"));
+
+  rdx.disconnect();
+}
+
+TEST(MockServerTest, ShardedRedirect) {
+  MockServer first;
+  MockServer second;
+  ASSERT_TRUE(first.start());
+  ASSERT_TRUE(second.start());
+
+  // The first node owns every slot, after a malformed entry that is skipped
+  first.reply("CLUSTER", "*2\r\n"
+                         "*3\r\n:0\r\n:16383\r\n*2\r\n:1\r\n:2\r\n"
+                         "*3\r\n:0\r\n:16383\r\n*2\r\n$9\r\n127.0.0.1\r\n:" +
+                             to_string(first.port()) + "\r\n");
+
+  // But the slot of the topic has moved to the second one
+  string second_addr = "127.0.0.1:" + to_string(second.port());
+  int slot = SlotMap::keySlot("topic");
+  first.reply("SPUBLISH", MockServer::error("MOVED " + to_string(slot) + " " + second_addr));
+
+  atomic_int published(0);
+  second.handle("SPUBLISH", [&published](const vector<string> &args) {
+    EXPECT_EQ("topic", args[1]);
+    EXPECT_EQ("msg", args[2]);
+    published++;
+    return MockServer::integer(1);
+  });
+
+  ShardedPublisher pub;
+  ASSERT_TRUE(pub.connect("127.0.0.1", first.port()));
+
+  // Resent to the second node, which it connects to off of the event loop
+  pub.spublish("topic", "msg");
+  EXPECT_TRUE(waitFor([&] { return published == 1; }));
+
+  // And sent there directly from then on
+  long redirects = first.commandsReceived();
+  pub.spublish("topic", "msg");
+  EXPECT_TRUE(waitFor([&] { return published == 2; }));
+  EXPECT_EQ(redirects, first.commandsReceived());
+
+  pub.disconnect();
+}
+
+TEST(MockServerTest, ShardedUnownedSlot) {
+  MockServer server;
+  ASSERT_TRUE(server.start());
+
+  // Only slot 0 is assigned
+  server.reply("CLUSTER", "*1\r\n*3\r\n:0\r\n:0\r\n*2\r\n$9\r\n127.0.0.1\r\n:" +
+                              to_string(server.port()) + "\r\n");
+
+  ShardedSubscriber sub;
+  ASSERT_TRUE(sub.connect("127.0.0.1", server.port()));
+
+  // The error callback can call back into the subscriber
+  bool failed = false;
+  sub.ssubscribe("foo", [](const string &, const string &) {}, nullptr,
+                 [&sub, &failed](const string &topic, int status) {
+                   EXPECT_EQ("foo", topic);
+                   EXPECT_TRUE(sub.ssubscribedTopics().empty());
+                   failed = true;
+                 });
+  EXPECT_TRUE(failed);
+
+  sub.disconnect();
+}
+
+TEST(MockServerTest, IoUring) {
+  MockServer server;
+  ASSERT_TRUE(server.start());
+  server.partialWrites(1000);
+
+  // Small buffers, so that values span many reads and writes
+  redox::IoUringOptions options;
+  options.buffer_size = 4096;
+
+  Redox rdx;
+  if (!rdx.ioUring(true, options)) {
+    cout << "io_uring is not available, skipping." << endl;
+    return;
+  }
+  atomic_int state(Redox::NOT_YET_CONNECTED);
+  ASSERT_TRUE(rdx.connect("127.0.0.1", server.port(), [&state](int s) { state = s; }));
+
+  string value(100000, 'v');
+  EXPECT_TRUE(rdx.set("key", value));
+  EXPECT_EQ(value, rdx.get("key"));
+
+  int count = 1000;
+  atomic_int replies(0);
+  for (int i = 0; i < count; i++) {
+    rdx.command<int>({"INCR", "counter"}, [&replies](Command<int> &c) {
+      EXPECT_TRUE(c.ok());
+      EXPECT_EQ(++replies, c.reply());
+    });
+  }
+  EXPECT_TRUE(waitFor([&] { return replies == count; }));
+
+  // Losing the connection goes through hiredis as with libev
+  server.disconnectAll();
+  rdx.wait();
+  EXPECT_EQ((int)Redox::DISCONNECT_ERROR, state);
+}
+
+// -------------------------------------------
+// Utilities
+// -------------------------------------------
+
+TEST(BoundedQueueTest, FullAndEmpty) {
+  BoundedQueue<string> q(3); // Rounded up to 4
+  EXPECT_EQ(4u, q.capacity());
+
+  string s;
+  EXPECT_FALSE(q.pop(s));
+  for (int i = 0; i < 4; i++)
+    EXPECT_TRUE(q.push(to_string(i)));
+  EXPECT_FALSE(q.push("full"));
+  EXPECT_EQ(4u, q.size());
+
+  for (int i = 0; i < 4; i++) {
+    ASSERT_TRUE(q.pop(s));
+    EXPECT_EQ(to_string(i), s);
+  }
+  EXPECT_FALSE(q.pop(s));
+  EXPECT_EQ(0u, q.size());
+}
+
+TEST(SlotMapTest, KeySlot) {
+  EXPECT_EQ(12182, SlotMap::keySlot("foo"));
+  EXPECT_EQ(0, SlotMap::keySlot(""));
+
+  // Only the hash tag is hashed, if it is not empty
+  EXPECT_EQ(SlotMap::keySlot("user"), SlotMap::keySlot("{user}a"));
+  EXPECT_EQ(SlotMap::keySlot("{user}a"), SlotMap::keySlot("{user}b"));
+  EXPECT_NE(SlotMap::keySlot("{}a"), SlotMap::keySlot("{}b"));
+}
+
+TEST(RespTest, CommandArgs) {
+
+  // Same as through a vector of strings
+  string key = "key";
+  char buffer[16] = "buffer";
+  static const char padded[16] = "padded";
+  const char *str = "str";
+  string out;
+  redox::resp::appendCommandArgs(out, "SET", key, buffer, padded, str, 0, -12, 3000000000u,
+                                 numeric_limits<long long>::min());
+  string expected;
+  redox::resp::appendCommand(expected, {"SET", "key", "buffer", "padded", "str", "0", "-12",
+                                        "3000000000", to_string(numeric_limits<long long>::min())});
+  EXPECT_EQ(expected, out);
+  EXPECT_EQ(9u, redox::resp::parseCommand(out).size());
+  EXPECT_EQ(vector<string>{"SET"}, redox::resp::parseCommand(out, 1));
+}
+
+TEST(HistogramTest, Percentiles) {
+  Histogram h;
+  for (uint64_t v = 1; v <= 1000; v++)
+    h.record(v * 1000);
+
+  Histogram::Snapshot s = h.snapshot();
+  EXPECT_EQ(1000u, s.count);
+  EXPECT_EQ(1000000u, s.max);
+  EXPECT_DOUBLE_EQ(500500.0, s.mean());
+
+  // Within the bucket resolution of about 6%
+  EXPECT_NEAR(500000.0, (double)s.percentile(0.5), 500000 * 0.07);
+  EXPECT_NEAR(990000.0, (double)s.percentile(0.99), 990000 * 0.07);
+  EXPECT_EQ(1000000u, s.percentile(1.0));
+
+  s.merge(h.snapshot());
+  EXPECT_EQ(2000u, s.count);
+}
+
+TEST(LoggerTest, AsyncDrops) {
+  ostringstream out;
+  int count = 100;
+  long dropped;
+  {
+    redox::log::Logger logger(out, redox::log::Info);
+    logger.async(16);
+    for (int i = 0; i < count; i++)
+      logger.info() << "message " << i;
+    dropped = logger.dropped();
+  }
+
+  // Everything is either written out by the destructor or counted
+  string s = out.str();
+  int written = 0;
+  for (size_t pos = 0; (pos = s.find("message ", pos)) != string::npos; pos++)
+    written++;
+  EXPECT_EQ(written + dropped, count);
+}
+
 // -------------------------------------------
 // End tests
 // -------------------------------------------